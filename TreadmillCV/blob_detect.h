@@ -0,0 +1,166 @@
+// Streaming connected components over a binary mask, fed one row at a time. Each row is cut
+// into runs of set pixels, runs that touch a run on the row above (8-connected, like
+// findContours) are merged with union-find, and per-component area, bounding box and centroid
+// sums are kept as the components grow. Nothing is traced and no contour is allocated.
+//
+// The caller stops feeding rows as soon as add_row() reports a finished blob bigger than the
+// minimum area, so on most frames only the rows down to the bottom of the dot are ever looked at.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+struct Blob {
+    int area = 0;  // in pixels
+    int minX = 0, minY = 0, maxX = 0, maxY = 0;
+    int64_t sumX = 0, sumY = 0;
+
+    double centroid_x() const { return (double)sumX / area; }
+    double centroid_y() const { return (double)sumY / area; }
+};
+
+class BlobDetector {
+public:
+    // Start a new mask, width pixels per row; blobs of more than minArea pixels are reported
+    void reset(int width, int minArea) {
+        width_ = width;
+        minArea_ = minArea;
+        found_ = -1;
+        largestArea_ = 0;
+        y_ = 0;
+        previous_.clear();
+        current_.clear();
+        parent_.clear();
+        blobs_.clear();
+    }
+
+    // Feed the next mask row (bytes are 0 or nonzero). Returns true once a blob of more than
+    // minArea pixels has been seen and the row just fed no longer touches it, i.e. it is complete.
+    bool add_row(const uint8_t* mask) {
+        int y = y_++;
+        current_.clear();
+        find_runs(mask, y);
+        link_runs();
+
+        bool complete = true;
+        for (const Run& run : current_) {
+            int root = find(run.label);
+            if (found_ < 0 && blobs_[root].area > minArea_)
+                found_ = root;
+            if (found_ >= 0 && root == find(found_))
+                complete = false;
+        }
+        previous_.swap(current_);
+        return found_ >= 0 && complete;
+    }
+
+    // Call after the last row; true if a big enough blob was found, even one touching the bottom
+    bool finish() const { return found_ >= 0; }
+
+    const Blob& blob() const {
+        int label = found_;
+        while (parent_[label] != label)
+            label = parent_[label];
+        return blobs_[label];
+    }
+
+    // Area of the biggest component seen so far, for display when nothing was big enough
+    int largest_area() const { return largestArea_; }
+
+private:
+    struct Run {
+        int start, end;  // inclusive
+        int label;
+    };
+
+    void find_runs(const uint8_t* mask, int y) {
+        int x = 0;
+        while (x < width_) {
+            // Skip background eight pixels at a time; the dot covers a tiny part of any row
+            while (x + 8 <= width_) {
+                uint64_t word;
+                memcpy(&word, mask + x, 8);
+                if (word != 0)
+                    break;
+                x += 8;
+            }
+            while (x < width_ && mask[x] == 0)
+                x++;
+            if (x >= width_)
+                break;
+            int start = x;
+            while (x < width_ && mask[x] != 0)
+                x++;
+            add_run(start, x - 1, y);
+        }
+    }
+
+    void add_run(int start, int end, int y) {
+        int label = (int)parent_.size();
+        parent_.push_back(label);
+        Blob blob;
+        blob.area = end - start + 1;
+        blob.minX = start;
+        blob.maxX = end;
+        blob.minY = blob.maxY = y;
+        blob.sumX = (int64_t)(start + end) * blob.area / 2;
+        blob.sumY = (int64_t)y * blob.area;
+        blobs_.push_back(blob);
+        current_.push_back({start, end, label});
+        if (blob.area > largestArea_)
+            largestArea_ = blob.area;
+    }
+
+    // Merge every run with the runs above it; both lists are sorted by start, so one sweep does it
+    void link_runs() {
+        size_t j = 0;
+        for (const Run& run : current_) {
+            while (j < previous_.size() && previous_[j].end < run.start - 1)
+                j++;
+            for (size_t k = j; k < previous_.size() && previous_[k].start <= run.end + 1; k++)
+                unite(run.label, previous_[k].label);
+        }
+    }
+
+    int find(int label) {
+        while (parent_[label] != label) {
+            parent_[label] = parent_[parent_[label]];
+            label = parent_[label];
+        }
+        return label;
+    }
+
+    void unite(int a, int b) {
+        a = find(a);
+        b = find(b);
+        if (a == b)
+            return;
+        // Keep the older label as the root so a found blob keeps its identity
+        if (b > a)
+            std::swap(a, b);
+        parent_[a] = b;
+        Blob& into = blobs_[b];
+        const Blob& from = blobs_[a];
+        into.area += from.area;
+        into.minX = std::min(into.minX, from.minX);
+        into.maxX = std::max(into.maxX, from.maxX);
+        into.minY = std::min(into.minY, from.minY);
+        into.maxY = std::max(into.maxY, from.maxY);
+        into.sumX += from.sumX;
+        into.sumY += from.sumY;
+        if (into.area > largestArea_)
+            largestArea_ = into.area;
+    }
+
+    int width_ = 0;
+    int minArea_ = 0;
+    int found_ = -1;
+    int largestArea_ = 0;
+    int y_ = 0;
+    std::vector<Run> previous_, current_;
+    std::vector<int> parent_;
+    std::vector<Blob> blobs_;
+};
@@ -0,0 +1,193 @@
+// Fits the dot's threshold bounds to what the camera actually sees, instead of hand tuning them
+// with the mouse-over readout. Pixels of the dot and of the background are collected over a few
+// seconds of frames; per-channel histograms of the dot give bounds that just cover it, with a
+// sliver cut off each tail as noise, and the background samples tell how much of the belt those
+// bounds would still let through.
+//
+// Hue is circular, so its histogram is cut at the widest empty gap rather than at 0. A red dot,
+// whose hues straddle 0, comes out as two ranges just like the hand-tuned red bounds.
+
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "color_threshold.h"
+
+const double CALIBRATION_TAIL = 0.005;        // fraction of dot pixels dropped off each end of a channel
+const int CALIBRATION_HUE_PADDING = 2;        // added around the fitted hue range
+const int CALIBRATION_PADDING = 10;           // added around every other fitted channel range
+const size_t CALIBRATION_MAX_BACKGROUND = 1 << 20;  // background samples kept
+
+class ColorCalibrator {
+public:
+    explicit ColorCalibrator(bool hsv) : hsv_(hsv) { memset(histograms_, 0, sizeof(histograms_)); }
+
+    void add_dot(int b, int g, int r) {
+        int c[3] = {b, g, r};
+        if (hsv_)
+            bgr_to_hsv_pixel(b, g, r, c[0], c[1], c[2]);
+        if (hsv_ && c[0] >= 180)
+            c[0] -= 180;  // rounding can land on 180, which is the same hue as 0
+        for (int i = 0; i < 3; i++)
+            histograms_[i][c[i]]++;
+        dotPixels_++;
+    }
+
+    void add_background(int b, int g, int r) {
+        if (background_.size() < CALIBRATION_MAX_BACKGROUND)
+            background_.push_back({(uint8_t)b, (uint8_t)g, (uint8_t)r});
+    }
+
+    uint64_t dot_pixels() const { return dotPixels_; }
+
+    // Bounds that cover the dot pixels seen; false if there were none
+    bool fit(ThresholdParams& params) const {
+        if (dotPixels_ == 0)
+            return false;
+        params = ThresholdParams();
+        params.hsv = hsv_;
+
+        int lower[3], upper[3];
+        for (int i = hsv_ ? 1 : 0; i < 3; i++) {
+            channel_bounds(histograms_[i], 256, lower[i], upper[i]);
+            lower[i] = std::max(lower[i] - CALIBRATION_PADDING, 0);
+            upper[i] = std::min(upper[i] + CALIBRATION_PADDING, 255);
+        }
+        if (!hsv_) {
+            params.ranges[0] = make_range(lower, upper);
+            return true;
+        }
+
+        // Rotate the hue circle so it starts right after its widest gap, then fit as usual
+        int start = widest_gap_end(histograms_[0]);
+        uint64_t rotated[180];
+        for (int k = 0; k < 180; k++)
+            rotated[k] = histograms_[0][(start + k) % 180];
+        int low, high;
+        channel_bounds(rotated, 180, low, high);
+        int span = std::min(high - low + 2 * CALIBRATION_HUE_PADDING, 179);
+        lower[0] = start + low - CALIBRATION_HUE_PADDING;
+        if (lower[0] < 0)
+            lower[0] += 180;
+        else if (lower[0] >= 180)
+            lower[0] -= 180;
+        upper[0] = lower[0] + span;
+
+        if (upper[0] < 180) {
+            params.ranges[0] = make_range(lower, upper);
+        } else {
+            int wrappedUpper = upper[0] - 180;
+            upper[0] = 180;
+            params.ranges[0] = make_range(lower, upper);
+            lower[0] = 0;
+            upper[0] = wrappedUpper;
+            params.ranges[1] = make_range(lower, upper);
+            params.rangeCount = 2;
+        }
+        return true;
+    }
+
+    // Fraction of the background samples that params would mark as dot
+    double background_fraction(const ThresholdParams& params) const {
+        if (background_.empty())
+            return 0;
+        size_t matched = 0;
+        for (const Sample& sample : background_)
+            matched += threshold_pixel(sample.b, sample.g, sample.r, params);
+        return (double)matched / background_.size();
+    }
+
+private:
+    struct Sample {
+        uint8_t b, g, r;
+    };
+
+    static ThresholdRange make_range(const int lower[3], const int upper[3]) {
+        ThresholdRange range;
+        for (int i = 0; i < 3; i++) {
+            range.lower[i] = (uint8_t)lower[i];
+            range.upper[i] = (uint8_t)upper[i];
+        }
+        return range;
+    }
+
+    // Smallest range holding all but CALIBRATION_TAIL of the samples at each end
+    void channel_bounds(const uint64_t* histogram, int bins, int& lower, int& upper) const {
+        uint64_t cut = (uint64_t)(dotPixels_ * CALIBRATION_TAIL);
+        uint64_t seen = 0;
+        for (lower = 0; lower < bins - 1 && seen + histogram[lower] <= cut; lower++)
+            seen += histogram[lower];
+        seen = 0;
+        for (upper = bins - 1; upper > lower && seen + histogram[upper] <= cut; upper--)
+            seen += histogram[upper];
+    }
+
+    // First hue bin after the longest circular run of empty bins
+    static int widest_gap_end(const uint64_t* hue) {
+        int best = 0, bestLength = -1;
+        for (int start = 0; start < 180; start++) {
+            if (hue[start] != 0 || hue[(start + 179) % 180] == 0)
+                continue;  // not the start of a gap
+            int length = 0;
+            while (length < 180 && hue[(start + length) % 180] == 0)
+                length++;
+            if (length > bestLength) {
+                bestLength = length;
+                best = (start + length) % 180;
+            }
+        }
+        return bestLength < 0 ? 0 : best;
+    }
+
+    bool hsv_;
+    uint64_t histograms_[3][256];
+    uint64_t dotPixels_ = 0;
+    std::vector<Sample> background_;
+};
+
+// Bounds are saved as text: "hsv" or "bgr", then one "lower0 lower1 lower2 upper0 upper1 upper2"
+// line per range
+inline bool save_threshold_params(const std::string& path, const ThresholdParams& params) {
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == nullptr)
+        return false;
+    fprintf(file, "%s\n", params.hsv ? "hsv" : "bgr");
+    for (int i = 0; i < params.rangeCount; i++) {
+        const ThresholdRange& range = params.ranges[i];
+        fprintf(file, "%d %d %d %d %d %d\n", range.lower[0], range.lower[1], range.lower[2],
+                range.upper[0], range.upper[1], range.upper[2]);
+    }
+    return fclose(file) == 0;
+}
+
+inline bool load_threshold_params(const std::string& path, ThresholdParams& params) {
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == nullptr)
+        return false;
+    char space[8] = "";
+    bool ok = fscanf(file, "%7s", space) == 1 && (strcmp(space, "hsv") == 0 || strcmp(space, "bgr") == 0);
+    ThresholdParams loaded;
+    loaded.hsv = strcmp(space, "hsv") == 0;
+    loaded.rangeCount = 0;
+    int c[6];
+    while (ok && loaded.rangeCount < 2 &&
+           fscanf(file, "%d %d %d %d %d %d", &c[0], &c[1], &c[2], &c[3], &c[4], &c[5]) == 6) {
+        for (int i = 0; i < 6; i++)
+            ok = ok && c[i] >= 0 && c[i] <= 255;
+        loaded.ranges[loaded.rangeCount++] = {{(uint8_t)c[0], (uint8_t)c[1], (uint8_t)c[2]},
+                                              {(uint8_t)c[3], (uint8_t)c[4], (uint8_t)c[5]}};
+    }
+    fclose(file);
+    if (!ok || loaded.rangeCount == 0) {
+        errno = EINVAL;
+        return false;
+    }
+    params = loaded;
+    return true;
+}
@@ -0,0 +1,262 @@
+// Fused color threshold kernels: BGR pixels in, 0/255 mask bytes out, with no intermediate HSV
+// image. The HSV conversion is OpenCV's 8-bit one, table for table, so the mask is exactly what
+// cvtColor(COLOR_BGR2HSV) followed by inRange() (and bitwise_or() for a second range) produces.
+// Build with -mavx2 (or -march=native) to get the vector kernel; otherwise the scalar one runs.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Inclusive per-channel bounds, in H,S,V order (or B,G,R order when thresholding BGR directly)
+struct ThresholdRange {
+    uint8_t lower[3];
+    uint8_t upper[3];
+};
+
+// A pixel passes if it falls in any of the ranges; red wraps around the hue circle and needs two
+struct ThresholdParams {
+    bool hsv = true;
+    int rangeCount = 1;
+    ThresholdRange ranges[2] = {};
+};
+
+// OpenCV's fixed point division tables for 8-bit BGR to HSV (hue scaled to 0..180)
+const int HSV_SHIFT = 12;
+
+struct HsvTables {
+    int32_t sdiv[256];
+    int32_t hdiv[256];
+
+    HsvTables() {
+        sdiv[0] = hdiv[0] = 0;
+        for (int i = 1; i < 256; i++) {
+            sdiv[i] = (int32_t)((255 << HSV_SHIFT) / (1.0 * i) + 0.5);
+            hdiv[i] = (int32_t)((180 << HSV_SHIFT) / (6.0 * i) + 0.5);
+        }
+    }
+};
+
+inline const HsvTables gHsvTables;
+
+inline void bgr_to_hsv_pixel(int b, int g, int r, int& h, int& s, int& v) {
+    v = b > g ? b : g;
+    v = v > r ? v : r;
+    int vmin = b < g ? b : g;
+    vmin = vmin < r ? vmin : r;
+    int diff = v - vmin;
+    s = (diff * gHsvTables.sdiv[v] + (1 << (HSV_SHIFT - 1))) >> HSV_SHIFT;
+    if (v == r)
+        h = g - b;
+    else if (v == g)
+        h = b - r + 2 * diff;
+    else
+        h = r - g + 4 * diff;
+    h = (h * gHsvTables.hdiv[diff] + (1 << (HSV_SHIFT - 1))) >> HSV_SHIFT;
+    h += h < 0 ? 180 : 0;
+}
+
+inline bool threshold_pixel(int b, int g, int r, const ThresholdParams& params) {
+    int c[3] = {b, g, r};
+    if (params.hsv)
+        bgr_to_hsv_pixel(b, g, r, c[0], c[1], c[2]);
+    for (int i = 0; i < params.rangeCount; i++) {
+        const ThresholdRange& range = params.ranges[i];
+        if (c[0] >= range.lower[0] && c[0] <= range.upper[0] &&
+            c[1] >= range.lower[1] && c[1] <= range.upper[1] &&
+            c[2] >= range.lower[2] && c[2] <= range.upper[2])
+            return true;
+    }
+    return false;
+}
+
+inline void threshold_row_scalar(const uint8_t* bgr, uint8_t* mask, int width, const ThresholdParams& params) {
+    for (int x = 0; x < width; x++, bgr += 3)
+        mask[x] = threshold_pixel(bgr[0], bgr[1], bgr[2], params) ? 255 : 0;
+}
+
+#if defined(__AVX2__)
+
+// All-ones in the lanes where lower <= value <= upper, for 8 lanes of 32-bit values
+inline __m256i in_bounds_epi32(__m256i value, int lower, int upper) {
+    __m256i outside = _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(lower), value),
+                                      _mm256_cmpgt_epi32(value, _mm256_set1_epi32(upper)));
+    return _mm256_xor_si256(outside, _mm256_set1_epi32(-1));
+}
+
+// Threshold 8 pixels whose channels are already widened to 32 bits; returns 0/-1 per lane
+inline __m256i threshold_8_avx2(__m256i c0, __m256i c1, __m256i c2, const ThresholdParams& params) {
+    if (params.hsv) {
+        __m256i b = c0, g = c1, r = c2;
+        __m256i v = _mm256_max_epi32(_mm256_max_epi32(b, g), r);
+        __m256i vmin = _mm256_min_epi32(_mm256_min_epi32(b, g), r);
+        __m256i diff = _mm256_sub_epi32(v, vmin);
+        __m256i round = _mm256_set1_epi32(1 << (HSV_SHIFT - 1));
+
+        __m256i sdiv = _mm256_i32gather_epi32(gHsvTables.sdiv, v, 4);
+        __m256i s = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(diff, sdiv), round), HSV_SHIFT);
+
+        __m256i hueR = _mm256_sub_epi32(g, b);
+        __m256i hueG = _mm256_add_epi32(_mm256_sub_epi32(b, r), _mm256_add_epi32(diff, diff));
+        __m256i hueB = _mm256_add_epi32(_mm256_sub_epi32(r, g), _mm256_slli_epi32(diff, 2));
+        __m256i h = _mm256_blendv_epi8(hueB, hueG, _mm256_cmpeq_epi32(v, g));
+        h = _mm256_blendv_epi8(h, hueR, _mm256_cmpeq_epi32(v, r));
+        __m256i hdiv = _mm256_i32gather_epi32(gHsvTables.hdiv, diff, 4);
+        h = _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(h, hdiv), round), HSV_SHIFT);
+        h = _mm256_add_epi32(h, _mm256_and_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), h), _mm256_set1_epi32(180)));
+
+        c0 = h;
+        c1 = s;
+        c2 = v;
+    }
+
+    __m256i result = _mm256_setzero_si256();
+    for (int i = 0; i < params.rangeCount; i++) {
+        const ThresholdRange& range = params.ranges[i];
+        __m256i in = _mm256_and_si256(in_bounds_epi32(c0, range.lower[0], range.upper[0]),
+                                      in_bounds_epi32(c1, range.lower[1], range.upper[1]));
+        in = _mm256_and_si256(in, in_bounds_epi32(c2, range.lower[2], range.upper[2]));
+        result = _mm256_or_si256(result, in);
+    }
+    return result;
+}
+
+// pshufb control that gathers one channel's bytes out of one 16-byte third of 16 BGR pixels
+inline __m128i deinterleave_control(int channel, int part) {
+    alignas(16) int8_t control[16];
+    for (int j = 0; j < 16; j++) {
+        int index = 3 * j + channel - 16 * part;
+        control[j] = (index >= 0 && index < 16) ? (int8_t)index : -1;
+    }
+    return _mm_load_si128((const __m128i*)control);
+}
+
+inline void threshold_row_avx2(const uint8_t* bgr, uint8_t* mask, int width, const ThresholdParams& params) {
+    __m128i control[3][3];
+    for (int channel = 0; channel < 3; channel++)
+        for (int part = 0; part < 3; part++)
+            control[channel][part] = deinterleave_control(channel, part);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const __m128i* src = (const __m128i*)(bgr + 3 * x);
+        __m128i a0 = _mm_loadu_si128(src), a1 = _mm_loadu_si128(src + 1), a2 = _mm_loadu_si128(src + 2);
+        __m128i channels[3];
+        for (int channel = 0; channel < 3; channel++)
+            channels[channel] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a0, control[channel][0]),
+                                                          _mm_shuffle_epi8(a1, control[channel][1])),
+                                             _mm_shuffle_epi8(a2, control[channel][2]));
+
+        __m256i low = threshold_8_avx2(_mm256_cvtepu8_epi32(channels[0]), _mm256_cvtepu8_epi32(channels[1]),
+                                       _mm256_cvtepu8_epi32(channels[2]), params);
+        __m256i high = threshold_8_avx2(_mm256_cvtepu8_epi32(_mm_srli_si128(channels[0], 8)),
+                                        _mm256_cvtepu8_epi32(_mm_srli_si128(channels[1], 8)),
+                                        _mm256_cvtepu8_epi32(_mm_srli_si128(channels[2], 8)), params);
+
+        // packs works within 128-bit lanes, so put the four 4-pixel groups back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), 0xD8);
+        __m128i bytes = _mm_packs_epi16(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1));
+        _mm_storeu_si128((__m128i*)(mask + x), bytes);
+    }
+    threshold_row_scalar(bgr + 3 * x, mask + x, width - x, params);
+}
+
+#endif
+
+// Threshold one row of width BGR pixels into width mask bytes
+inline void threshold_row(const uint8_t* bgr, uint8_t* mask, int width, const ThresholdParams& params) {
+#if defined(__AVX2__)
+    threshold_row_avx2(bgr, mask, width, params);
+#else
+    threshold_row_scalar(bgr, mask, width, params);
+#endif
+}
+
+// OpenCV's fixed point BT.601 conversion from video range YUV, as used by
+// cvtColor(COLOR_YUV2BGR_YUYV) and cvtColor(COLOR_YUV2BGR_NV12)
+const int YUV_SHIFT = 20;
+
+inline void yuv_to_bgr_pixel(int y, int u, int v, uint8_t bgr[3]) {
+    const int CY = 1220542, CUB = 2116026, CUG = -409993, CVG = -852492, CVR = 1673527;
+    int luma = (y > 16 ? y - 16 : 0) * CY;
+    u -= 128;
+    v -= 128;
+    int round = 1 << (YUV_SHIFT - 1);
+    int channels[3] = {(luma + round + CUB * u) >> YUV_SHIFT,
+                       (luma + round + CVG * v + CUG * u) >> YUV_SHIFT,
+                       (luma + round + CVR * v) >> YUV_SHIFT};
+    for (int i = 0; i < 3; i++)
+        bgr[i] = (uint8_t)(channels[i] < 0 ? 0 : channels[i] > 255 ? 255 : channels[i]);
+}
+
+// The whole 24-bit color cube precomputed as one bit per color (2MB). Worth it when the
+// bounds are fixed for a long run: a lookup replaces the HSV math and every range test.
+// Built over YUV instead, it thresholds camera YUV directly with exactly the result of
+// converting to BGR first, which is how the YUYV and NV12 paths stay equivalent to the HSV bounds.
+class ColorLut {
+public:
+    void build(const ThresholdParams& params) { build(params, false); }
+    void build_yuv(const ThresholdParams& params) { build(params, true); }
+
+    bool empty() const { return bits_.empty(); }
+
+    // Indexed by (r, g, b) for a BGR table or (y, u, v) for a YUV one
+    bool lookup(int c2, int c1, int c0) const {
+        uint32_t color = (uint32_t)(c2 << 16) | (uint32_t)(c1 << 8) | (uint32_t)c0;
+        return (bits_[color / 64] >> (color % 64)) & 1;
+    }
+
+    void threshold_row(const uint8_t* bgr, uint8_t* mask, int width) const {
+        for (int x = 0; x < width; x++, bgr += 3)
+            mask[x] = lookup(bgr[2], bgr[1], bgr[0]) ? 255 : 0;
+    }
+
+    // Pixels x0 .. x0 + width - 1 of a packed Y0 U Y1 V row, into mask[0 .. width - 1]
+    void threshold_yuyv_row(const uint8_t* yuyv, int x0, int width, uint8_t* mask) const {
+        for (int i = 0; i < width; i++) {
+            int x = x0 + i;
+            const uint8_t* pair = yuyv + 4 * (x / 2);
+            mask[i] = lookup(yuyv[2 * x], pair[1], pair[3]) ? 255 : 0;
+        }
+    }
+
+    // Pixels x0 .. x0 + width - 1 of a luma row and its half resolution interleaved UV row
+    void threshold_nv12_row(const uint8_t* luma, const uint8_t* uv, int x0, int width, uint8_t* mask) const {
+        for (int i = 0; i < width; i++) {
+            int x = x0 + i;
+            const uint8_t* chroma = uv + 2 * (x / 2);
+            mask[i] = lookup(luma[x], chroma[0], chroma[1]) ? 255 : 0;
+        }
+    }
+
+private:
+    void build(const ThresholdParams& params, bool yuv) {
+        bits_.assign((1 << 24) / 64, 0);
+        std::vector<uint8_t> row(256 * 3), mask(256);
+        for (int c2 = 0; c2 < 256; c2++) {
+            for (int c1 = 0; c1 < 256; c1++) {
+                for (int c0 = 0; c0 < 256; c0++) {
+                    uint8_t* pixel = &row[3 * c0];
+                    if (yuv) {
+                        yuv_to_bgr_pixel(c2, c1, c0, pixel);
+                    } else {
+                        pixel[0] = (uint8_t)c0;
+                        pixel[1] = (uint8_t)c1;
+                        pixel[2] = (uint8_t)c2;
+                    }
+                }
+                ::threshold_row(row.data(), mask.data(), 256, params);
+                uint64_t* word = &bits_[((c2 << 16) | (c1 << 8)) / 64];
+                for (int c0 = 0; c0 < 256; c0++)
+                    if (mask[c0])
+                        word[c0 / 64] |= (uint64_t)1 << (c0 % 64);
+            }
+        }
+    }
+
+    std::vector<uint64_t> bits_;
+};
@@ -0,0 +1,130 @@
+// Follows the dot's centroid from frame to frame and times the moment it crosses a fixed
+// reference line. The crossing is interpolated between the last centroid before the line and the
+// first one after it using their capture timestamps, so loop times are not quantized to whole
+// frames. Each pass of the dot through the view is one track and yields exactly one loop.
+//
+// The line is perpendicular to the x or y axis. Unless configured, it is learned from the first
+// track that travels far enough: the axis it moved most along, halfway across its path. That
+// track's sightings are kept until then, so it is timed at its crossing of the line like every
+// later one, and the first interval is not off by however long the dot took to reach the line. A
+// track that never straddles the line (it was seen only once, or the line is outside its path) is
+// still counted when it ends, at the sighting closest to the line.
+
+#pragma once
+
+#include <cmath>
+#include <vector>
+
+const int TRACK_MAX_MISSING = 15;      // frames without the dot before its track ends
+const double TRACK_MAX_JUMP = 200;     // in pixels per frame, further than that is a new track
+const double TRACK_MIN_TRAVEL = 20;    // in pixels, for a track to teach where the line goes
+
+class DotTracker {
+public:
+    // Fix the reference line at position along axis 0 (a vertical line at x) or 1 (horizontal at y)
+    void set_line(int axis, double position) {
+        axis_ = axis;
+        line_ = position;
+    }
+
+    bool has_line() const { return axis_ >= 0; }
+    int line_axis() const { return axis_; }
+    double line_position() const { return line_; }
+
+    // Feed one frame. Returns true with loopTime set when a loop is counted on this frame.
+    bool update(bool present, double x, double y, double time, double& loopTime) {
+        if (!present) {
+            if (active_ && ++missing_ > TRACK_MAX_MISSING)
+                return end_track(loopTime);
+            return false;
+        }
+
+        bool counted = false;
+        if (active_ && std::hypot(x - lastX_, y - lastY_) > TRACK_MAX_JUMP * (missing_ + 1))
+            counted = end_track(loopTime);
+
+        if (!active_) {
+            active_ = true;
+            crossed_ = false;
+            minX_ = maxX_ = x;
+            minY_ = maxY_ = y;
+            closestTime_ = time;
+            closestDistance_ = has_line() ? std::fabs(along(x, y) - line_) : 0;
+            unlinedTrack_.clear();
+        } else if (has_line() && !crossed_) {
+            double before = along(lastX_, lastY_) - line_;
+            double after = along(x, y) - line_;
+            if ((before < 0 && after >= 0) || (before > 0 && after <= 0)) {
+                crossed_ = true;
+                loopTime = lastTime_ + (time - lastTime_) * before / (before - after);
+                counted = true;
+            }
+        }
+
+        if (!has_line())
+            unlinedTrack_.push_back({x, y, time});
+        if (has_line() && std::fabs(along(x, y) - line_) < closestDistance_) {
+            closestDistance_ = std::fabs(along(x, y) - line_);
+            closestTime_ = time;
+        }
+        minX_ = std::fmin(minX_, x);
+        maxX_ = std::fmax(maxX_, x);
+        minY_ = std::fmin(minY_, y);
+        maxY_ = std::fmax(maxY_, y);
+        lastX_ = x;
+        lastY_ = y;
+        lastTime_ = time;
+        missing_ = 0;
+        return counted;
+    }
+
+private:
+    struct Sighting {
+        double x, y, time;
+    };
+
+    double along(double x, double y) const { return axis_ == 0 ? x : y; }
+
+    bool end_track(double& loopTime) {
+        active_ = false;
+        if (!has_line() && std::fmax(maxX_ - minX_, maxY_ - minY_) >= TRACK_MIN_TRAVEL) {
+            if (maxX_ - minX_ >= maxY_ - minY_)
+                set_line(0, (minX_ + maxX_) / 2);
+            else
+                set_line(1, (minY_ + maxY_) / 2);
+            loopTime = unlined_crossing();
+            unlinedTrack_.clear();
+            return true;
+        }
+        unlinedTrack_.clear();
+        if (crossed_)
+            return false;
+        loopTime = closestTime_;
+        return true;
+    }
+
+    // When the track the line was just learned from crossed it. The line is halfway between
+    // sightings on either side, so some pair of consecutive ones straddles it.
+    double unlined_crossing() const {
+        for (size_t i = 1; i < unlinedTrack_.size(); i++) {
+            const Sighting& last = unlinedTrack_[i - 1];
+            const Sighting& next = unlinedTrack_[i];
+            double before = along(last.x, last.y) - line_;
+            double after = along(next.x, next.y) - line_;
+            if ((before < 0 && after >= 0) || (before > 0 && after <= 0))
+                return last.time + (next.time - last.time) * before / (before - after);
+        }
+        return unlinedTrack_.empty() ? closestTime_ : unlinedTrack_.front().time;
+    }
+
+    int axis_ = -1;
+    double line_ = 0;
+
+    bool active_ = false;
+    bool crossed_ = false;
+    int missing_ = 0;
+    double lastX_ = 0, lastY_ = 0, lastTime_ = 0;
+    double minX_ = 0, maxX_ = 0, minY_ = 0, maxY_ = 0;
+    double closestTime_ = 0, closestDistance_ = 0;
+    std::vector<Sighting> unlinedTrack_;  // sightings of the track in progress while there is no line
+};
@@ -0,0 +1,220 @@
+// Append-only binary log of every session and every loop counted in it, so a crash loses at most
+// a few seconds of history instead of the whole session. Records are fixed size and go into an
+// in-memory buffer that a background thread writes out every EVENT_LOG_FLUSH_INTERVAL seconds,
+// so counting a loop never waits on the disk.
+//
+// Next to the log, <log>.idx holds one fixed-size summary per session (loops, distance, time),
+// rewritten in place at every flush as a checkpoint. Summaries come from the index alone, without
+// reading the records; if the index is lost it is rebuilt by scanning the log.
+
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+const char EVENT_LOG_MAGIC[8] = {'T', 'M', 'C', 'V', 'L', 'O', 'G', '1'};
+const double EVENT_LOG_FLUSH_INTERVAL = 5;  // in seconds
+
+const uint32_t EVENT_SESSION_START = 1;  // time is the wall clock time the session started
+const uint32_t EVENT_LOOP = 2;           // time is seconds since the session started
+const uint32_t EVENT_SESSION_END = 3;    // time is the wall clock time the session ended
+
+struct EventRecord {
+    uint32_t type;
+    uint32_t session;
+    double time;
+    double interval;  // seconds since the previous loop
+    double speed;     // in mph
+    double distance;  // in miles, for the session so far
+};
+
+// One entry of the index, and what a session summary is made of
+struct EventLogSession {
+    uint32_t session;
+    uint32_t loops;
+    uint64_t offset;          // of the session's first record in the log
+    double startWallTime;     // seconds since the epoch
+    double lastWallTime;      // when the session ended, or its last checkpoint if it never did
+    double distance;          // in miles
+    double elapsedMinutes;    // from the start to the last loop, like activity_log.txt
+    uint32_t ended;
+    uint32_t unused;
+};
+
+inline double wall_clock_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Rebuild the session summaries from the records themselves
+inline bool scan_event_log(const std::string& path, std::vector<EventLogSession>& sessions) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    char magic[sizeof(EVENT_LOG_MAGIC)];
+    bool ok = read(fd, magic, sizeof(magic)) == (ssize_t)sizeof(magic) &&
+              memcmp(magic, EVENT_LOG_MAGIC, sizeof(magic)) == 0;
+    uint64_t offset = sizeof(EVENT_LOG_MAGIC);
+    sessions.clear();
+    EventRecord record;
+    while (ok && read(fd, &record, sizeof(record)) == (ssize_t)sizeof(record)) {
+        if (record.type == EVENT_SESSION_START) {
+            EventLogSession session = {};
+            session.session = record.session;
+            session.offset = offset;
+            session.startWallTime = session.lastWallTime = record.time;
+            sessions.push_back(session);
+        } else if (!sessions.empty() && sessions.back().session == record.session) {
+            EventLogSession& session = sessions.back();
+            if (record.type == EVENT_LOOP) {
+                session.loops++;
+                session.distance = record.distance;
+                session.elapsedMinutes = record.time / 60;
+                session.lastWallTime = session.startWallTime + record.time;
+            } else if (record.type == EVENT_SESSION_END) {
+                session.lastWallTime = record.time;
+                session.ended = 1;
+            }
+        }
+        offset += sizeof(record);
+    }
+    close(fd);
+    if (!ok)
+        errno = EINVAL;
+    return ok;
+}
+
+// The session summaries, from the index when it is there and from the log otherwise
+inline bool read_event_log_sessions(const std::string& path, std::vector<EventLogSession>& sessions) {
+    int fd = ::open((path + ".idx").c_str(), O_RDONLY);
+    if (fd < 0)
+        return scan_event_log(path, sessions);
+    sessions.clear();
+    EventLogSession session;
+    while (read(fd, &session, sizeof(session)) == (ssize_t)sizeof(session))
+        sessions.push_back(session);
+    close(fd);
+    return true;
+}
+
+class EventLog {
+public:
+    ~EventLog() { close(wall_clock_seconds()); }
+
+    bool is_open() const { return fd_ >= 0; }
+
+    // Start a new session at the end of the log at path (created if needed)
+    bool open(const std::string& path, double wallTime) {
+        std::vector<EventLogSession> sessions;
+        bool existed = access(path.c_str(), F_OK) == 0;
+        if (existed && !read_event_log_sessions(path, sessions))
+            return false;
+
+        fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        indexFd_ = ::open((path + ".idx").c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd_ < 0 || indexFd_ < 0)
+            return false;
+        off_t end = lseek(fd_, 0, SEEK_END);
+        if (end == 0 && write(fd_, EVENT_LOG_MAGIC, sizeof(EVENT_LOG_MAGIC)) != (ssize_t)sizeof(EVENT_LOG_MAGIC))
+            return false;
+        // Bring the index up to date in case it was lost, then add this session to it
+        for (size_t i = 0; i < sessions.size(); i++)
+            if (pwrite(indexFd_, &sessions[i], sizeof(sessions[i]), i * sizeof(sessions[i])) != (ssize_t)sizeof(sessions[i]))
+                return false;
+
+        summary_ = {};
+        summary_.session = (uint32_t)sessions.size();
+        summary_.offset = end == 0 ? sizeof(EVENT_LOG_MAGIC) : (uint64_t)end;
+        summary_.startWallTime = summary_.lastWallTime = wallTime;
+        append({EVENT_SESSION_START, summary_.session, wallTime, 0, 0, 0});
+        if (!flush())
+            return false;
+        flusher_ = std::thread(&EventLog::flush_loop, this);
+        return true;
+    }
+
+    void add_loop(double time, double interval, double speed, double distance) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.push_back({EVENT_LOOP, summary_.session, time, interval, speed, distance});
+        summary_.loops++;
+        summary_.distance = distance;
+        summary_.elapsedMinutes = time / 60;
+    }
+
+    // End the session and write out everything still buffered
+    void close(double wallTime) {
+        if (fd_ < 0 && indexFd_ < 0)
+            return;
+        if (flusher_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                closing_ = true;
+            }
+            wake_.notify_one();
+            flusher_.join();
+            append({EVENT_SESSION_END, summary_.session, wallTime, 0, 0, 0});
+            summary_.ended = 1;
+            summary_.lastWallTime = wallTime;
+            flush();
+        }
+        if (fd_ >= 0)
+            ::close(fd_);
+        if (indexFd_ >= 0)
+            ::close(indexFd_);
+        fd_ = indexFd_ = -1;
+    }
+
+private:
+    void append(const EventRecord& record) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        pending_.push_back(record);
+    }
+
+    void flush_loop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!closing_) {
+            wake_.wait_for(lock, std::chrono::duration<double>(EVENT_LOG_FLUSH_INTERVAL));
+            lock.unlock();
+            flush();
+            lock.lock();
+        }
+    }
+
+    // Write the buffered records, then checkpoint the session's index entry
+    bool flush() {
+        EventLogSession summary;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            writing_.swap(pending_);
+            if (!summary_.ended)
+                summary_.lastWallTime = wall_clock_seconds();
+            summary = summary_;
+        }
+        size_t bytes = writing_.size() * sizeof(EventRecord);
+        bool ok = bytes == 0 || write(fd_, writing_.data(), bytes) == (ssize_t)bytes;
+        writing_.clear();
+        return ok && pwrite(indexFd_, &summary, sizeof(summary), (off_t)summary.session * sizeof(summary)) ==
+                         (ssize_t)sizeof(summary);
+    }
+
+    int fd_ = -1;
+    int indexFd_ = -1;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    bool closing_ = false;
+    std::vector<EventRecord> pending_, writing_;
+    EventLogSession summary_ = {};
+    std::thread flusher_;
+};
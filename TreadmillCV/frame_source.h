@@ -0,0 +1,138 @@
+// Recorded frames for offline replay. A raw dump is an 8-byte magic followed by one
+// RawFrameHeader and the frame's pixels per frame, so the original capture timestamps survive
+// and a replay sees exactly the frames (and the timing) the live run saw. Frames keep the pixel
+// format they were captured in, so dumps of YUYV or NV12 camera frames replay through the same
+// YUV detection path. Ordinary video files replay too, as BGR timed by their presentation timestamps.
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+const char RAW_FRAME_MAGIC[8] = {'T', 'M', 'C', 'V', 'R', 'A', 'W', '1'};
+
+// How a frame's pixels are laid out in its cv::Mat
+const int32_t RAW_FORMAT_BGR = 0;   // CV_8UC3, height rows of B G R
+const int32_t RAW_FORMAT_YUYV = 1;  // CV_8UC2, height rows of Y0 U Y1 V pairs
+const int32_t RAW_FORMAT_NV12 = 2;  // CV_8UC1, height luma rows then height / 2 rows of interleaved U V
+
+struct RawFrameHeader {
+    double captureTime;  // seconds, on whatever clock the recording used
+    int32_t width;
+    int32_t height;
+    int32_t format;
+    int32_t unused;
+};
+
+// Size image to hold one frame of the given format, reusing its buffer when it already fits
+inline bool create_frame_image(cv::Mat& image, int32_t format, int width, int height) {
+    switch (format) {
+    case RAW_FORMAT_BGR:
+        image.create(height, width, CV_8UC3);
+        return true;
+    case RAW_FORMAT_YUYV:
+        image.create(height, width, CV_8UC2);
+        return width % 2 == 0;
+    case RAW_FORMAT_NV12:
+        image.create(height * 3 / 2, width, CV_8UC1);
+        return width % 2 == 0 && height % 2 == 0;
+    }
+    return false;
+}
+
+class RawFrameWriter {
+public:
+    ~RawFrameWriter() { close(); }
+
+    bool open(const std::string& path) {
+        file_ = fopen(path.c_str(), "wb");
+        if (file_ == nullptr)
+            return false;
+        return fwrite(RAW_FRAME_MAGIC, sizeof(RAW_FRAME_MAGIC), 1, file_) == 1;
+    }
+
+    bool is_open() const { return file_ != nullptr; }
+
+    bool write(const cv::Mat& image, int32_t format, int width, int height, double captureTime) {
+        RawFrameHeader header = {captureTime, width, height, format, 0};
+        if (fwrite(&header, sizeof(header), 1, file_) != 1)
+            return false;
+        for (int y = 0; y < image.rows; y++)
+            if (fwrite(image.ptr(y), (size_t)image.cols * image.channels(), 1, file_) != 1)
+                return false;
+        return true;
+    }
+
+    void close() {
+        if (file_ != nullptr)
+            fclose(file_);
+        file_ = nullptr;
+    }
+
+private:
+    FILE* file_ = nullptr;
+};
+
+// Reads a raw dump, or anything cv::VideoCapture can open, one frame at a time
+class ReplaySource {
+public:
+    ~ReplaySource() {
+        if (raw_ != nullptr)
+            fclose(raw_);
+    }
+
+    bool open(const std::string& path) {
+        raw_ = fopen(path.c_str(), "rb");
+        if (raw_ == nullptr)
+            return false;
+        char magic[sizeof(RAW_FRAME_MAGIC)];
+        if (fread(magic, sizeof(magic), 1, raw_) == 1 && memcmp(magic, RAW_FRAME_MAGIC, sizeof(magic)) == 0) {
+            // Peek at the first frame's format, so the caller can get ready for it
+            RawFrameHeader header;
+            if (fread(&header, sizeof(header), 1, raw_) == 1)
+                format_ = header.format;
+            return fseek(raw_, sizeof(RAW_FRAME_MAGIC), SEEK_SET) == 0;
+        }
+        fclose(raw_);
+        raw_ = nullptr;
+        return video_.open(path);
+    }
+
+    // Pixel format of the first frame; video files are always decoded to BGR
+    int32_t format() const { return format_; }
+
+    // Decode the next frame into image (reusing its buffer when the size matches); false at the end
+    bool read(cv::Mat& image, int32_t& format, int& width, int& height, double& captureTime) {
+        if (raw_ == nullptr) {
+            if (!video_.read(image) || image.empty())
+                return false;
+            format = RAW_FORMAT_BGR;
+            width = image.cols;
+            height = image.rows;
+            captureTime = video_.get(cv::CAP_PROP_POS_MSEC) / 1000;
+            return true;
+        }
+
+        RawFrameHeader header;
+        if (fread(&header, sizeof(header), 1, raw_) != 1 || header.width <= 0 || header.height <= 0 ||
+            !create_frame_image(image, header.format, header.width, header.height))
+            return false;
+        for (int y = 0; y < image.rows; y++)
+            if (fread(image.ptr(y), (size_t)image.cols * image.channels(), 1, raw_) != 1)
+                return false;
+        format = header.format;
+        width = header.width;
+        height = header.height;
+        captureTime = header.captureTime;
+        return true;
+    }
+
+private:
+    FILE* raw_ = nullptr;
+    int32_t format_ = RAW_FORMAT_BGR;
+    cv::VideoCapture video_;
+};
@@ -0,0 +1,59 @@
+// Cheap latency bookkeeping for the frame pipeline: a monotonic nanosecond clock (a vDSO call,
+// no syscall) and a fixed-bucket histogram that records a sample with a couple of instructions
+// and never allocates, so it can stay on for every frame.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+
+inline int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Bucket 0 holds samples under 1us and bucket i holds [2^(i-1), 2^i) us, so 24 buckets
+// reach past four seconds; anything slower lands in the last one
+const int LATENCY_BUCKETS = 24;
+
+struct LatencyHistogram {
+    uint64_t counts[LATENCY_BUCKETS] = {};
+    uint64_t samples = 0;
+    int64_t sumNs = 0;
+    int64_t maxNs = 0;
+
+    void add(int64_t ns) {
+        if (ns < 0)
+            ns = 0;
+        uint64_t us = (uint64_t)ns / 1000;
+        int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+        counts[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+        samples++;
+        sumNs += ns;
+        if (ns > maxNs)
+            maxNs = ns;
+    }
+
+    // Upper edge of the bucket holding the given fraction of samples (but never more than
+    // the slowest sample), in milliseconds
+    double percentile_ms(double fraction) const {
+        if (samples == 0)
+            return 0;
+        uint64_t rank = (uint64_t)(fraction * (samples - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS - 1; i++) {
+            seen += counts[i];
+            if (seen >= rank)
+                return std::min((double)((uint64_t)1 << i) / 1000, max_ms());
+        }
+        return max_ms();
+    }
+
+    double mean_ms() const { return samples ? sumNs / 1e6 / samples : 0; }
+    double max_ms() const { return maxNs / 1e6; }
+
+    void clear() { memset(this, 0, sizeof(*this)); }
+};
@@ -0,0 +1,70 @@
+// A lock-free ring of preallocated slots for handing items from exactly one producer thread
+// to exactly one consumer thread. Neither side ever blocks the other: the producer finds
+// out immediately when the ring is full and can decide to drop the item instead of waiting.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity) : slots_(capacity) {}
+
+    size_t capacity() const { return slots_.size(); }
+
+    // Direct access to every slot, for preallocating their contents before the threads start
+    T& slot(size_t index) { return slots_[index]; }
+
+    // Number of items waiting; exact from either thread, approximate from anywhere else
+    size_t depth() const {
+        return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+    }
+
+    // Producer: the slot to fill next, or nullptr if the ring is full
+    T* begin_write() {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == slots_.size())
+            return nullptr;
+        return &slots_[head % slots_.size()];
+    }
+
+    // Producer: hand the slot from begin_write() to the consumer
+    void end_write() {
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer: the oldest filled slot, or nullptr if the ring is empty
+    T* begin_read() {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire))
+            return nullptr;
+        return &slots_[tail % slots_.size()];
+    }
+
+    // Consumer: give the slot from begin_read() back to the producer
+    void end_read() {
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer: wait up to timeout for a filled slot. Frames arrive tens of milliseconds
+    // apart, so polling every half millisecond costs nothing and keeps the producer lock-free.
+    T* wait_read(std::chrono::milliseconds timeout) {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (true) {
+            T* item = begin_read();
+            if (item != nullptr || std::chrono::steady_clock::now() >= deadline)
+                return item;
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+    }
+
+private:
+    std::vector<T> slots_;
+    alignas(64) std::atomic<size_t> head_{0};   // written only by the producer
+    alignas(64) std::atomic<size_t> tail_{0};   // written only by the consumer
+};
@@ -0,0 +1,1411 @@
+/*
+Native port of treadmillcv.py. The program watches a red or blue dot sticker on a treadmill belt
+through a camera, counts the loops it makes and reports speed and distance just like the Python
+version, appending the session to activity_log.txt when it exits.
+
+Unlike the Python version, capture and detection run on separate threads. The capture thread does
+nothing but grab frames, stamp each one with the time it was acquired, and drop it into a ring of
+preallocated frame buffers. The processing thread consumes the ring, so a slow detection pass (or
+a slow imshow) never delays acquisition and never skews the loop timing; if processing falls a
+whole ring behind, the newest frames are dropped and counted instead of stalling the camera.
+
+The dot mask is built in one pass straight from the BGR frame (see color_threshold.h) rather than
+converting the whole frame to HSV first, and each row goes straight into a streaming connected
+components pass (see blob_detect.h) that stops the frame as soon as the dot is complete; -l swaps
+the per-pixel math for a color lookup table. With -R only a region of interest around the dot's
+path is thresholded on most frames, either a fixed x,y,w,h rectangle or one learned from where
+the dot shows up; a full frame scan every ROI_RESCAN_INTERVAL frames, or after the dot has gone
+missing for a while, re-acquires it if the camera or the sticker moves.
+
+-P looks for the dot on a mask downsampled 2x or 4x first: only every second or fourth pixel of
+every second or fourth row is thresholded, gathered into a short row for the same vector kernel,
+and the dot still covers plenty of those samples. Full resolution is only used in a small box
+around a candidate, so the centroid (and with it loop timing) is as precise as ever.
+
+With -g, a frame whose region looks the same as the last fully processed one, judged from a
+sparse grid of pixels, skips thresholding and blob detection and reuses the previous result; a
+treadmill at rest or between passes of the dot costs almost nothing.
+
+Instead of the Python version's "dot reappeared after FRAME_MEMORY_MAX empty frames" rule, loops
+are timed by following the dot's centroid from frame to frame and interpolating, between capture
+timestamps, the moment it crosses a reference line (see dot_tracker.h); -L places the line.
+
+-W records every processed frame with its capture timestamp to a raw dump, and -p replays such a
+dump (or any video file) instead of the camera, as fast as frames can be processed and without
+dropping any. Since loop timing only ever uses capture timestamps, a replay reproduces the live
+run's loops exactly; -o writes them to a CSV log that can be diffed between builds.
+
+Several cameras (-c) and replays (-p) can be watched at once. Each stream has its own capture
+thread, ring, detection and loop state, logs and stats; processing is shared by a pool of -j
+worker threads, each of which takes whichever stream has frames waiting and processes a few of
+them before moving on, so one busy stream cannot starve the others.
+
+The preview (-d, -m) has a thread of its own, the main one. Workers only hand it a copy of each
+processed frame and what was found in it, through a triple buffer that always holds the newest
+(see triple_buffer.h); the render thread annotates and shows whatever is newest about once per
+display refresh and never holds up detection, so loop timing is the same with or without it.
+
+Every frame's trip through the pipeline is timed stage by stage (decode, waiting in the ring,
+detection, handing off to the preview, and capture to done) into fixed-bucket histograms; -s prints a summary line
+with those and the dropped frame and ring depth counts every STATS_INTERVAL seconds, and -t
+writes every frame's timings to a CSV trace.
+
+-v captures straight from a V4L2 device in its native YUYV or NV12 format (-f), out of memory-mapped
+driver buffers and stamped with the driver's capture time when it is on the monotonic clock, or else
+the time the frame was grabbed (see v4l2_capture.h). Those frames are never converted to BGR for
+detection: the mask comes from a lookup table over YUV built to match converting to BGR and applying
+the usual bounds, and only a preview converts. Raw dumps keep the format, so YUV recordings replay
+through the same path.
+
+-C fits the dot's color bounds to the first CALIBRATION_SECONDS of frames instead of relying on
+the hand-tuned ones: the dot is found with the defaults loosened, and bounds are cut from
+histograms of its pixels (see color_calibration.h). They are saved so -k can load them next time,
+and either way the bounds are baked into a color lookup table, one lookup per pixel.
+
+-E keeps a binary log of every session and every loop in it (see event_log.h), flushed every
+few seconds from a background thread, so a crash no longer loses the session the way
+activity_log.txt, written only at exit, does. Its index summarizes each session without reading
+the loops, and -A prints those summaries as activity_log.txt lines.
+
+Compile with:
+    g++ -O2 -march=native -std=c++17 -pthread treadmillcv.cpp -o treadmillcv $(pkg-config --cflags --libs opencv4)
+Run with:
+    ./treadmillcv [-d] [-r] [-m] [-b] [-l] [-g] [-R auto|x,y,w,h] [-P 1|2|4] [-c device]... [-v /dev/videoN]... [-f yuyv|nv12]
+                  [-C bounds.txt] [-k bounds.txt] [-p replay]... [-j workers] [-W dump] [-o loops.csv] [-L x=N|y=N] [-s] [-t trace.csv]
+                  [-E events.bin] [-A events.bin]
+*/
+
+#include <opencv2/opencv.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "blob_detect.h"
+#include "color_calibration.h"
+#include "color_threshold.h"
+#include "dot_tracker.h"
+#include "event_log.h"
+#include "frame_source.h"
+#include "latency_stats.h"
+#include "spsc_ring.h"
+#include "triple_buffer.h"
+#include "v4l2_capture.h"
+
+const double TRACK_LENGTH = 124.1875;  // in inches
+const double INCHES_PER_MILE = 63360;
+const double TRACK_LENGTH_MILES = TRACK_LENGTH / INCHES_PER_MILE;
+const char* WIN_TITLE = "Treadmill Monitor";
+const int TEXT_DISPLAY_INTERVAL = 30;  // in frames
+const int MIN_DOT_AREA = 200;  // in pixels, a little more generous than contourArea()'s polygon area
+
+const int FRAME_WIDTH = 800;
+const int FRAME_HEIGHT = 600;
+const int FRAME_RATE = 30;
+const size_t FRAME_RING_SIZE = 8;  // about a quarter second of frames at 30fps
+
+const double STATS_INTERVAL = 10;  // in seconds
+const int DISPLAY_INTERVAL_MS = 16;  // about the display's refresh rate
+const int WORKER_BATCH = 4;        // frames a worker processes from one stream before looking at the others
+
+const int MOTION_SAMPLE_STEP = 6;       // in pixels; smaller than the dot, so it always covers samples
+const int MOTION_PIXEL_THRESHOLD = 24;  // channel difference that counts as a change rather than noise
+const int MOTION_MIN_CHANGED = 2;       // changed samples needed to run detection
+const int MOTION_MAX_SKIP = 15;         // frames skipped in a row before detection runs anyway
+
+const int ROI_LEARN_FRAMES = 45;        // full frame sightings of the dot before settling on a region
+const int ROI_MARGIN = 40;              // in pixels, added around the learned dot path
+const int ROI_RESCAN_INTERVAL = 30;     // in frames
+const int ROI_LOST_FRAMES = 30 * 15;    // frames without the dot before going back to full frames
+
+const int V4L2_GRAB_TIMEOUT_MS = 2000;  // a camera that sends nothing for this long has failed
+
+const double CALIBRATION_SECONDS = 5;
+const int CALIBRATION_SLACK_HUE = 10;   // the default bounds are widened by this much to find the dot
+const int CALIBRATION_SLACK = 40;       // in every other channel
+const int CALIBRATION_SAMPLE_STEP = 12; // in pixels, between background samples
+const int CALIBRATION_MIN_FRAMES = 5;   // frames the dot must be seen in for a fit
+
+// A camera device (through OpenCV, or V4L2 directly) or a replay file
+struct StreamSource {
+    bool replay = false;
+    bool v4l2 = false;
+    int device = 0;
+    std::string path;
+};
+
+struct Options {
+    bool showVideo = false;
+    bool useBlue = true;
+    bool showMask = false;
+    bool useBgr = false;
+    bool useLut = false;
+    std::string calibratePath;  // -C, fit bounds and save them here
+    std::string boundsPath;     // -k, load bounds fitted earlier
+    bool motionGate = false;
+    bool learnRoi = false;
+    cv::Rect roi;  // empty unless given with -R
+    int pyramid = 1;  // downsampling of the first detection pass
+    std::vector<StreamSource> sources;  // camera 0 if none are given
+    int workers = 0;                    // one per stream (up to the core count) if not given
+    int32_t v4l2Format = RAW_FORMAT_YUYV;
+    std::string recordPath;
+    std::string loopLogPath;
+    std::string eventLogPath;
+    std::string convertPath;  // -A, only print this event log's sessions
+    int lineAxis = -1;  // reference line from -L, learned if not given
+    double linePosition = 0;
+    bool showStats = false;
+    std::string tracePath;
+};
+
+// One slot of the frame ring. The pixel buffer is allocated once, before capture starts.
+struct Frame {
+    cv::Mat image;  // laid out as format says, see frame_source.h
+    int32_t format = RAW_FORMAT_BGR;
+    int width = 0, height = 0;
+    double captureTime = 0;  // seconds on the monotonic clock, taken right after the grab
+    uint64_t sequence = 0;
+    int64_t grabNs = 0;      // when the capture thread got the frame, for latency stats only
+    int64_t queuedNs = 0;    // when it was decoded and handed to the processing thread
+};
+
+// Counters shared between the capture thread and the rest of the program
+struct CaptureStats {
+    std::atomic<uint64_t> captured{0};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> failed{false};
+    std::atomic<bool> ended{false};  // a replay ran out of frames
+};
+
+// Buffers reused by every detection pass, so processing a frame allocates nothing. The mask
+// is always frame sized; a pass over a region only fills in (and looks at) that part of it.
+struct DetectScratch {
+    cv::Mat mask;
+    BlobDetector blobs;
+    std::vector<uint8_t> samples;  // one downsampled row of pixels, and its mask
+    std::vector<uint8_t> coarseMask;
+    BlobDetector coarseBlobs;
+};
+
+// The dot's color bounds and the tables built from them, shared read-only by every worker
+struct ColorModel {
+    ThresholdParams params;
+    ColorLut lut;     // over BGR, only built with -l
+    ColorLut yuvLut;  // over YUV, built when any stream delivers YUV frames
+};
+
+struct Detection {
+    bool present = false;
+    int area = 0;
+    cv::Rect box;  // in full frame coordinates
+    double centroidX = 0, centroidY = 0;
+    bool coarseOnly = false;  // nothing found by detect_dot_pyramid()'s downsampled pass, so never checked in full
+};
+
+// Where to look for the dot. area stays empty (meaning the whole frame) until it is configured
+// or learned; learned accumulates every box a full frame scan found the dot in.
+struct RegionOfInterest {
+    cv::Rect area;
+    cv::Rect learned;
+    int learnedFrames = 0;
+    int framesSinceFullScan = 0;
+    int framesSinceSeen = 0;
+};
+
+// Per-stage latency of frames through the pipeline, kept by the processing thread alone
+struct PipelineStats {
+    LatencyHistogram decode, queue, detect, display, total;
+    uint64_t frames = 0;
+    uint64_t skipped = 0;  // frames the motion gate let through without detection
+    uint64_t depthSum = 0;
+    size_t maxDepth = 0;
+    uint64_t droppedBefore = 0;
+    int64_t intervalStartNs = 0;
+    FILE* trace = nullptr;
+};
+
+// Sparse samples of the last frame detection ran on, for spotting frames with nothing new
+struct MotionGate {
+    std::vector<uint8_t> reference;
+    std::vector<uint8_t> samples;
+    cv::Rect region;  // where reference was sampled
+    int skippedInARow = 0;
+    uint64_t skipped = 0;
+    uint64_t checked = 0;
+};
+
+// Loop counting and speed state, the same bookkeeping the Python version keeps in globals
+struct SpeedTracker {
+    bool started = false;
+    FILE* loopLog = nullptr;
+    EventLog events;
+    int loopCount = 0;
+    double startTime = 0;
+    double lastRedDotTime = 0;
+    double distance = 0;
+    double lastSpeed = 0;
+    double elapsedTimeMin = 0;
+};
+
+// What the preview needs of a processed frame: a copy of it as captured, and what was found in it
+struct PreviewFrame {
+    Frame frame;
+    cv::Mat mask;  // only with -m
+    Detection detection;
+    cv::Rect region;
+    bool fullScan = true;
+    int lineAxis = -1;
+    double linePosition = 0;
+};
+
+// State of the preview window between frames, only ever touched by the render thread
+struct DisplayState {
+    std::string title;
+    std::atomic<int> curX{0};
+    std::atomic<int> curY{0};
+    cv::Mat masked;
+    cv::Mat converted;  // BGR copy of a YUV frame, for showing it
+    int curCount = TEXT_DISPLAY_INTERVAL;
+    int phsv[3] = {0, 0, 0};
+};
+
+// Everything one camera or replay needs. Streams share nothing but the worker pool: the capture
+// thread fills ring, and whichever worker holds busy runs everything below it.
+struct Stream {
+    int index = 0;
+    std::string name;    // for messages
+    std::string prefix;  // put in front of console lines when there is more than one stream
+    StreamSource source;
+    cv::VideoCapture cap;
+    V4l2Capture v4l2;
+    ReplaySource replay;
+    SpscRing<Frame> ring{FRAME_RING_SIZE};
+    CaptureStats stats;
+    std::thread captureThread;
+    std::atomic_flag busy = ATOMIC_FLAG_INIT;
+    std::atomic<bool> done{false};
+
+    DetectScratch scratch;
+    RegionOfInterest roi;
+    bool roiConfigured = false;
+    DotTracker dotTracker;
+    MotionGate motionGate;
+    Detection lastDetection;
+    SpeedTracker tracker;
+    PipelineStats pipeline;
+    RawFrameWriter recorder;
+    TripleBuffer<PreviewFrame> preview;  // from whichever worker has the stream to the render thread
+    DisplayState display;
+};
+
+std::atomic<bool> gRunning{true};
+volatile sig_atomic_t gSignalled = 0;
+
+bool parse_command_line_arguments(int argc, char* argv[], Options& options) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0) {
+            options.showVideo = true;
+        } else if (strcmp(argv[i], "-r") == 0) {
+            options.useBlue = false;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            options.showMask = true;
+            options.showVideo = true;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            options.useBgr = true;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            options.useLut = true;
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc) {
+            options.calibratePath = argv[++i];
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            options.boundsPath = argv[++i];
+        } else if (strcmp(argv[i], "-g") == 0) {
+            options.motionGate = true;
+        } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+            i++;
+            cv::Rect& roi = options.roi;
+            if (strcmp(argv[i], "auto") == 0) {
+                options.learnRoi = true;
+            } else if (sscanf(argv[i], "%d,%d,%d,%d", &roi.x, &roi.y, &roi.width, &roi.height) != 4 ||
+                       roi.x < 0 || roi.y < 0 || roi.width <= 0 || roi.height <= 0) {
+                fprintf(stderr, "Invalid region %s, expected auto or x,y,w,h\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            options.pyramid = atoi(argv[++i]);
+            if (options.pyramid != 1 && options.pyramid != 2 && options.pyramid != 4) {
+                fprintf(stderr, "Invalid downsampling %s, expected 1, 2 or 4\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            StreamSource source;
+            source.device = atoi(argv[++i]);
+            options.sources.push_back(source);
+        } else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc) {
+            StreamSource source;
+            source.v4l2 = true;
+            source.path = argv[++i];
+            options.sources.push_back(source);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "yuyv") == 0) {
+                options.v4l2Format = RAW_FORMAT_YUYV;
+            } else if (strcmp(argv[i], "nv12") == 0) {
+                options.v4l2Format = RAW_FORMAT_NV12;
+            } else {
+                fprintf(stderr, "Invalid pixel format %s, expected yuyv or nv12\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            StreamSource source;
+            source.replay = true;
+            source.path = argv[++i];
+            options.sources.push_back(source);
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            options.workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc) {
+            options.recordPath = argv[++i];
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            options.loopLogPath = argv[++i];
+        } else if (strcmp(argv[i], "-E") == 0 && i + 1 < argc) {
+            options.eventLogPath = argv[++i];
+        } else if (strcmp(argv[i], "-A") == 0 && i + 1 < argc) {
+            options.convertPath = argv[++i];
+        } else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+            i++;
+            char axis;
+            if (sscanf(argv[i], "%c=%lf", &axis, &options.linePosition) != 2 || (axis != 'x' && axis != 'y')) {
+                fprintf(stderr, "Invalid reference line %s, expected x=N or y=N\n", argv[i]);
+                return false;
+            }
+            options.lineAxis = axis == 'x' ? 0 : 1;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            options.showStats = true;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            options.tracePath = argv[++i];
+        } else if (strcmp(argv[i], "-h") == 0) {
+            printf("Usage: %s [-d] [-r] [-m] [-b] [-l] [-g] [-R auto|x,y,w,h] [-P 1|2|4] [-c device]... [-v /dev/videoN]... [-f yuyv|nv12]\n"
+                   "       [-C bounds.txt] [-k bounds.txt] [-p replay]... [-j workers] [-W dump] [-o loops.csv] [-L x=N|y=N] [-s] [-t trace.csv]\n"
+                   "       [-E events.bin] [-A events.bin]\n", argv[0]);
+            printf("  -d: Display the video feed from the camera\n");
+            printf("  -r: Use a red dot instead of a blue dot (blue dot is the default)\n");
+            printf("  -m: Display the mask used to detect the dots on the video feed in real-time\n");
+            printf("  -b: Use BGR instead of HSV for dot detection\n");
+            printf("  -l: Precompute a color lookup table for dot detection (adds a moment to startup)\n");
+            printf("  -C: Fit the dot's color bounds over the first %g seconds of the first stream and save them\n",
+                   CALIBRATION_SECONDS);
+            printf("  -k: Use color bounds saved by -C (either one implies -l)\n");
+            printf("  -g: Skip dot detection on frames that have not changed since the last one it ran on\n");
+            printf("  -R: Only scan a region of the frame for the dot, learned from where it is seen or given as x,y,w,h\n");
+            printf("  -P: Find the dot on a 2x or 4x downsampled mask first, refining at full resolution around it (1: off)\n");
+            printf("  -c: Watch this camera device (0 if no -c or -p is given); repeat for more cameras\n");
+            printf("  -v: Capture YUV frames straight from this V4L2 device, skipping the BGR conversion; repeatable\n");
+            printf("  -f: Pixel format to ask -v devices for, yuyv (the default) or nv12\n");
+            printf("  -p: Replay a raw frame dump or video file instead of using the camera (no activity log is written); repeatable\n");
+            printf("  -j: Worker threads shared by all streams (one per stream by default)\n");
+            printf("  With several streams, -W, -o, -t and the activity log get a -N suffix per stream\n");
+            printf("  -W: Record every processed frame and its capture time to a raw frame dump\n");
+            printf("  -o: Write every counted loop to a CSV file\n");
+            printf("  -L: Time loops where the dot crosses the line x=N or y=N (learned from the dot's path by default)\n");
+            printf("  -s: Print pipeline latency, dropped frame and queue depth stats every %g seconds\n", STATS_INTERVAL);
+            printf("  -t: Write every frame's pipeline latencies to a CSV file\n");
+            printf("  -E: Append the session and every loop to a binary event log, flushed every %g seconds\n",
+                   EVENT_LOG_FLUSH_INTERVAL);
+            printf("  -A: Print the sessions in an event log as activity_log.txt lines and exit\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+ThresholdParams select_color_bounds(const Options& options) {
+    ThresholdParams params;
+    params.hsv = !options.useBgr;
+    if (options.useBgr) {
+        // BGR, not RGB, since the camera uses BGR
+        if (options.useBlue)
+            params.ranges[0] = {{100, 0, 0}, {255, 100, 100}};
+        else
+            params.ranges[0] = {{0, 0, 130}, {100, 100, 255}};
+    } else {
+        if (options.useBlue) {
+            params.ranges[0] = {{85, 80, 80}, {110, 180, 255}};
+        } else {
+            params.ranges[0] = {{0, 120, 90}, {10, 255, 255}};
+            params.ranges[1] = {{170, 120, 90}, {180, 255, 255}};
+            params.rangeCount = 2;
+        }
+    }
+    return params;
+}
+
+// Format a double the way Python's str() does, so activity_log.txt lines match the Python version
+std::string format_python_float(double value) {
+    char buffer[64];
+    double magnitude = std::fabs(value);
+    std::chars_format format = (magnitude == 0 || (magnitude >= 1e-4 && magnitude < 1e16))
+        ? std::chars_format::fixed : std::chars_format::scientific;
+    char* end = std::to_chars(buffer, buffer + sizeof(buffer), value, format).ptr;
+    std::string text(buffer, end);
+    if (text.find_first_of(".en") == std::string::npos)
+        text += ".0";
+    return text;
+}
+
+// Capture thread: grab, timestamp, and hand off. Never waits on the processing thread.
+void capture_loop(cv::VideoCapture& cap, SpscRing<Frame>& ring, CaptureStats& stats) {
+    uint64_t sequence = 0;
+    while (gRunning.load(std::memory_order_relaxed)) {
+        if (!cap.grab()) {
+            stats.failed = true;
+            break;
+        }
+        int64_t grabNs = monotonic_ns();
+        sequence++;
+
+        Frame* frame = ring.begin_write();
+        if (frame == nullptr) {
+            // Processing is a full ring behind; drop this frame rather than stall the camera
+            stats.dropped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        // Decodes into the slot's existing buffer; it only reallocates if the camera ignored
+        // the requested resolution, and then only the first time round the ring
+        if (!cap.retrieve(frame->image) || frame->image.empty()) {
+            stats.failed = true;
+            break;
+        }
+        frame->format = RAW_FORMAT_BGR;
+        frame->width = frame->image.cols;
+        frame->height = frame->image.rows;
+        frame->captureTime = grabNs / 1e9;
+        frame->sequence = sequence;
+        frame->grabNs = grabNs;
+        frame->queuedNs = monotonic_ns();
+        ring.end_write();
+        stats.captured.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// V4L2 capture thread: the same hand-off, but the frame arrives in a driver buffer in its native
+// YUV format; it is copied row by row into the slot and handed back to the driver right away
+void v4l2_capture_loop(V4l2Capture& cap, int32_t format, SpscRing<Frame>& ring, CaptureStats& stats) {
+    uint64_t sequence = 0;
+    while (gRunning.load(std::memory_order_relaxed)) {
+        if (!cap.grab(V4L2_GRAB_TIMEOUT_MS)) {
+            stats.failed = true;
+            break;
+        }
+        int64_t grabNs = monotonic_ns();
+        sequence++;
+
+        Frame* frame = ring.begin_write();
+        if (frame == nullptr) {
+            stats.dropped.fetch_add(1, std::memory_order_relaxed);
+            cap.release();
+            continue;
+        }
+        create_frame_image(frame->image, format, cap.width(), cap.height());
+        size_t rowBytes = (size_t)frame->image.cols * frame->image.channels();
+        if (cap.size() < (size_t)cap.bytes_per_line() * (frame->image.rows - 1) + rowBytes) {
+            // A short frame (the driver flagged an error); not worth stopping for
+            cap.release();
+            stats.dropped.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        for (int y = 0; y < frame->image.rows; y++)
+            memcpy(frame->image.ptr(y), cap.data() + (size_t)y * cap.bytes_per_line(), rowBytes);
+        frame->format = format;
+        frame->width = cap.width();
+        frame->height = cap.height();
+        // The tracker's clock is monotonic_ns(); a driver timestamp on some other clock would
+        // make elapsed time and loop intervals meaningless, so the grab time stands in for it
+        frame->captureTime = cap.has_monotonic_timestamp() ? cap.timestamp() : grabNs / 1e9;
+        cap.release();
+        frame->sequence = sequence;
+        frame->grabNs = grabNs;
+        frame->queuedNs = monotonic_ns();
+        ring.end_write();
+        stats.captured.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Threshold one row of the frame to only show dot pixels, straight from the captured format in
+// a single pass: per pixel math or the table over BGR, the YUV table over YUYV and NV12
+void threshold_mask_row(const Frame& frame, const cv::Rect& region, const ColorModel& colors, cv::Mat& mask, int y) {
+    uint8_t* dst = mask.ptr(y) + region.x;
+    switch (frame.format) {
+    case RAW_FORMAT_YUYV:
+        colors.yuvLut.threshold_yuyv_row(frame.image.ptr(y), region.x, region.width, dst);
+        break;
+    case RAW_FORMAT_NV12:
+        colors.yuvLut.threshold_nv12_row(frame.image.ptr(y), frame.image.ptr(frame.height + y / 2),
+                                         region.x, region.width, dst);
+        break;
+    default:
+        if (!colors.lut.empty())
+            colors.lut.threshold_row(frame.image.ptr(y) + 3 * region.x, dst, region.width);
+        else
+            threshold_row(frame.image.ptr(y) + 3 * region.x, dst, region.width, colors.params);
+    }
+}
+
+// The three channels of one pixel as captured: B G R, or Y U V
+void frame_pixel(const Frame& frame, int x, int y, uint8_t channels[3]) {
+    const uint8_t* row = frame.image.ptr(y);
+    if (frame.format == RAW_FORMAT_YUYV) {
+        const uint8_t* pair = row + 4 * (x / 2);
+        channels[0] = row[2 * x];
+        channels[1] = pair[1];
+        channels[2] = pair[3];
+    } else if (frame.format == RAW_FORMAT_NV12) {
+        const uint8_t* chroma = frame.image.ptr(frame.height + y / 2) + 2 * (x / 2);
+        channels[0] = row[x];
+        channels[1] = chroma[0];
+        channels[2] = chroma[1];
+    } else {
+        memcpy(channels, row + 3 * x, 3);
+    }
+}
+
+// Threshold every step-th pixel of row y inside region into mask, one row of a mask downsampled
+// by step. The samples are gathered into a short contiguous row first so the same kernels (and
+// vector code) run on them; YUV samples go in V U Y order, which is how the YUV table indexes them.
+void threshold_sampled_row(const Frame& frame, const cv::Rect& region, const ColorModel& colors, int step,
+                           std::vector<uint8_t>& samples, uint8_t* mask, int y) {
+    int count = (region.width + step - 1) / step;
+    samples.resize(3 * count);
+    if (frame.format == RAW_FORMAT_BGR) {
+        const uint8_t* src = frame.image.ptr(y) + 3 * region.x;
+        for (int i = 0; i < count; i++, src += 3 * step)
+            memcpy(&samples[3 * i], src, 3);
+        if (!colors.lut.empty())
+            colors.lut.threshold_row(samples.data(), mask, count);
+        else
+            threshold_row(samples.data(), mask, count, colors.params);
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        uint8_t channels[3];
+        frame_pixel(frame, region.x + i * step, y, channels);
+        samples[3 * i] = channels[2];
+        samples[3 * i + 1] = channels[1];
+        samples[3 * i + 2] = channels[0];
+    }
+    colors.yuvLut.threshold_row(samples.data(), mask, count);
+}
+
+// One pixel as B G R whatever the frame's format
+void frame_pixel_bgr(const Frame& frame, int x, int y, uint8_t bgr[3]) {
+    uint8_t channels[3];
+    frame_pixel(frame, x, y, channels);
+    if (frame.format == RAW_FORMAT_BGR)
+        memcpy(bgr, channels, 3);
+    else
+        yuv_to_bgr_pixel(channels[0], channels[1], channels[2], bgr);
+}
+
+// Sample region of the frame on a sparse grid and compare with the last frame detection ran
+// on. Returns true if the frame can skip detection; otherwise the samples become the new
+// reference, since the caller is about to run detection on this frame.
+bool motion_gate_skip(MotionGate& gate, const Frame& frame, const cv::Rect& region) {
+    gate.samples.clear();
+    for (int y = region.y + MOTION_SAMPLE_STEP / 2; y < region.y + region.height; y += MOTION_SAMPLE_STEP) {
+        for (int x = region.x + MOTION_SAMPLE_STEP / 2; x < region.x + region.width; x += MOTION_SAMPLE_STEP) {
+            uint8_t channels[3];
+            frame_pixel(frame, x, y, channels);
+            gate.samples.insert(gate.samples.end(), channels, channels + 3);
+        }
+    }
+    gate.checked++;
+
+    bool sameRegion = gate.region.x == region.x && gate.region.y == region.y &&
+                      gate.region.width == region.width && gate.region.height == region.height;
+    if (sameRegion && gate.skippedInARow < MOTION_MAX_SKIP && gate.samples.size() == gate.reference.size()) {
+        int changed = 0;
+        for (size_t i = 0; i < gate.samples.size() && changed < MOTION_MIN_CHANGED; i += 3) {
+            if (abs(gate.samples[i] - gate.reference[i]) > MOTION_PIXEL_THRESHOLD ||
+                abs(gate.samples[i + 1] - gate.reference[i + 1]) > MOTION_PIXEL_THRESHOLD ||
+                abs(gate.samples[i + 2] - gate.reference[i + 2]) > MOTION_PIXEL_THRESHOLD)
+                changed++;
+        }
+        if (changed < MOTION_MIN_CHANGED) {
+            gate.skippedInARow++;
+            gate.skipped++;
+            return true;
+        }
+    }
+    gate.reference.swap(gate.samples);
+    gate.region = region;
+    gate.skippedInARow = 0;
+    return false;
+}
+
+// Make the next frame run detection however little it changed
+void motion_gate_reset(MotionGate& gate) {
+    gate.reference.clear();
+    gate.skippedInARow = 0;
+}
+
+// Replay thread: the same hand-off as capture_loop, but a replay has all the time in the world,
+// so it waits for a free slot instead of dropping frames and output never depends on timing
+void replay_loop(ReplaySource& source, SpscRing<Frame>& ring, CaptureStats& stats) {
+    uint64_t sequence = 0;
+    while (gRunning.load(std::memory_order_relaxed)) {
+        Frame* frame = ring.begin_write();
+        if (frame == nullptr) {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+            continue;
+        }
+        frame->grabNs = monotonic_ns();
+        if (!source.read(frame->image, frame->format, frame->width, frame->height, frame->captureTime)) {
+            stats.ended = true;
+            break;
+        }
+        frame->sequence = ++sequence;
+        frame->queuedNs = monotonic_ns();
+        ring.end_write();
+        stats.captured.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+// Look for the dot inside region of the frame only. Thresholding and blob finding run row by
+// row together and stop once the dot has been seen whole, unless fullMask asks for the entire
+// region's mask (for showing it).
+Detection detect_dot(const Frame& frame, const cv::Rect& region, const ColorModel& colors, bool fullMask,
+                     DetectScratch& scratch) {
+    scratch.mask.create(frame.height, frame.width, CV_8UC1);
+    scratch.blobs.reset(region.width, MIN_DOT_AREA);
+
+    bool found = false;
+    int y = region.y;
+    for (; y < region.y + region.height && !found; y++) {
+        threshold_mask_row(frame, region, colors, scratch.mask, y);
+        found = scratch.blobs.add_row(scratch.mask.ptr(y) + region.x);
+    }
+    found = found || scratch.blobs.finish();
+    if (fullMask) {
+        for (; y < region.y + region.height; y++)
+            threshold_mask_row(frame, region, colors, scratch.mask, y);
+    }
+
+    Detection detection;
+    detection.area = scratch.blobs.largest_area();
+    if (found) {
+        const Blob& blob = scratch.blobs.blob();
+        detection.present = true;
+        detection.area = blob.area;
+        detection.box = cv::Rect(region.x + blob.minX, region.y + blob.minY,
+                                 blob.maxX - blob.minX + 1, blob.maxY - blob.minY + 1);
+        detection.centroidX = region.x + blob.centroid_x();
+        detection.centroidY = region.y + blob.centroid_y();
+    }
+    return detection;
+}
+
+cv::Rect clip_rect(const cv::Rect& rect, int width, int height) {
+    int x0 = std::max(rect.x, 0), y0 = std::max(rect.y, 0);
+    int x1 = std::min(rect.x + rect.width, width), y1 = std::min(rect.y + rect.height, height);
+    return (x1 > x0 && y1 > y0) ? cv::Rect(x0, y0, x1 - x0, y1 - y0) : cv::Rect();
+}
+
+cv::Rect union_rect(const cv::Rect& a, const cv::Rect& b) {
+    if (a.width == 0)
+        return b;
+    int x0 = std::min(a.x, b.x), y0 = std::min(a.y, b.y);
+    int x1 = std::max(a.x + a.width, b.x + b.width), y1 = std::max(a.y + a.height, b.y + b.height);
+    return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+bool contains_rect(const cv::Rect& outer, const cv::Rect& inner) {
+    return inner.x >= outer.x && inner.y >= outer.y &&
+           inner.x + inner.width <= outer.x + outer.width && inner.y + inner.height <= outer.y + outer.height;
+}
+
+// detect_dot() on a mask downsampled by step first. A dot big enough to count covers more than
+// MIN_DOT_AREA / step² samples; half that is enough to make a candidate, which is then measured at
+// full resolution inside its box, grown by a step on every side to take in the pixels between
+// samples. A candidate that turns out too small sends the whole region to full resolution, so
+// nothing is missed that a full resolution pass would have found.
+Detection detect_dot_pyramid(const Frame& frame, const cv::Rect& region, const ColorModel& colors, int step,
+                             bool fullMask, DetectScratch& scratch) {
+    int columns = (region.width + step - 1) / step;
+    scratch.coarseMask.resize(columns);
+    scratch.coarseBlobs.reset(columns, MIN_DOT_AREA / (step * step) / 2);
+    bool found = false;
+    for (int y = region.y; y < region.y + region.height && !found; y += step) {
+        threshold_sampled_row(frame, region, colors, step, scratch.samples, scratch.coarseMask.data(), y);
+        found = scratch.coarseBlobs.add_row(scratch.coarseMask.data());
+    }
+
+    Detection detection;
+    if (found || scratch.coarseBlobs.finish()) {
+        // Grow the candidate within the grid of samples, then scale it up; only the last row and
+        // column of samples can then reach past the region, and by less than a step
+        const Blob& blob = scratch.coarseBlobs.blob();
+        int rows = (region.height + step - 1) / step;
+        int x0 = std::max(blob.minX - 1, 0), y0 = std::max(blob.minY - 1, 0);
+        int x1 = std::min(blob.maxX + 2, columns), y1 = std::min(blob.maxY + 2, rows);
+        cv::Rect box = clip_rect(cv::Rect(region.x + x0 * step, region.y + y0 * step, (x1 - x0) * step, (y1 - y0) * step),
+                                 region.x + region.width, region.y + region.height);
+        if (box.width * box.height >= MIN_DOT_AREA)
+            detection = detect_dot(frame, box, colors, false, scratch);
+        if (!detection.present)
+            return detect_dot(frame, region, colors, fullMask, scratch);
+    } else {
+        detection.area = scratch.coarseBlobs.largest_area() * step * step;
+        detection.coarseOnly = true;
+    }
+    if (fullMask) {
+        scratch.mask.create(frame.height, frame.width, CV_8UC1);
+        for (int y = region.y; y < region.y + region.height; y++)
+            threshold_mask_row(frame, region, colors, scratch.mask, y);
+    }
+    return detection;
+}
+
+// The part of the frame to scan next; the whole frame while learning, when a rescan is due,
+// or when there is no region at all
+cv::Rect choose_region(const RegionOfInterest& roi, int width, int height) {
+    if (roi.area.width == 0 || roi.framesSinceFullScan >= ROI_RESCAN_INTERVAL)
+        return cv::Rect(0, 0, width, height);
+    return roi.area;
+}
+
+void update_region(RegionOfInterest& roi, const Options& options, const Detection& detection,
+                   bool fullScan, int width, int height) {
+    roi.framesSinceFullScan = fullScan ? 0 : roi.framesSinceFullScan + 1;
+    roi.framesSinceSeen = detection.present ? 0 : roi.framesSinceSeen + 1;
+    if (!options.learnRoi && options.roi.width == 0)
+        return;
+
+    if (detection.present && fullScan) {
+        cv::Rect padded = clip_rect(cv::Rect(detection.box.x - ROI_MARGIN, detection.box.y - ROI_MARGIN,
+                                             detection.box.width + 2 * ROI_MARGIN, detection.box.height + 2 * ROI_MARGIN),
+                                    width, height);
+        if (roi.area.width == 0) {
+            roi.learned = union_rect(roi.learned, padded);
+            if (++roi.learnedFrames >= ROI_LEARN_FRAMES) {
+                roi.area = roi.learned;
+                printf("Region of interest: %d,%d,%d,%d\n", roi.area.x, roi.area.y, roi.area.width, roi.area.height);
+            }
+        } else if (!contains_rect(roi.area, detection.box)) {
+            // The dot turned up outside the region, so the camera or the sticker moved; follow it
+            roi.area = union_rect(roi.area, padded);
+            printf("Region of interest grown to: %d,%d,%d,%d\n", roi.area.x, roi.area.y, roi.area.width, roi.area.height);
+        }
+    }
+
+    if (options.learnRoi && roi.area.width != 0 && roi.framesSinceSeen >= ROI_LOST_FRAMES) {
+        // Nothing in a learned region for a long time: scan whole frames and learn it again
+        printf("Dot lost, scanning the full frame\n");
+        roi.area = cv::Rect();
+        roi.learned = cv::Rect();
+        roi.learnedFrames = 0;
+    }
+}
+
+void start_tracker(SpeedTracker& tracker, double startTime) {
+    tracker.started = true;
+    tracker.startTime = startTime;
+    tracker.lastRedDotTime = startTime - 5;
+}
+
+// Count a loop that the dot tracker timed at loopTime, a capture timestamp interpolated to the
+// moment the dot crossed the reference line, unless it implies a ridiculous speed
+void count_loop(SpeedTracker& tracker, double loopTime, const std::string& prefix) {
+    double timeSinceLastRedDot = loopTime - tracker.lastRedDotTime;
+    double curSpeed = TRACK_LENGTH_MILES / (timeSinceLastRedDot / 3600);
+
+    if (curSpeed < 5 || (curSpeed < 7 && tracker.lastSpeed > 2) || (curSpeed < 15 && tracker.lastSpeed > 4)) {
+        // ignore false positives that show ridiculous speeds
+        tracker.lastSpeed = curSpeed;
+        tracker.distance += TRACK_LENGTH_MILES;
+        tracker.elapsedTimeMin = (loopTime - tracker.startTime) / 60;
+        tracker.lastRedDotTime = loopTime;
+
+        printf("%sSpeed = %.2fmph, Distance = %.2fmi, Time = %.2fm, Avg Speed = %.2f, LoopTime = %.2fs\n",
+               prefix.c_str(), curSpeed, tracker.distance, tracker.elapsedTimeMin,
+               tracker.distance / (tracker.elapsedTimeMin / 60), timeSinceLastRedDot);
+        fflush(stdout);
+        tracker.loopCount++;
+        if (tracker.loopLog != nullptr)
+            fprintf(tracker.loopLog, "%d,%.6f,%.6f,%.6f,%.6f\n", tracker.loopCount,
+                    loopTime - tracker.startTime, timeSinceLastRedDot, curSpeed, tracker.distance);
+        if (tracker.events.is_open())
+            tracker.events.add_loop(loopTime - tracker.startTime, timeSinceLastRedDot, curSpeed, tracker.distance);
+    }
+}
+
+void mouse_callback(int event, int x, int y, int, void* userdata) {
+    DisplayState* state = (DisplayState*)userdata;
+    if (event == cv::EVENT_MOUSEMOVE) {
+        state->curX = x;
+        state->curY = y;
+    }
+}
+
+// The frame as BGR for showing: the image itself, or converted into buffer when it is YUV
+cv::Mat& bgr_image(Frame& frame, cv::Mat& buffer) {
+    if (frame.format == RAW_FORMAT_YUYV)
+        cv::cvtColor(frame.image, buffer, cv::COLOR_YUV2BGR_YUYV);
+    else if (frame.format == RAW_FORMAT_NV12)
+        cv::cvtColor(frame.image, buffer, cv::COLOR_YUV2BGR_NV12);
+    else
+        return frame.image;
+    return buffer;
+}
+
+// Hand a copy of the frame and its detection to the render thread. This is all a worker does for
+// the preview, so detection takes just as long with the window open as without it.
+void publish_preview(Stream& stream, const Frame& frame, const Detection& detection, const cv::Rect& region,
+                     bool fullScan, const Options& options) {
+    PreviewFrame& preview = stream.preview.back();
+    frame.image.copyTo(preview.frame.image);
+    preview.frame.format = frame.format;
+    preview.frame.width = frame.width;
+    preview.frame.height = frame.height;
+    if (options.showMask)
+        stream.scratch.mask.copyTo(preview.mask);
+    preview.detection = detection;
+    preview.region = region;
+    preview.fullScan = fullScan;
+    preview.lineAxis = stream.dotTracker.has_line() ? stream.dotTracker.line_axis() : -1;
+    preview.linePosition = stream.dotTracker.line_position();
+    stream.preview.publish();
+}
+
+// Annotate the preview's frame and show it
+void show_frame(PreviewFrame& preview, const Options& options, DisplayState& state) {
+    cv::Mat& display = bgr_image(preview.frame, state.converted);
+    const Detection& detection = preview.detection;
+    const cv::Rect& region = preview.region;
+    if (detection.present) {
+        cv::rectangle(display, detection.box, cv::Scalar(0, 255, 0), 2);
+        cv::circle(display, cv::Point((int)detection.centroidX, (int)detection.centroidY), 3, cv::Scalar(0, 255, 0), -1);
+    }
+    if (options.showMask) {
+        state.masked.create(display.rows, display.cols, CV_8UC3);
+        state.masked.setTo(cv::Scalar::all(0));
+        cv::Mat maskedRegion = state.masked(region);
+        cv::bitwise_and(display(region), display(region), maskedRegion, preview.mask(region));
+        state.masked.copyTo(display);
+    }
+    if (!preview.fullScan)
+        cv::rectangle(display, region, cv::Scalar(255, 0, 0), 1);
+    if (preview.lineAxis >= 0) {
+        int position = (int)preview.linePosition;
+        if (preview.lineAxis == 0)
+            cv::line(display, cv::Point(position, 0), cv::Point(position, display.rows - 1), cv::Scalar(0, 255, 255), 1);
+        else
+            cv::line(display, cv::Point(0, position), cv::Point(display.cols - 1, position), cv::Scalar(0, 255, 255), 1);
+    }
+
+    if (state.curCount == TEXT_DISPLAY_INTERVAL) {
+        state.curCount = 0;
+        int x = std::min(std::max(state.curX.load(), 0), display.cols - 1);
+        int y = std::min(std::max(state.curY.load(), 0), display.rows - 1);
+        const uint8_t* pixel = display.ptr(y) + 3 * x;
+        bgr_to_hsv_pixel(pixel[0], pixel[1], pixel[2], state.phsv[0], state.phsv[1], state.phsv[2]);
+    }
+    state.curCount++;
+
+    char text[128];
+    snprintf(text, sizeof(text), "X: %d, Y: %d, HSV: [%d %d %d], AREA: %d",
+             state.curX.load(), state.curY.load(), state.phsv[0], state.phsv[1], state.phsv[2], detection.area);
+    cv::putText(display, text, cv::Point(10, 30), cv::FONT_HERSHEY_SIMPLEX, 0.7, cv::Scalar(0, 0, 255), 2);
+    cv::imshow(state.title, display);
+}
+
+// Render thread body, run by the main thread since HighGUI wants a single thread: show the newest
+// processed frame of each stream about once per display refresh, skipping any it had no time for
+void render_loop(std::vector<std::unique_ptr<Stream>>& streams, const Options& options) {
+    while (true) {
+        bool allDone = true;
+        for (std::unique_ptr<Stream>& stream : streams) {
+            allDone = allDone && stream->done;
+            PreviewFrame* preview = stream->preview.take();
+            if (preview != nullptr)
+                show_frame(*preview, options, stream->display);
+        }
+        if (allDone)
+            break;
+        // Exit the program if the 'q' key is pressed
+        if ((cv::waitKey(DISPLAY_INTERVAL_MS) & 0xFF) == 'q')
+            gRunning = false;
+    }
+}
+
+void print_pipeline_stats(PipelineStats& pipeline, const CaptureStats& stats, const std::string& prefix) {
+    uint64_t dropped = stats.dropped.load(std::memory_order_relaxed);
+    printf("%sStats: %llu frames, %llu dropped, %llu skipped, queue depth avg %.2f max %zu, latency ms p50/p99/max:",
+           prefix.c_str(), (unsigned long long)pipeline.frames, (unsigned long long)(dropped - pipeline.droppedBefore),
+           (unsigned long long)pipeline.skipped, pipeline.frames ? (double)pipeline.depthSum / pipeline.frames : 0.0,
+           pipeline.maxDepth);
+    const char* names[] = {"decode", "queue", "detect", "display", "total"};
+    const LatencyHistogram* histograms[] = {&pipeline.decode, &pipeline.queue, &pipeline.detect,
+                                            &pipeline.display, &pipeline.total};
+    for (int i = 0; i < 5; i++) {
+        if (histograms[i]->samples == 0)
+            continue;
+        printf(" %s %.2f/%.2f/%.2f", names[i], histograms[i]->percentile_ms(0.5),
+               histograms[i]->percentile_ms(0.99), histograms[i]->max_ms());
+    }
+    printf("\n");
+    fflush(stdout);
+
+    pipeline.decode.clear();
+    pipeline.queue.clear();
+    pipeline.detect.clear();
+    pipeline.display.clear();
+    pipeline.total.clear();
+    pipeline.frames = 0;
+    pipeline.depthSum = 0;
+    pipeline.maxDepth = 0;
+    pipeline.skipped = 0;
+    pipeline.droppedBefore = dropped;
+}
+
+// Detect, track and count on one frame of the stream, then show it
+void process_frame(Stream& stream, Frame* frame, const Options& options, const ColorModel& colors) {
+    int64_t dequeuedNs = monotonic_ns();
+    size_t depth = stream.ring.depth();
+    PipelineStats& pipeline = stream.pipeline;
+
+    if (!stream.tracker.started)
+        start_tracker(stream.tracker, frame->captureTime);
+    if (stream.recorder.is_open() &&
+        !stream.recorder.write(frame->image, frame->format, frame->width, frame->height, frame->captureTime)) {
+        perror(stream.name.c_str());
+        stream.recorder.close();
+    }
+
+    int width = frame->width, height = frame->height;
+    RegionOfInterest& roi = stream.roi;
+    if (!stream.roiConfigured) {
+        // The camera may not honor the requested size, so wait for a frame to clip the region
+        roi.area = clip_rect(options.roi, width, height);
+        stream.roiConfigured = true;
+    }
+    cv::Rect region = choose_region(roi, width, height);
+    bool fullScan = region.width == width && region.height == height;
+
+    int64_t detectStartNs = monotonic_ns();
+    Detection detection;
+    if (options.motionGate && motion_gate_skip(stream.motionGate, *frame, region)) {
+        detection = stream.lastDetection;
+        pipeline.skipped++;
+    } else {
+        detection = options.pyramid > 1
+            ? detect_dot_pyramid(*frame, region, colors, options.pyramid, options.showMask, stream.scratch)
+            : detect_dot(*frame, region, colors, options.showMask, stream.scratch);
+        // The downsampled pass alone losing a dot that was just there gets a second look on the
+        // next frame, rather than being repeated for every frame the gate would skip after it
+        if (options.motionGate && detection.coarseOnly && stream.lastDetection.present)
+            motion_gate_reset(stream.motionGate);
+        stream.lastDetection = detection;
+    }
+    double loopTime;
+    if (stream.dotTracker.update(detection.present, detection.centroidX, detection.centroidY, frame->captureTime, loopTime))
+        count_loop(stream.tracker, loopTime, stream.prefix);
+    update_region(roi, options, detection, fullScan, width, height);
+    int64_t detectEndNs = monotonic_ns();
+
+    if (options.showVideo)
+        publish_preview(stream, *frame, detection, region, fullScan, options);
+    int64_t doneNs = monotonic_ns();
+
+    pipeline.decode.add(frame->queuedNs - frame->grabNs);
+    pipeline.queue.add(dequeuedNs - frame->queuedNs);
+    pipeline.detect.add(detectEndNs - detectStartNs);
+    if (options.showVideo)
+        pipeline.display.add(doneNs - detectEndNs);
+    pipeline.total.add(doneNs - frame->grabNs);
+    pipeline.frames++;
+    pipeline.depthSum += depth;
+    pipeline.maxDepth = std::max(pipeline.maxDepth, depth);
+    if (pipeline.trace != nullptr)
+        fprintf(pipeline.trace, "%llu,%.6f,%.3f,%.3f,%.3f,%.3f,%.3f,%zu,%llu\n",
+                (unsigned long long)frame->sequence, frame->captureTime,
+                (frame->queuedNs - frame->grabNs) / 1e6, (dequeuedNs - frame->queuedNs) / 1e6,
+                (detectEndNs - detectStartNs) / 1e6, (doneNs - detectEndNs) / 1e6,
+                (doneNs - frame->grabNs) / 1e6, depth,
+                (unsigned long long)stream.stats.dropped.load(std::memory_order_relaxed));
+    if (options.showStats && doneNs - pipeline.intervalStartNs >= STATS_INTERVAL * 1e9) {
+        print_pipeline_stats(pipeline, stream.stats, stream.prefix);
+        pipeline.intervalStartNs = doneNs;
+    }
+}
+
+// Process up to WORKER_BATCH waiting frames of a stream this worker has claimed; returns how many
+int process_stream_batch(Stream& stream, const Options& options, const ColorModel& colors) {
+    int processed = 0;
+    while (processed < WORKER_BATCH) {
+        Frame* frame = stream.ring.begin_read();
+        if (frame == nullptr) {
+            // Only finished once the capture side has stopped and everything it queued is done
+            if (stream.stats.failed || stream.stats.ended || !gRunning) {
+                if (options.showStats && stream.pipeline.frames > 0)
+                    print_pipeline_stats(stream.pipeline, stream.stats, stream.prefix);
+                stream.done = true;
+            }
+            break;
+        }
+        process_frame(stream, frame, options, colors);
+        stream.ring.end_read();
+        processed++;
+    }
+    return processed;
+}
+
+// Worker pool body: sweep the streams, claim any one nobody else is processing, take a batch of
+// its frames, let it go. A stream's frames are thus processed in order, by one worker at a time.
+void worker_loop(std::vector<std::unique_ptr<Stream>>& streams, const Options& options, const ColorModel& colors) {
+    while (true) {
+        bool allDone = true;
+        int processed = 0;
+        for (std::unique_ptr<Stream>& stream : streams) {
+            if (stream->done)
+                continue;
+            allDone = false;
+            if (stream->busy.test_and_set(std::memory_order_acquire))
+                continue;
+            if (!stream->done)
+                processed += process_stream_batch(*stream, options, colors);
+            stream->busy.clear(std::memory_order_release);
+        }
+        if (allDone)
+            break;
+        if (processed == 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+    }
+}
+
+// Bounds loosened on every side, wide enough to find a dot the camera sees a little differently
+ThresholdParams loosen_bounds(const ThresholdParams& params) {
+    ThresholdParams loose = params;
+    for (int i = 0; i < params.rangeCount; i++) {
+        for (int c = 0; c < 3; c++) {
+            int slack = params.hsv && c == 0 ? CALIBRATION_SLACK_HUE : CALIBRATION_SLACK;
+            int top = params.hsv && c == 0 ? 180 : 255;
+            loose.ranges[i].lower[c] = (uint8_t)std::max(params.ranges[i].lower[c] - slack, 0);
+            loose.ranges[i].upper[c] = (uint8_t)std::min(params.ranges[i].upper[c] + slack, top);
+        }
+    }
+    return loose;
+}
+
+// Fit the bounds to the first CALIBRATION_SECONDS of the stream's frames, which are used up for
+// it. The dot is found with the current bounds loosened, so those only need to be roughly right;
+// its pixels feed the histograms, and a sparse grid over the rest of the frame the background.
+bool calibrate_colors(Stream& stream, ColorModel& colors) {
+    ColorModel seed;
+    seed.params = loosen_bounds(colors.params);
+    if (stream.source.v4l2 || stream.replay.format() != RAW_FORMAT_BGR)
+        seed.yuvLut.build_yuv(seed.params);
+    ColorCalibrator calibrator(colors.params.hsv);
+    DetectScratch scratch;
+
+    printf("Calibrating dot colors from %s for %g seconds\n", stream.name.c_str(), CALIBRATION_SECONDS);
+    fflush(stdout);
+    int frames = 0, seen = 0;
+    double firstTime = 0;
+    while (gRunning) {
+        Frame* frame = stream.ring.wait_read(std::chrono::milliseconds(100));
+        if (frame == nullptr) {
+            if (stream.stats.failed || stream.stats.ended)
+                break;
+            continue;
+        }
+        if (frames == 0)
+            firstTime = frame->captureTime;
+        if (frame->captureTime - firstTime >= CALIBRATION_SECONDS)
+            break;  // left in the ring for the workers
+        frames++;
+
+        Detection detection = detect_dot(*frame, cv::Rect(0, 0, frame->width, frame->height), seed, false, scratch);
+        uint8_t bgr[3];
+        if (detection.present) {
+            seen++;
+            const cv::Rect& box = detection.box;
+            for (int y = box.y; y < box.y + box.height; y++) {
+                const uint8_t* mask = scratch.mask.ptr(y);
+                for (int x = box.x; x < box.x + box.width; x++) {
+                    if (mask[x] == 0)
+                        continue;
+                    frame_pixel_bgr(*frame, x, y, bgr);
+                    calibrator.add_dot(bgr[0], bgr[1], bgr[2]);
+                }
+            }
+        }
+        for (int y = CALIBRATION_SAMPLE_STEP / 2; y < frame->height; y += CALIBRATION_SAMPLE_STEP) {
+            for (int x = CALIBRATION_SAMPLE_STEP / 2; x < frame->width; x += CALIBRATION_SAMPLE_STEP) {
+                if (detection.present && detection.box.contains(cv::Point(x, y)))
+                    continue;
+                frame_pixel_bgr(*frame, x, y, bgr);
+                calibrator.add_background(bgr[0], bgr[1], bgr[2]);
+            }
+        }
+        stream.ring.end_read();
+    }
+
+    ThresholdParams fitted;
+    if (seen < CALIBRATION_MIN_FRAMES || !calibrator.fit(fitted)) {
+        printf("Calibration failed: dot seen in %d of %d frames, keeping the default bounds\n", seen, frames);
+        return false;
+    }
+    colors.params = fitted;
+    for (int i = 0; i < fitted.rangeCount; i++) {
+        const ThresholdRange& range = fitted.ranges[i];
+        printf("Calibrated %s bounds: [%d %d %d] - [%d %d %d]\n", fitted.hsv ? "HSV" : "BGR",
+               range.lower[0], range.lower[1], range.lower[2], range.upper[0], range.upper[1], range.upper[2]);
+    }
+    printf("From %llu dot pixels in %d of %d frames; %.3f%% of the background falls inside\n",
+           (unsigned long long)calibrator.dot_pixels(), seen, frames, 100 * calibrator.background_fraction(fitted));
+    fflush(stdout);
+    return true;
+}
+
+// One session's line of activity_log.txt, written when it ended
+void write_activity_line(FILE* log, time_t when, double distance, double elapsedTimeMin) {
+    char timestamp[32];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&when));
+    fprintf(log, "%s,%s,miles,%s,minutes\n", timestamp,
+            format_python_float(distance).c_str(), format_python_float(elapsedTimeMin).c_str());
+}
+
+// Print the sessions of an event log the way activity_log.txt would have them, from its index
+bool print_activity_log(const std::string& path) {
+    std::vector<EventLogSession> sessions;
+    if (!read_event_log_sessions(path, sessions)) {
+        perror(path.c_str());
+        return false;
+    }
+    for (const EventLogSession& session : sessions)
+        write_activity_line(stdout, (time_t)session.lastWallTime, session.distance, session.elapsedMinutes);
+    return true;
+}
+
+void cleanup(Stream& stream, const std::string& activityLogPath) {
+    SpeedTracker& tracker = stream.tracker;
+    printf("%sNumber of loops detected: %d\n", stream.prefix.c_str(), tracker.loopCount);
+    printf("%sFrames captured: %llu, dropped: %llu\n", stream.prefix.c_str(),
+           (unsigned long long)stream.stats.captured.load(), (unsigned long long)stream.stats.dropped.load());
+    if (stream.motionGate.checked > 0)
+        printf("%sFrames skipped as unchanged: %llu (%.1f%%)\n", stream.prefix.c_str(),
+               (unsigned long long)stream.motionGate.skipped, 100.0 * stream.motionGate.skipped / stream.motionGate.checked);
+    if (tracker.loopLog != nullptr)
+        fclose(tracker.loopLog);
+    tracker.events.close(wall_clock_seconds());
+    if (stream.pipeline.trace != nullptr)
+        fclose(stream.pipeline.trace);
+    if (stream.source.replay)
+        return;
+
+    FILE* log = fopen(activityLogPath.c_str(), "a");
+    if (log == NULL) {
+        perror(activityLogPath.c_str());
+        return;
+    }
+    write_activity_line(log, time(NULL), tracker.distance, tracker.elapsedTimeMin);
+    fclose(log);
+}
+
+void signal_handler(int) {
+    gSignalled = 1;
+    gRunning = false;
+}
+
+// With several streams, output files get the stream number before their extension
+std::string stream_path(const std::string& path, int index, size_t count) {
+    if (count == 1)
+        return path;
+    size_t slash = path.rfind('/');
+    size_t dot = path.rfind('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash) || dot == 0)
+        dot = path.size();
+    return path.substr(0, dot) + "-" + std::to_string(index) + path.substr(dot);
+}
+
+bool open_stream(Stream& stream, const Options& options, size_t count) {
+    if (stream.source.replay) {
+        stream.name = stream.source.path;
+        if (!stream.replay.open(stream.source.path)) {
+            fprintf(stderr, "Cannot open %s for replay\n", stream.source.path.c_str());
+            return false;
+        }
+    } else if (stream.source.v4l2) {
+        stream.name = stream.source.path;
+        uint32_t fourcc = options.v4l2Format == RAW_FORMAT_NV12 ? V4L2_PIX_FMT_NV12 : V4L2_PIX_FMT_YUYV;
+        if (!stream.v4l2.open(stream.source.path, FRAME_WIDTH, FRAME_HEIGHT, fourcc, FRAME_RATE))
+            return false;
+    } else {
+        // Set up the video capture
+        stream.name = "camera " + std::to_string(stream.source.device);
+        stream.cap.open(stream.source.device);
+        stream.cap.set(cv::CAP_PROP_FRAME_WIDTH, FRAME_WIDTH);
+        stream.cap.set(cv::CAP_PROP_FRAME_HEIGHT, FRAME_HEIGHT);
+        stream.cap.set(cv::CAP_PROP_FPS, FRAME_RATE);
+    }
+    if (count > 1)
+        stream.prefix = "[" + stream.name + "] ";
+    stream.display.title = count > 1 ? std::string(WIN_TITLE) + " - " + stream.name : WIN_TITLE;
+
+    if (!options.recordPath.empty()) {
+        std::string path = stream_path(options.recordPath, stream.index, count);
+        if (!stream.recorder.open(path)) {
+            perror(path.c_str());
+            return false;
+        }
+    }
+    if (!options.tracePath.empty()) {
+        std::string path = stream_path(options.tracePath, stream.index, count);
+        stream.pipeline.trace = fopen(path.c_str(), "w");
+        if (stream.pipeline.trace == NULL) {
+            perror(path.c_str());
+            return false;
+        }
+        fprintf(stream.pipeline.trace, "sequence,capture_time_s,decode_ms,queue_ms,detect_ms,display_ms,total_ms,queue_depth,dropped\n");
+    }
+    if (!options.loopLogPath.empty()) {
+        std::string path = stream_path(options.loopLogPath, stream.index, count);
+        stream.tracker.loopLog = fopen(path.c_str(), "w");
+        if (stream.tracker.loopLog == NULL) {
+            perror(path.c_str());
+            return false;
+        }
+        fprintf(stream.tracker.loopLog, "loop,time_s,loop_time_s,speed_mph,distance_mi\n");
+    }
+    if (!options.eventLogPath.empty()) {
+        std::string path = stream_path(options.eventLogPath, stream.index, count);
+        if (!stream.tracker.events.open(path, wall_clock_seconds())) {
+            perror(path.c_str());
+            return false;
+        }
+    }
+    if (options.lineAxis >= 0)
+        stream.dotTracker.set_line(options.lineAxis, options.linePosition);
+
+    // Preallocate every frame buffer up front so the capture thread never allocates
+    for (size_t i = 0; i < stream.ring.capacity(); i++) {
+        if (stream.source.v4l2)
+            create_frame_image(stream.ring.slot(i).image, options.v4l2Format, stream.v4l2.width(), stream.v4l2.height());
+        else
+            stream.ring.slot(i).image.create(FRAME_HEIGHT, FRAME_WIDTH, CV_8UC3);
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (!parse_command_line_arguments(argc, argv, options))
+        return 0;
+    if (!options.convertPath.empty())
+        return print_activity_log(options.convertPath) ? 0 : 1;
+    if (options.sources.empty())
+        options.sources.push_back(StreamSource());
+    ColorModel colors;
+    colors.params = select_color_bounds(options);
+    if (!options.boundsPath.empty() && !load_threshold_params(options.boundsPath, colors.params)) {
+        perror(options.boundsPath.c_str());
+        return 1;
+    }
+
+    printf("Arguments: Show Video: %s, Use Blue: %s, Show Mask: %s, Use BGR: %s\n",
+           options.showVideo ? "True" : "False", options.useBlue ? "True" : "False",
+           options.showMask ? "True" : "False", options.useBgr ? "True" : "False");
+
+    std::vector<std::unique_ptr<Stream>> streams;
+    bool needYuvLut = false;
+    for (size_t i = 0; i < options.sources.size(); i++) {
+        streams.push_back(std::make_unique<Stream>());
+        streams.back()->index = (int)i;
+        streams.back()->source = options.sources[i];
+        if (!open_stream(*streams.back(), options, options.sources.size()))
+            return 1;
+        if (streams.back()->source.v4l2 || streams.back()->replay.format() != RAW_FORMAT_BGR)
+            needYuvLut = true;
+    }
+
+    int workers = options.workers > 0 ? options.workers
+        : (int)std::min<size_t>(streams.size(), std::max(1u, std::thread::hardware_concurrency()));
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = signal_handler;
+    sigaction(SIGINT, &action, NULL);
+
+    if (options.showVideo) {
+        for (std::unique_ptr<Stream>& stream : streams) {
+            cv::namedWindow(stream->display.title);
+            cv::setMouseCallback(stream->display.title, mouse_callback, &stream->display);
+        }
+    }
+
+    for (std::unique_ptr<Stream>& stream : streams) {
+        Stream& s = *stream;
+        if (s.source.replay)
+            s.captureThread = std::thread(replay_loop, std::ref(s.replay), std::ref(s.ring), std::ref(s.stats));
+        else if (s.source.v4l2)
+            s.captureThread = std::thread(v4l2_capture_loop, std::ref(s.v4l2), options.v4l2Format,
+                                          std::ref(s.ring), std::ref(s.stats));
+        else
+            s.captureThread = std::thread(capture_loop, std::ref(s.cap), std::ref(s.ring), std::ref(s.stats));
+    }
+
+    // Calibrating holds up processing of every stream; live ones drop frames meanwhile
+    if (!options.calibratePath.empty() && calibrate_colors(*streams[0], colors) &&
+        !save_threshold_params(options.calibratePath, colors.params))
+        perror(options.calibratePath.c_str());
+    if (options.useLut || !options.calibratePath.empty() || !options.boundsPath.empty())
+        colors.lut.build(colors.params);
+    if (needYuvLut)
+        colors.yuvLut.build_yuv(colors.params);
+
+    int64_t startNs = monotonic_ns();
+    for (std::unique_ptr<Stream>& stream : streams) {
+        // Live runs time the session from startup like the Python version; replays from their first frame
+        if (!stream->source.replay)
+            start_tracker(stream->tracker, startNs / 1e9);
+        stream->pipeline.intervalStartNs = startNs;
+    }
+
+    // The main thread is one of the workers, or the render thread when there is a preview to drive
+    std::vector<std::thread> workerThreads;
+    for (int i = options.showVideo ? 0 : 1; i < workers; i++)
+        workerThreads.emplace_back(worker_loop, std::ref(streams), std::cref(options), std::cref(colors));
+    if (options.showVideo)
+        render_loop(streams, options);
+    else
+        worker_loop(streams, options, colors);
+    for (std::thread& thread : workerThreads)
+        thread.join();
+    gRunning = false;
+
+    for (std::unique_ptr<Stream>& stream : streams)
+        stream->captureThread.join();
+
+    if (gSignalled)
+        printf("Exiting via signal handler\n");
+    for (std::unique_ptr<Stream>& stream : streams) {
+        if (stream->stats.failed && !gSignalled)
+            printf("%sError: No frame captured\n", stream->prefix.c_str());
+        stream->cap.release();
+        stream->v4l2.close();
+        stream->recorder.close();
+        cleanup(*stream, stream_path("activity_log.txt", stream->index, streams.size()));
+    }
+    cv::destroyAllWindows();
+    return 0;
+}
@@ -0,0 +1,40 @@
+// Lock-free hand-off of the newest value from one producer thread to one consumer thread. There
+// are three slots: the producer fills its back slot and swaps it into the middle, the consumer
+// swaps the middle into its front slot when something new is there. Neither side ever waits on
+// the other, and a value the consumer did not get to in time is simply overwritten by the next.
+
+#pragma once
+
+#include <atomic>
+
+template <typename T>
+class TripleBuffer {
+public:
+    // Producer: the slot to fill next; its contents are whatever was handed off three values ago
+    T& back() { return slots_[back_]; }
+
+    // Producer: make the back slot the newest value, replacing one the consumer never took
+    void publish() {
+        int old = middle_.exchange(back_ | FRESH, std::memory_order_acq_rel);
+        back_ = old & INDEX;
+    }
+
+    // Consumer: the newest value, or nullptr if nothing was published since the last call.
+    // The value stays valid (and untouched by the producer) until the next call.
+    T* take() {
+        if ((middle_.load(std::memory_order_relaxed) & FRESH) == 0)
+            return nullptr;
+        int old = middle_.exchange(front_, std::memory_order_acq_rel);
+        front_ = old & INDEX;
+        return &slots_[front_];
+    }
+
+private:
+    static const int INDEX = 3;
+    static const int FRESH = 4;
+
+    T slots_[3];
+    int back_ = 0;
+    int front_ = 1;
+    std::atomic<int> middle_{2};
+};
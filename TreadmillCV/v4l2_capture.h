@@ -0,0 +1,187 @@
+// Direct V4L2 capture with memory-mapped driver buffers. The camera's native YUYV or NV12 frames
+// are handed out in place, without the BGR conversion cv::VideoCapture does on every frame, and
+// with the driver's own timestamp of when the frame was captured, if the driver says it is on
+// CLOCK_MONOTONIC.
+
+#pragma once
+
+#include <linux/videodev2.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+const int V4L2_BUFFER_COUNT = 4;
+
+class V4l2Capture {
+public:
+    ~V4l2Capture() { close(); }
+
+    // Open device and start streaming width x height frames in fourcc (V4L2_PIX_FMT_YUYV or
+    // V4L2_PIX_FMT_NV12). The driver may round the size; width() and height() say what it chose.
+    bool open(const std::string& device, int width, int height, uint32_t fourcc, int fps) {
+        fd_ = ::open(device.c_str(), O_RDWR | O_NONBLOCK);
+        if (fd_ < 0) {
+            perror(device.c_str());
+            return false;
+        }
+
+        struct v4l2_format format;
+        memset(&format, 0, sizeof(format));
+        format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        format.fmt.pix.width = width;
+        format.fmt.pix.height = height;
+        format.fmt.pix.pixelformat = fourcc;
+        format.fmt.pix.field = V4L2_FIELD_NONE;
+        if (xioctl(VIDIOC_S_FMT, &format) < 0) {
+            perror("VIDIOC_S_FMT");
+            return false;
+        }
+        if (format.fmt.pix.pixelformat != fourcc) {
+            fprintf(stderr, "%s does not support the requested pixel format\n", device.c_str());
+            return false;
+        }
+        width_ = format.fmt.pix.width;
+        height_ = format.fmt.pix.height;
+        bytesPerLine_ = format.fmt.pix.bytesperline;
+
+        struct v4l2_streamparm parm;
+        memset(&parm, 0, sizeof(parm));
+        parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        parm.parm.capture.timeperframe.numerator = 1;
+        parm.parm.capture.timeperframe.denominator = fps;
+        xioctl(VIDIOC_S_PARM, &parm);  // best effort, not every driver lets the rate be set
+
+        struct v4l2_requestbuffers request;
+        memset(&request, 0, sizeof(request));
+        request.count = V4L2_BUFFER_COUNT;
+        request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        request.memory = V4L2_MEMORY_MMAP;
+        if (xioctl(VIDIOC_REQBUFS, &request) < 0) {
+            perror("VIDIOC_REQBUFS");
+            return false;
+        }
+
+        for (unsigned i = 0; i < request.count; i++) {
+            struct v4l2_buffer buffer;
+            memset(&buffer, 0, sizeof(buffer));
+            buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            buffer.memory = V4L2_MEMORY_MMAP;
+            buffer.index = i;
+            if (xioctl(VIDIOC_QUERYBUF, &buffer) < 0) {
+                perror("VIDIOC_QUERYBUF");
+                return false;
+            }
+            void* start = mmap(nullptr, buffer.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, buffer.m.offset);
+            if (start == MAP_FAILED) {
+                perror("mmap");
+                return false;
+            }
+            buffers_.push_back({(uint8_t*)start, buffer.length});
+            if (xioctl(VIDIOC_QBUF, &buffer) < 0) {
+                perror("VIDIOC_QBUF");
+                return false;
+            }
+        }
+
+        int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (xioctl(VIDIOC_STREAMON, &type) < 0) {
+            perror("VIDIOC_STREAMON");
+            return false;
+        }
+        streaming_ = true;
+        return true;
+    }
+
+    // Wait up to timeoutMs for the next frame and borrow its buffer until release().
+    // Returns false on timeout or error.
+    bool grab(int timeoutMs) {
+        struct pollfd pfd = {fd_, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeoutMs);
+        if (ready <= 0) {
+            if (ready < 0 && errno != EINTR)
+                perror("poll");
+            return false;
+        }
+
+        memset(&current_, 0, sizeof(current_));
+        current_.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        current_.memory = V4L2_MEMORY_MMAP;
+        if (xioctl(VIDIOC_DQBUF, &current_) < 0) {
+            if (errno != EAGAIN)
+                perror("VIDIOC_DQBUF");
+            return false;
+        }
+        held_ = true;
+        return true;
+    }
+
+    const uint8_t* data() const { return buffers_[current_.index].start; }
+    size_t size() const { return current_.bytesused; }
+
+    // Whether the held frame's timestamp is on CLOCK_MONOTONIC. Drivers that copy it from
+    // elsewhere (V4L2_BUF_FLAG_TIMESTAMP_COPY) or don't say (UNKNOWN) can be on any clock.
+    bool has_monotonic_timestamp() const {
+        return (current_.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    }
+
+    // When the driver captured the held frame, in seconds; only on CLOCK_MONOTONIC if
+    // has_monotonic_timestamp()
+    double timestamp() const { return current_.timestamp.tv_sec + current_.timestamp.tv_usec / 1e6; }
+
+    // Give the held buffer back to the driver
+    void release() {
+        if (held_ && xioctl(VIDIOC_QBUF, &current_) < 0)
+            perror("VIDIOC_QBUF");
+        held_ = false;
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    int bytes_per_line() const { return bytesPerLine_; }
+
+    void close() {
+        if (fd_ < 0)
+            return;
+        release();
+        if (streaming_) {
+            int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            xioctl(VIDIOC_STREAMOFF, &type);
+            streaming_ = false;
+        }
+        for (const Buffer& buffer : buffers_)
+            munmap(buffer.start, buffer.length);
+        buffers_.clear();
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+private:
+    struct Buffer {
+        uint8_t* start;
+        size_t length;
+    };
+
+    int xioctl(unsigned long request, void* arg) {
+        int result;
+        do
+            result = ioctl(fd_, request, arg);
+        while (result < 0 && errno == EINTR);
+        return result;
+    }
+
+    int fd_ = -1;
+    bool streaming_ = false;
+    bool held_ = false;
+    int width_ = 0, height_ = 0, bytesPerLine_ = 0;
+    std::vector<Buffer> buffers_;
+    struct v4l2_buffer current_ = {};
+};
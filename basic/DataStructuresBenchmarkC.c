@@ -0,0 +1,520 @@
+/*
+    Performance tests for the C data structures, to go with the unit tests in
+    DataStructuresPython.py: the hash table (HashTableC.c), the stack (StackC.c) and the
+    priority queues (PriorityQueueC.c). The data structure files are compiled straight into
+    this program, with their own test programs left out.
+
+    The hash table is measured with insert/get/remove mixes, with keys drawn uniformly or
+    from a Zipfian distribution (a few very popular keys, like most real traffic), at table
+    sizes from "fits in L1 cache" up to ten times the last-level cache, where nearly every
+    lookup is a cache miss. The concurrent structures are measured at increasing thread
+    counts. Every workload uses a fixed random seed, so two runs do exactly the same work.
+
+    Results can be saved as CSV and compared against a saved run from an earlier commit;
+    any benchmark that got more than 10% slower is reported and the program exits with
+    status 2, so it can run as a check before changes to these structures are merged:
+        gcc -O2 -pthread DataStructuresBenchmarkC.c -o dsbench -lm
+        ./dsbench --csv before.csv                       (on the old commit)
+        ./dsbench --compare before.csv --csv after.csv   (on the new commit)
+    Other options: --quick (smaller runs, no tables bigger than the LLC), --threads N,
+    --threshold percent (how much slower counts as a regression; raise it on noisy machines)
+*/
+
+#define _GNU_SOURCE
+#define DATASTRUCTURES_NO_MAIN
+#include "HashTableC.c"
+#include "StackC.c"
+#include "PriorityQueueC.c"
+
+#include <math.h>
+
+#define MAX_RESULTS 256
+#define REPEATS 3                       // each benchmark reports its best of this many runs
+#define BYTES_PER_ENTRY 56              // entry + buckets + key/value strings, roughly
+#define GET_MANY_BATCH 1000
+
+typedef struct Result {
+    char name[96];
+    long entries;
+    int threads;
+    long ops;
+    double seconds;
+} Result;
+
+typedef struct Zipf {
+    long n;
+    double theta, alpha, zetan, eta;
+} Zipf;
+
+typedef struct KeyChooser {
+    int zipfian;
+    long n;
+    Zipf zipf;
+    unsigned long long state;
+} KeyChooser;
+
+typedef struct Mix {
+    const char* name;
+    int getPercent;
+    int insertPercent;                  // whatever is left over is removes
+} Mix;
+
+static const Mix gMixes[] = {
+    { "read-only", 100, 0 },
+    { "read-heavy", 90, 5 },
+    { "write-heavy", 50, 25 },
+};
+
+static Result gResults[MAX_RESULTS];
+static int gResultCount = 0;
+static int gQuick = 0;
+static int gMaxThreads = 8;
+static double gRegressionThreshold = 0.10;     // report anything this much slower than the baseline
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_result(const char* name, long entries, int threads, long ops, double seconds) {
+    if (gResultCount == MAX_RESULTS)
+        return;
+    Result* r = &gResults[gResultCount++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->entries = entries;
+    r->threads = threads;
+    r->ops = ops;
+    r->seconds = seconds;
+    printf("%-58s %10ld entries %3d threads %8.2f Mops/s\n", name, entries, threads, ops / seconds / 1e6);
+    fflush(stdout);
+}
+
+// Random numbers with a seed we choose, so workloads repeat exactly
+
+static unsigned long long splitmix(unsigned long long* state) {
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Zipfian ranks in [0, n) (Gray et al., "Quickly Generating Billion-Record Synthetic Databases")
+static void zipf_init(Zipf* z, long n, double theta) {
+    z->n = n;
+    z->theta = theta;
+    z->zetan = 0;
+    for (long i = 1; i <= n; i++)
+        z->zetan += 1.0 / pow((double)i, theta);
+    double zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static long zipf_next(Zipf* z, unsigned long long* state) {
+    double u = (splitmix(state) >> 11) * (1.0 / 9007199254740992.0);
+    double uz = u * z->zetan;
+    if (uz < 1.0)
+        return 0;
+    if (uz < 1.0 + pow(0.5, z->theta))
+        return 1;
+    long rank = (long)(z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
+}
+
+static void chooser_init(KeyChooser* c, long n, int zipfian, const Zipf* zipf, unsigned long long seed) {
+    c->n = n;
+    c->zipfian = zipfian;
+    if (zipfian)
+        c->zipf = *zipf;
+    c->state = seed;
+}
+
+static long chooser_next(KeyChooser* c) {
+    if (!c->zipfian)
+        return (long)(splitmix(&c->state) % c->n);
+    // Scatter the popular ranks over the key space, so they don't sit next to each other in memory
+    return (long)(((unsigned long long)zipf_next(&c->zipf, &c->state) * 0x9E3779B97F4A7C15ULL) % c->n);
+}
+
+// Hash table benchmarks
+
+typedef struct HashTableWorkload {
+    HashTable* ht;
+    char** keys;
+    KeyChooser chooser;
+    const Mix* mix;
+    long ops;
+    int batched;
+} HashTableWorkload;
+
+static void* hashtable_worker(void* arg) {
+    HashTableWorkload* w = (HashTableWorkload*)arg;
+    long found = 0;
+    if (w->batched) {
+        const char* batch[GET_MANY_BATCH];
+        const char* values[GET_MANY_BATCH];
+        for (long done = 0; done < w->ops; done += GET_MANY_BATCH) {
+            for (int i = 0; i < GET_MANY_BATCH; i++)
+                batch[i] = w->keys[chooser_next(&w->chooser)];
+            ht_get_many(w->ht, batch, GET_MANY_BATCH, values);
+            found += (values[0] != NULL);
+        }
+    } else {
+        for (long i = 0; i < w->ops; i++) {
+            const char* key = w->keys[chooser_next(&w->chooser)];
+            int choice = (int)(splitmix(&w->chooser.state) % 100);
+            if (choice < w->mix->getPercent)
+                found += (ht_get(w->ht, key) != NULL);
+            else if (choice < w->mix->getPercent + w->mix->insertPercent)
+                ht_insert(w->ht, key, "value");
+            else
+                ht_remove(w->ht, key);
+        }
+    }
+    return (void*)found;
+}
+
+static double run_hashtable(HashTable* ht, char** keys, long keySpace, int zipfian, const Zipf* zipf,
+                            const Mix* mix, int batched, int threads, long ops) {
+    pthread_t tids[64];
+    HashTableWorkload work[64];
+    for (int t = 0; t < threads; t++) {
+        work[t].ht = ht;
+        work[t].keys = keys;
+        work[t].mix = mix;
+        work[t].ops = ops / threads;
+        work[t].batched = batched;
+        chooser_init(&work[t].chooser, keySpace, zipfian, zipf, 1000 + t);
+    }
+
+    double start = now_seconds();
+    if (threads == 1) {
+        hashtable_worker(&work[0]);
+    } else {
+        for (int t = 0; t < threads; t++)
+            pthread_create(&tids[t], NULL, hashtable_worker, &work[t]);
+        for (int t = 0; t < threads; t++)
+            pthread_join(tids[t], NULL);
+    }
+    return now_seconds() - start;
+}
+
+// Insert keys [0, n) into a fresh table, with no rehash left in progress
+static double build_table(HashTable* ht, char** keys, long n) {
+    double start = now_seconds();
+    if (ht_init(ht, HT_MIN_BUCKETS) != 0) {
+        perror("Failed to create hash table");
+        exit(1);
+    }
+    for (long i = 0; i < n; i++)
+        ht_insert(ht, keys[i], "value");
+    double elapsed = now_seconds() - start;
+
+    // Lookups only change the table while it is rehashing; once that's done,
+    // several threads can safely share it for read-only runs
+    while (ht_is_rehashing(ht))
+        ht_rehash_step(ht);
+    return elapsed;
+}
+
+static void benchmark_hashtable(const char* label, long entries) {
+    char name[96];
+    long ops = gQuick ? 200000 : 2000000;
+
+    // Writes use a key space twice the table size, so about half of the inserts and
+    // removes find their key and the table stays near its starting size
+    long keySpace = entries * 2;
+    char** keys = malloc(keySpace * sizeof(char*));
+    char* keyText = malloc(keySpace * 24);
+    for (long i = 0; i < keySpace; i++) {
+        keys[i] = keyText + i * 24;
+        snprintf(keys[i], 24, "key%ld", (long)((i * 0x9E3779B1UL) % keySpace));
+    }
+    Zipf zipfRead, zipfWrite;
+    zipf_init(&zipfRead, entries, 0.99);
+    zipf_init(&zipfWrite, keySpace, 0.99);
+
+    HashTable ht;
+    double best = 1e30;
+    for (int r = 0; r < REPEATS; r++) {
+        double elapsed = build_table(&ht, keys, entries);
+        best = elapsed < best ? elapsed : best;
+        if (r + 1 < REPEATS)
+            ht_destroy(&ht);
+    }
+    snprintf(name, sizeof(name), "hashtable/insert/sequential/%s", label);
+    add_result(name, entries, 1, entries, best);
+
+    for (int zipfian = 0; zipfian <= 1; zipfian++) {
+        const char* distribution = zipfian ? "zipf" : "uniform";
+
+        // Read-only runs share one table across threads and leave it unchanged
+        for (int threads = 1; threads <= gMaxThreads; threads *= 2) {
+            best = 1e30;
+            for (int r = 0; r < REPEATS; r++) {
+                double elapsed = run_hashtable(&ht, keys, entries, zipfian, &zipfRead, &gMixes[0], 0, threads, ops);
+                best = elapsed < best ? elapsed : best;
+            }
+            snprintf(name, sizeof(name), "hashtable/read-only/%s/%s", distribution, label);
+            add_result(name, entries, threads, ops, best);
+        }
+
+        best = 1e30;
+        for (int r = 0; r < REPEATS; r++) {
+            double elapsed = run_hashtable(&ht, keys, entries, zipfian, &zipfRead, &gMixes[0], 1, 1, ops);
+            best = elapsed < best ? elapsed : best;
+        }
+        snprintf(name, sizeof(name), "hashtable/get_many/%s/%s", distribution, label);
+        add_result(name, entries, 1, ops, best);
+
+        // The table isn't thread-safe for writers, so mixes with writes run on one thread,
+        // each on a freshly built table
+        for (size_t m = 1; m < sizeof(gMixes) / sizeof(gMixes[0]); m++) {
+            best = 1e30;
+            for (int r = 0; r < REPEATS; r++) {
+                ht_destroy(&ht);
+                build_table(&ht, keys, entries);
+                double elapsed = run_hashtable(&ht, keys, keySpace, zipfian, &zipfWrite, &gMixes[m], 0, 1, ops);
+                best = elapsed < best ? elapsed : best;
+            }
+            snprintf(name, sizeof(name), "hashtable/%s/%s/%s", gMixes[m].name, distribution, label);
+            add_result(name, entries, 1, ops, best);
+        }
+    }
+
+    ht_destroy(&ht);
+    free(keyText);
+    free(keys);
+}
+
+// Stack benchmarks
+
+typedef struct StackWorkload {
+    Stack* stack;
+    long ops;
+    int bulk;
+} StackWorkload;
+
+static void* stack_worker(void* arg) {
+    StackWorkload* w = (StackWorkload*)arg;
+    void* batch[8];
+    for (long i = 0; i < w->ops; i++) {
+        if (w->bulk) {
+            long got = stack_pop_many(w->stack, batch, 8);
+            stack_push_many(w->stack, batch, got);
+        } else if (stack_pop(w->stack, &batch[0]) == 0) {
+            stack_push(w->stack, batch[0]);
+        }
+    }
+    return NULL;
+}
+
+static void benchmark_stack() {
+    char name[96];
+    long ops = gQuick ? 200000 : 2000000;
+    for (int bulk = 0; bulk <= 1; bulk++) {
+        for (int threads = 1; threads <= gMaxThreads; threads *= 2) {
+            double best = 1e30;
+            for (int r = 0; r < REPEATS; r++) {
+                Stack s;
+                pthread_t tids[64];
+                StackWorkload work = { &s, ops / threads, bulk };
+                stack_init(&s, 65536);
+                for (long i = 0; i < 32768; i++)
+                    stack_push(&s, (void*)i);
+                double start = now_seconds();
+                for (int t = 0; t < threads; t++)
+                    pthread_create(&tids[t], NULL, stack_worker, &work);
+                for (int t = 0; t < threads; t++)
+                    pthread_join(tids[t], NULL);
+                double elapsed = now_seconds() - start;
+                best = elapsed < best ? elapsed : best;
+                stack_destroy(&s);
+            }
+            snprintf(name, sizeof(name), "stack/%s", bulk ? "pop_many+push_many(8)" : "pop+push");
+            add_result(name, 32768, threads, ops, best);
+        }
+    }
+}
+
+// Priority queue benchmarks
+
+typedef struct QueueWorkload {
+    void* queue;
+    int multiQueue;
+    long ops;
+    unsigned long long seed;
+} QueueWorkload;
+
+static void* queue_worker(void* arg) {
+    QueueWorkload* w = (QueueWorkload*)arg;
+    void* item;
+    for (long i = 0; i < w->ops; i++) {
+        int priority = (int)(splitmix(&w->seed) % 1000000);
+        if (w->multiQueue) {
+            mq_enqueue(w->queue, NULL, priority);
+            mq_dequeue(w->queue, &item, NULL);
+        } else {
+            pq_enqueue(w->queue, NULL, priority);
+            pq_dequeue(w->queue, &item, NULL);
+        }
+    }
+    return NULL;
+}
+
+static void benchmark_priority_queues() {
+    char name[96];
+    long ops = gQuick ? 200000 : 2000000;
+    const long prefill = 100000;
+    for (int multiQueue = 0; multiQueue <= 1; multiQueue++) {
+        for (int threads = 1; threads <= gMaxThreads; threads *= 2) {
+            double best = 1e30;
+            for (int r = 0; r < REPEATS; r++) {
+                PriorityQueue pq;
+                MultiQueue mq;
+                pthread_t tids[64];
+                QueueWorkload work[64];
+                unsigned long long seed = 42;
+                if (multiQueue)
+                    mq_init(&mq, threads, 2);
+                else
+                    pq_init(&pq);
+                for (long i = 0; i < prefill; i++) {
+                    if (multiQueue)
+                        mq_enqueue(&mq, NULL, (int)(splitmix(&seed) % 1000000));
+                    else
+                        pq_enqueue(&pq, NULL, (int)(splitmix(&seed) % 1000000));
+                }
+                for (int t = 0; t < threads; t++) {
+                    work[t].queue = multiQueue ? (void*)&mq : (void*)&pq;
+                    work[t].multiQueue = multiQueue;
+                    work[t].ops = ops / threads;
+                    work[t].seed = 2000 + t;
+                }
+                double start = now_seconds();
+                for (int t = 0; t < threads; t++)
+                    pthread_create(&tids[t], NULL, queue_worker, &work[t]);
+                for (int t = 0; t < threads; t++)
+                    pthread_join(tids[t], NULL);
+                double elapsed = now_seconds() - start;
+                best = elapsed < best ? elapsed : best;
+                if (multiQueue)
+                    mq_destroy(&mq);
+                else
+                    pq_destroy(&pq);
+            }
+            snprintf(name, sizeof(name), "%s/enqueue+dequeue", multiQueue ? "multiqueue" : "priorityqueue");
+            add_result(name, prefill, threads, ops, best);
+        }
+    }
+}
+
+// Saving and comparing results
+
+static int write_csv(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        perror("Failed to write results");
+        return -1;
+    }
+    fprintf(f, "benchmark,entries,threads,ops,seconds,mops\n");
+    for (int i = 0; i < gResultCount; i++) {
+        Result* r = &gResults[i];
+        fprintf(f, "%s,%ld,%d,%ld,%.6f,%.4f\n", r->name, r->entries, r->threads, r->ops, r->seconds, r->ops / r->seconds / 1e6);
+    }
+    fclose(f);
+    return 0;
+}
+
+// Returns the number of regressions, or -1 if the baseline can't be read
+static int compare_csv(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        perror("Failed to read baseline results");
+        return -1;
+    }
+
+    char line[256], name[96];
+    long entries, ops;
+    int threads, regressions = 0;
+    double seconds, mops;
+    printf("\n%-58s %7s %10s %10s %8s\n", "benchmark", "threads", "before", "after", "change");
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "%95[^,],%ld,%d,%ld,%lf,%lf", name, &entries, &threads, &ops, &seconds, &mops) != 6)
+            continue;
+        for (int i = 0; i < gResultCount; i++) {
+            Result* r = &gResults[i];
+            if (strcmp(r->name, name) != 0 || r->threads != threads || r->entries != entries)
+                continue;
+            double now = r->ops / r->seconds / 1e6;
+            double change = (now - mops) / mops;
+            int regressed = change < -gRegressionThreshold;
+            regressions += regressed;
+            printf("%-58s %7d %10.2f %10.2f %+7.1f%%%s\n", name, threads, mops, now, change * 100,
+                   regressed ? "  REGRESSION" : "");
+        }
+    }
+    fclose(f);
+    return regressions;
+}
+
+static long cache_size(int name, long fallback) {
+    long size = sysconf(name);
+    return size > 0 ? size : fallback;
+}
+
+int main(int argc, char* argv[]) {
+    const char* csvPath = NULL;
+    const char* comparePath = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--quick") == 0) {
+            gQuick = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            gMaxThreads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            gRegressionThreshold = atof(argv[++i]) / 100;
+        } else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc) {
+            csvPath = argv[++i];
+        } else if (strcmp(argv[i], "--compare") == 0 && i + 1 < argc) {
+            comparePath = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--quick] [--threads N] [--csv results.csv] [--compare baseline.csv] [--threshold percent]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (gMaxThreads < 1 || gMaxThreads > 64)
+        gMaxThreads = 8;
+
+    long l1 = cache_size(_SC_LEVEL1_DCACHE_SIZE, 32 * 1024);
+    long l2 = cache_size(_SC_LEVEL2_CACHE_SIZE, 1024 * 1024);
+    long llc = cache_size(_SC_LEVEL3_CACHE_SIZE, l2);
+    printf("Caches: L1 %ldKB, L2 %ldKB, LLC %ldKB\n", l1 / 1024, l2 / 1024, llc / 1024);
+
+    // Sizes are named by cache level rather than entry count, so results from
+    // different commits on the same machine line up
+    struct { const char* label; long bytes; } sizes[] = {
+        { "L1", l1 / 2 }, { "L2", l2 / 2 }, { "LLC", llc / 2 }, { "10xLLC", llc * 10 },
+    };
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        if (gQuick && sizes[i].bytes > llc)
+            continue;
+        benchmark_hashtable(sizes[i].label, sizes[i].bytes / BYTES_PER_ENTRY);
+    }
+    benchmark_stack();
+    benchmark_priority_queues();
+
+    if (csvPath != NULL && write_csv(csvPath) != 0)
+        return 1;
+    if (comparePath != NULL) {
+        int regressions = compare_csv(comparePath);
+        if (regressions < 0)
+            return 1;
+        if (regressions > 0) {
+            printf("%d benchmarks regressed by more than %.0f%%\n", regressions, gRegressionThreshold * 100);
+            return 2;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,1799 @@
+/*
+    A hash table mapping string keys to string values, with the same insert/remove/get/
+    getnthitem/len/clear operations as the HashTable class in DataStructuresPython.py.
+
+    Collisions are handled the same way as in the Python version: each bucket holds a chain
+    (here a linked list) of every entry whose key hashes to that bucket. Unlike the Python
+    version, the table grows by itself once it holds more entries than it has buckets, so
+    chains stay short no matter how many entries are inserted.
+
+    Growing a table the obvious way (allocate a bigger bucket array and move every entry into
+    it at once) stalls whichever insert triggered the growth for as long as it takes to touch
+    every entry -- hundreds of milliseconds for 10 million entries. Instead we rehash
+    incrementally: growing only allocates the new bucket array, and then every following
+    insert/remove/get moves a few buckets from the old array to the new one. While the move
+    is in progress, lookups check both arrays. The work per operation is bounded by
+    HT_REHASH_STEP_BUCKETS, so the worst-case latency of an operation does not depend on how
+    big the table is.
+
+    The entries themselves are not stored in the buckets. They live in one dense array in the
+    order they were inserted, and the buckets and chains only hold positions in that array
+    (the same layout CPython uses for dict). That makes getnthitem(n) a single array access
+    instead of a walk over every bucket, and iterating over the table a linear scan. Removing
+    an entry leaves a hole in the array. Once holes (or the strings of removed entries) make up
+    half the table, they are squeezed out the same way the table grows: a cursor walks the
+    array, and every following insert moves a few entries down over the holes, copying their
+    strings into the other strings section. Only inserts do this work, so removals and lookups
+    never move an entry, and no single operation pays for the whole array.
+
+    Nothing in the table is a pointer: the header, bucket arrays, entries and strings each
+    have a fixed place in one big region of address space and refer to each other by position
+    or offset. So the region can just as well be a file mapped into memory with ht_open(): a
+    process can open a huge table and answer lookups immediately, reading pages from disk as
+    they are used, with no rebuild at startup. Changes to a file-backed table stay in memory
+    until ht_sync(), which uses a small undo log so that a crash in the middle of saving
+    leaves the file exactly as it was after one sync or the other, never something in between.
+    A table that only lives in memory starts with small sections instead, and moves to a
+    reservation with bigger ones when a section fills up. mremap() moves the pages themselves
+    rather than their contents, and since nothing is a pointer, nothing needs fixing up.
+
+        gcc -O2 HashTableC.c -o hashtable
+        ./hashtable [entries] [file]
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#define HT_MIN_BUCKETS 8
+#define HT_REHASH_STEP_BUCKETS 4        // buckets moved to the new table per operation
+#define HT_REHASH_MAX_EMPTY_VISITS 40   // empty buckets skipped per operation, so a sparse table can't stall either
+#define HT_NONE 0                       // buckets and chains store entry position + 1, so 0 means "no entry"
+#define HT_NO_STRING 0                  // offset 0 of the strings section is never used, like a NULL pointer
+#define HT_COMPACT_MIN_BYTES 65536      // don't bother compacting strings sections smaller than this
+#define HT_COMPACT_STEP_ENTRIES 4       // entries moved down over the holes per insert
+#define HT_COMPACT_MAX_DEAD_VISITS 40   // removed entries skipped per insert
+#define HT_RELEASE_STEP_BYTES (1 << 20) // memory compaction left unused that is given back per insert
+
+// File layout. Every number is stored in this machine's byte order; the magic number reads
+// differently on a machine with the other byte order, so such a file is rejected, not misread.
+#define HT_MAGIC 0x0A4C425448534148ULL  // "HASHTBL\n"
+#define HT_FORMAT_VERSION 2             // version 1 is the same without compaction state, which reads as zero
+#define HT_HEADER_SIZE 65536            // a multiple of any page size, so every section is page aligned
+#define HT_SECTION_SIZE (1ULL << 38)    // room reserved for each section of a file (256GB, mostly never backed
+                                        // by disk), and the most a section of a table in memory grows to
+#define HT_MIN_SECTION_SIZE (1 << 20)   // room each section of a table in memory starts with
+#define HT_SECTION_BUCKETS 0            // sections 0 and 1: the two bucket arrays used while rehashing
+#define HT_SECTION_ENTRIES 2
+#define HT_SECTION_STRINGS 3            // sections 3 and 4: strings are compacted by copying between them
+#define HT_SECTIONS 5
+#define HT_UNDO_MAGIC 0x474f4c4f444e5548ULL     // "HUNDOLOG"
+#define HT_UNDO_COMMIT 0x54494d4d4f434855ULL    // "UHCOMMIT"
+
+typedef struct HTHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t sectionSize;
+    uint64_t bucketsSize[2];            // table[1] is only in use while rehashing into it
+    uint32_t bucketsSection[2];         // which bucket section each table lives in; always different
+    int64_t rehashIndex;                // next bucket of table[0] to move, or -1 if not rehashing
+    uint64_t entriesUsed;               // entries in insertion order, including removed ones
+    uint64_t count;                     // entries that have not been removed
+    uint32_t stringsSection;
+    uint32_t unused;
+    uint64_t stringsUsed;
+    uint64_t stringsGarbage;            // bytes of strings that belong to removed entries or replaced values
+    uint64_t compactNext;               // next entry for compaction to move, or 0 if not compacting
+    uint64_t compactUsed;               // entries moved so far; their strings are in the other section
+    uint64_t compactStringsUsed;
+    uint64_t compactStringsGarbage;
+} HTHeader;
+
+typedef struct HTEntry {
+    uint64_t hash;                      // kept so moving an entry never has to rehash its key
+    uint64_t keyOffset;                 // HT_NO_STRING once the entry has been removed
+    uint64_t valueOffset;
+    uint32_t next;                      // next entry in the same bucket
+    uint32_t keyLength;
+} HTEntry;
+
+typedef struct HTDirtyPages {
+    uint64_t* pages;                    // open-addressed set of page number + 1
+    size_t count;
+    size_t capacity;
+} HTDirtyPages;
+
+typedef struct HashTable {
+    HTHeader* header;                   // the start of the region
+    char* base;
+    size_t regionSize;
+    size_t pageSize;
+    int fd;                             // -1 for a table that only lives in memory
+    int undoFd;
+    HTDirtyPages dirty;                 // pages changed since the last ht_sync()
+    char* releaseStringsEnd;            // in memory: what compaction left unused, still to be
+    char* releaseEntriesEnd;            // given back from here down, or NULL
+    uint32_t* ranks;                    // Fenwick tree of live entries for ht_getnthitem(), or NULL
+    size_t ranksSize;                   // entries it covers, always entriesUsed while it exists
+    size_t ranksCapacity;
+} HashTable;
+
+// 64-bit FNV-1a; the table only needs the low bits to be well mixed
+static uint64_t ht_hash(const char* key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char* p = (const unsigned char*)key; *p; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash ^ (hash >> 32);
+}
+
+static uint64_t ht_checksum(uint64_t sum, const void* data, size_t length) {
+    for (const unsigned char* p = data; length > 0; p++, length--) {
+        sum ^= *p;
+        sum *= 0x100000001b3ULL;
+    }
+    return sum;
+}
+
+static size_t ht_round_buckets(size_t buckets) {
+    size_t size = HT_MIN_BUCKETS;
+    while (size < buckets)
+        size *= 2;
+    return size;
+}
+
+static inline int ht_is_rehashing(HashTable* ht) {
+    return ht->header->rehashIndex != -1;
+}
+
+static inline char* ht_section(HashTable* ht, uint32_t section) {
+    return ht->base + HT_HEADER_SIZE + section * ht->header->sectionSize;
+}
+
+static inline uint32_t* ht_buckets(HashTable* ht, int t) {
+    return (uint32_t*)ht_section(ht, ht->header->bucketsSection[t]);
+}
+
+static inline HTEntry* ht_entry(HashTable* ht, uint32_t ref) {
+    return &((HTEntry*)ht_section(ht, HT_SECTION_ENTRIES))[ref - 1];
+}
+
+static inline int ht_is_compacting(HashTable* ht) {
+    return ht->header->compactNext != 0;
+}
+
+// The strings section that compaction copies into
+static inline uint32_t ht_spare_strings(HashTable* ht) {
+    return HT_SECTION_STRINGS + 1 - (ht->header->stringsSection - HT_SECTION_STRINGS);
+}
+
+// Entries compaction has already moved keep their strings in the spare section
+static inline int ht_is_compacted(HashTable* ht, uint32_t ref) {
+    return ht_is_compacting(ht) && ref <= ht->header->compactUsed;
+}
+
+static inline char* ht_strings(HashTable* ht, uint32_t ref) {
+    return ht_section(ht, ht_is_compacted(ht, ref) ? ht_spare_strings(ht) : ht->header->stringsSection);
+}
+
+static inline char* ht_key(HashTable* ht, uint32_t ref) {
+    return ht_strings(ht, ref) + ht_entry(ht, ref)->keyOffset;
+}
+
+static inline char* ht_value(HashTable* ht, uint32_t ref) {
+    return ht_strings(ht, ref) + ht_entry(ht, ref)->valueOffset;
+}
+
+// Strings no longer in use count against the section they are in
+static inline uint64_t* ht_garbage(HashTable* ht, uint32_t ref) {
+    return ht_is_compacted(ht, ref) ? &ht->header->compactStringsGarbage : &ht->header->stringsGarbage;
+}
+
+// Dirty page tracking: a file-backed region is mapped MAP_PRIVATE, so changes stay in memory
+// until ht_sync() writes exactly the pages recorded here
+
+static int ht_dirty_add(HTDirtyPages* d, uint64_t page) {
+    if ((d->count + 1) * 2 > d->capacity) {
+        size_t capacity = d->capacity ? d->capacity * 2 : 1024;
+        uint64_t* pages = calloc(capacity, sizeof(uint64_t));
+        if (pages == NULL)
+            return -1;
+        for (size_t i = 0; i < d->capacity; i++) {
+            if (d->pages[i] == 0)
+                continue;
+            size_t slot = (d->pages[i] * 0x9E3779B97F4A7C15ULL) & (capacity - 1);
+            while (pages[slot] != 0)
+                slot = (slot + 1) & (capacity - 1);
+            pages[slot] = d->pages[i];
+        }
+        free(d->pages);
+        d->pages = pages;
+        d->capacity = capacity;
+    }
+
+    size_t slot = ((page + 1) * 0x9E3779B97F4A7C15ULL) & (d->capacity - 1);
+    while (d->pages[slot] != 0) {
+        if (d->pages[slot] == page + 1)
+            return 0;
+        slot = (slot + 1) & (d->capacity - 1);
+    }
+    d->pages[slot] = page + 1;
+    d->count++;
+    return 0;
+}
+
+// Call before writing length bytes at p
+static inline void ht_touch(HashTable* ht, const void* p, size_t length) {
+    if (ht->fd < 0 || length == 0)
+        return;
+    uint64_t first = ((const char*)p - ht->base) / ht->pageSize;
+    uint64_t last = ((const char*)p + length - 1 - ht->base) / ht->pageSize;
+    for (uint64_t page = first; page <= last; page++) {
+        if (ht_dirty_add(&ht->dirty, page) != 0) {
+            // Without a record of the page, ht_sync() would silently lose the change
+            perror("Failed to record hash table change");
+            exit(1);
+        }
+    }
+}
+
+// Give the memory (and, for a file, the disk space) behind an unused range back to the system.
+// In memory, the range reads as zeros afterwards.
+static void ht_release(HashTable* ht, char* start, size_t length) {
+    uint64_t from = ((start - ht->base) + ht->pageSize - 1) / ht->pageSize * ht->pageSize;
+    uint64_t to = (start + length - ht->base) / ht->pageSize * ht->pageSize;
+    if (to <= from)
+        return;
+    if (ht->fd >= 0)
+        fallocate(ht->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from);
+    madvise(ht->base + from, to - from, MADV_DONTNEED);
+}
+
+// The end of the page p is in (p itself if it is at the start of a page)
+static inline char* ht_page_end(HashTable* ht, char* p) {
+    return ht->base + ((p - ht->base) + ht->pageSize - 1) / ht->pageSize * ht->pageSize;
+}
+
+static inline void ht_link(HashTable* ht, int t, uint32_t ref) {
+    HTEntry* e = ht_entry(ht, ref);
+    uint32_t* bucket = &ht_buckets(ht, t)[e->hash & (ht->header->bucketsSize[t] - 1)];
+    ht_touch(ht, &e->next, sizeof(e->next));
+    ht_touch(ht, bucket, sizeof(*bucket));
+    e->next = *bucket;
+    *bucket = ref;
+}
+
+// Make the new table the only table once every bucket has moved into it. The old bucket
+// section is all zeros by then, which is what ht_start_grow() relies on next time.
+static void ht_finish_rehash(HashTable* ht) {
+    HTHeader* h = ht->header;
+    uint32_t oldSection = h->bucketsSection[0];
+    size_t oldSize = h->bucketsSize[0];
+    ht_touch(ht, h, sizeof(HTHeader));
+    h->bucketsSection[0] = h->bucketsSection[1];
+    h->bucketsSection[1] = oldSection;
+    h->bucketsSize[0] = h->bucketsSize[1];
+    h->bucketsSize[1] = 0;
+    h->rehashIndex = -1;
+    if (ht->fd < 0)
+        ht_release(ht, ht_section(ht, oldSection), oldSize * sizeof(uint32_t));
+}
+
+// Move up to HT_REHASH_STEP_BUCKETS buckets from table[0] into table[1]
+static void ht_rehash_step(HashTable* ht) {
+    if (!ht_is_rehashing(ht))
+        return;
+
+    HTHeader* h = ht->header;
+    uint32_t* from = ht_buckets(ht, 0);
+    int moved = 0, emptyVisits = 0;
+    ht_touch(ht, h, sizeof(HTHeader));
+    while (moved < HT_REHASH_STEP_BUCKETS && (uint64_t)h->rehashIndex < h->bucketsSize[0]) {
+        uint32_t ref = from[h->rehashIndex];
+        if (ref == HT_NONE) {
+            h->rehashIndex++;
+            if (++emptyVisits >= HT_REHASH_MAX_EMPTY_VISITS)
+                break;
+            continue;
+        }
+        while (ref != HT_NONE) {
+            uint32_t next = ht_entry(ht, ref)->next;
+            ht_link(ht, 1, ref);
+            ref = next;
+        }
+        ht_touch(ht, &from[h->rehashIndex], sizeof(uint32_t));
+        from[h->rehashIndex++] = HT_NONE;
+        moved++;
+    }
+
+    if ((uint64_t)h->rehashIndex >= h->bucketsSize[0])
+        ht_finish_rehash(ht);
+}
+
+// Move section (or, for section 0, the header and section 0, which follow each other) from one
+// reservation to the same place in another, without copying it
+static int ht_move_section(char* fromBase, uint64_t fromSize, char* toBase, uint64_t toSize, int section) {
+    char* from = (section == 0) ? fromBase : fromBase + HT_HEADER_SIZE + section * fromSize;
+    char* to = (section == 0) ? toBase : toBase + HT_HEADER_SIZE + section * toSize;
+    size_t length = fromSize + ((section == 0) ? HT_HEADER_SIZE : 0);
+    return mremap(from, length, length, MREMAP_MAYMOVE | MREMAP_FIXED, to) == MAP_FAILED ? -1 : 0;
+}
+
+// Make every section at least bytes long. A file has all the room it will ever have, but a table
+// in memory moves into a new reservation with sections at least twice as big. Returns -1 with
+// errno set if there is no room; nothing has moved then.
+static int ht_reserve(HashTable* ht, uint64_t bytes) {
+    uint64_t oldSize = ht->header->sectionSize;
+    if (bytes <= oldSize)
+        return 0;
+    if (ht->fd >= 0 || bytes > HT_SECTION_SIZE) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    uint64_t size = oldSize * 2;
+    while (size < bytes)
+        size *= 2;
+    size_t regionSize = HT_HEADER_SIZE + HT_SECTIONS * size;
+    char* base = mmap(NULL, regionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    int moved = 0;
+    while (moved < HT_SECTIONS && ht_move_section(ht->base, oldSize, base, size, moved) == 0)
+        moved++;
+    if (moved < HT_SECTIONS) {
+        int error = errno;
+        while (--moved >= 0) {
+            if (ht_move_section(base, size, ht->base, oldSize, moved) != 0) {
+                perror("Failed to move hash table back");
+                exit(1);
+            }
+        }
+        munmap(base, regionSize);
+        errno = error;
+        return -1;
+    }
+
+    // Memory still to be given back moved along with its section
+    if (ht->releaseStringsEnd != NULL)
+        ht->releaseStringsEnd = base + (ht->releaseStringsEnd - ht->base) + ht_spare_strings(ht) * (size - oldSize);
+    if (ht->releaseEntriesEnd != NULL)
+        ht->releaseEntriesEnd = base + (ht->releaseEntriesEnd - ht->base) + HT_SECTION_ENTRIES * (size - oldSize);
+    ht->base = base;
+    ht->header = (HTHeader*)base;
+    ht->regionSize = regionSize;
+    ht->header->sectionSize = size;
+    return 0;
+}
+
+static void ht_start_grow(HashTable* ht) {
+    if (ht_is_rehashing(ht) || ht->header->count <= ht->header->bucketsSize[0])
+        return;
+    if (ht_reserve(ht, ht->header->bucketsSize[0] * 2 * sizeof(uint32_t)) != 0)
+        return;     // out of room; chains just get longer
+    HTHeader* h = ht->header;
+
+    // The other bucket section is all zeros and its pages only get backed as they are
+    // written, so "allocating" the new table costs nothing
+    ht_touch(ht, h, sizeof(HTHeader));
+    h->bucketsSize[1] = h->bucketsSize[0] * 2;
+    h->rehashIndex = 0;
+}
+
+// Append a string for entry ref to its strings section; returns its offset, or HT_NO_STRING if
+// the section is full
+static uint64_t ht_store_string(HashTable* ht, uint32_t ref, const char* s, size_t length) {
+    HTHeader* h = ht->header;
+    uint64_t* used = ht_is_compacted(ht, ref) ? &h->compactStringsUsed : &h->stringsUsed;
+    if (*used + length + 1 > h->sectionSize)
+        return HT_NO_STRING;
+    uint64_t offset = *used;
+    char* p = ht_strings(ht, ref) + offset;
+    ht_touch(ht, p, length + 1);
+    memcpy(p, s, length + 1);
+    ht_touch(ht, h, sizeof(HTHeader));
+    *used += length + 1;
+    return offset;
+}
+
+// Find the link (in either table) that points at entry ref, which must be in the table
+static uint32_t* ht_find_link(HashTable* ht, uint64_t hash, uint32_t ref) {
+    for (int t = 0; t < (ht_is_rehashing(ht) ? 2 : 1); t++) {
+        uint32_t* link = &ht_buckets(ht, t)[hash & (ht->header->bucketsSize[t] - 1)];
+        while (*link != HT_NONE) {
+            if (*link == ref)
+                return link;
+            link = &ht_entry(ht, *link)->next;
+        }
+    }
+    return NULL;
+}
+
+// Finding the nth live entry past the holes of removed entries would take a walk over the
+// array, so once it is needed with holes around, a Fenwick tree over the entries array counts
+// the live ones: ranks[i - 1] holds how many of entries (i - lowbit(i), i] are live. It lives in
+// ordinary memory rather than the region, is built on first use and kept up to date from then
+// on, at O(log n) per insert, removal or moved entry.
+static int ht_ranks_build(HashTable* ht) {
+    size_t size = ht->header->entriesUsed;
+    size_t capacity = (size > HT_MIN_BUCKETS) ? size : HT_MIN_BUCKETS;
+    uint32_t* ranks = malloc(capacity * sizeof(uint32_t));
+    if (ranks == NULL)
+        return -1;
+    for (size_t i = 1; i <= size; i++)
+        ranks[i - 1] = (ht_entry(ht, (uint32_t)i)->keyOffset != HT_NO_STRING);
+    for (size_t i = 1; i <= size; i++) {
+        size_t parent = i + (i & -i);
+        if (parent <= size)
+            ranks[parent - 1] += ranks[i - 1];
+    }
+    ht->ranks = ranks;
+    ht->ranksSize = size;
+    ht->ranksCapacity = capacity;
+    return 0;
+}
+
+static void ht_ranks_drop(HashTable* ht) {
+    free(ht->ranks);
+    ht->ranks = NULL;
+    ht->ranksSize = 0;
+    ht->ranksCapacity = 0;
+}
+
+// Entry ref became live (delta 1) or removed (delta -1)
+static void ht_ranks_add(HashTable* ht, uint32_t ref, int delta) {
+    if (ht->ranks == NULL)
+        return;
+    for (size_t i = ref; i <= ht->ranksSize; i += i & -i)
+        ht->ranks[i - 1] += delta;
+}
+
+// A new live entry at the end of the array; its node sums the nodes below it that it covers.
+// If the tree can't grow it is dropped, and built again when next needed.
+static void ht_ranks_append(HashTable* ht) {
+    if (ht->ranks == NULL)
+        return;
+    size_t i = ht->ranksSize + 1;
+    if (i > ht->ranksCapacity) {
+        uint32_t* ranks = realloc(ht->ranks, 2 * ht->ranksCapacity * sizeof(uint32_t));
+        if (ranks == NULL) {
+            ht_ranks_drop(ht);
+            return;
+        }
+        ht->ranks = ranks;
+        ht->ranksCapacity *= 2;
+    }
+    uint32_t sum = 1;
+    for (size_t j = i - 1; j > i - (i & -i); j -= j & -j)
+        sum += ht->ranks[j - 1];
+    ht->ranks[i - 1] = sum;
+    ht->ranksSize = i;
+}
+
+// The entry holding the nth live one (from 0), which must exist
+static uint32_t ht_ranks_find(HashTable* ht, uint64_t n) {
+    size_t position = 0, step = 1;
+    while (step * 2 <= ht->ranksSize)
+        step *= 2;
+    for (; step > 0; step /= 2) {
+        if (position + step <= ht->ranksSize && ht->ranks[position + step - 1] <= n) {
+            position += step;
+            n -= ht->ranks[position - 1];
+        }
+    }
+    return (uint32_t)position + 1;
+}
+
+// Make the compacted entries and strings the only ones once the cursor has passed every entry
+static void ht_finish_compact(HashTable* ht) {
+    HTHeader* h = ht->header;
+    uint32_t oldSection = h->stringsSection;
+    uint64_t oldUsed = h->entriesUsed, oldStringsUsed = h->stringsUsed;
+    ht_touch(ht, h, sizeof(HTHeader));
+    h->entriesUsed = h->compactUsed;
+    h->stringsSection = ht_spare_strings(ht);
+    h->stringsUsed = h->compactStringsUsed;
+    h->stringsGarbage = h->compactStringsGarbage;
+    h->compactNext = 0;
+    h->compactUsed = 0;
+    h->compactStringsUsed = 0;
+    h->compactStringsGarbage = 0;
+    // Every entry past the compacted ones is a hole, so the nodes covering them can just go
+    if (ht->ranks != NULL)
+        ht->ranksSize = h->entriesUsed;
+    if (ht->fd < 0) {
+        ht->releaseStringsEnd = ht_page_end(ht, ht_section(ht, oldSection) + oldStringsUsed);
+        ht->releaseEntriesEnd = ht_page_end(ht, (char*)ht_entry(ht, oldUsed + 1));
+    }
+}
+
+// Release up to HT_RELEASE_STEP_BYTES below *end, but nothing below floor
+static void ht_release_down(HashTable* ht, char** end, char* floor) {
+    if (*end <= floor) {
+        *end = NULL;
+        return;
+    }
+    char* start = (*end - floor > HT_RELEASE_STEP_BYTES) ? *end - HT_RELEASE_STEP_BYTES : floor;
+    ht_release(ht, start, *end - start);
+    *end = (start == floor) ? NULL : start;
+}
+
+// Giving back everything compaction left unused at once would stall one insert as long as the
+// whole compaction, so it goes a step at a time too: the old strings, then the end of the
+// entries array down to the entries in use
+static void ht_release_step(HashTable* ht) {
+    if (ht->releaseStringsEnd != NULL)
+        ht_release_down(ht, &ht->releaseStringsEnd, ht_section(ht, ht_spare_strings(ht)));
+    else if (ht->releaseEntriesEnd != NULL)
+        ht_release_down(ht, &ht->releaseEntriesEnd, (char*)ht_entry(ht, ht->header->entriesUsed + 1));
+}
+
+// Move up to HT_COMPACT_STEP_ENTRIES entries down over the holes in front of the cursor, copying
+// their strings into the spare section. Everything before the cursor is then either a moved
+// entry or a hole, and the entries keep their insertion order.
+static void ht_compact_step(HashTable* ht) {
+    if (!ht_is_compacting(ht)) {
+        ht_release_step(ht);
+        return;
+    }
+
+    HTHeader* h = ht->header;
+    char* from = ht_section(ht, h->stringsSection);
+    char* to = ht_section(ht, ht_spare_strings(ht));
+    int moved = 0, deadVisits = 0;
+    ht_touch(ht, h, sizeof(HTHeader));
+    while (moved < HT_COMPACT_STEP_ENTRIES && h->compactNext <= h->entriesUsed) {
+        uint32_t ref = (uint32_t)h->compactNext++;
+        HTEntry e = *ht_entry(ht, ref);
+        if (e.keyOffset == HT_NO_STRING) {
+            if (++deadVisits >= HT_COMPACT_MAX_DEAD_VISITS)
+                break;
+            continue;
+        }
+
+        size_t valueLength = strlen(from + e.valueOffset);
+        ht_touch(ht, to + h->compactStringsUsed, e.keyLength + valueLength + 2);
+        memcpy(to + h->compactStringsUsed, from + e.keyOffset, e.keyLength + 1);
+        e.keyOffset = h->compactStringsUsed;
+        h->compactStringsUsed += e.keyLength + 1;
+        memcpy(to + h->compactStringsUsed, from + e.valueOffset, valueLength + 1);
+        e.valueOffset = h->compactStringsUsed;
+        h->compactStringsUsed += valueLength + 1;
+
+        // The slot it moves to is a hole (or its own slot), so nothing links to it yet
+        uint32_t target = (uint32_t)++h->compactUsed;
+        uint32_t* link = ht_find_link(ht, e.hash, ref);
+        ht_touch(ht, link, sizeof(*link));
+        *link = target;
+        ht_touch(ht, ht_entry(ht, target), sizeof(HTEntry));
+        *ht_entry(ht, target) = e;
+        if (target != ref) {
+            ht_touch(ht, ht_entry(ht, ref), sizeof(HTEntry));
+            ht_entry(ht, ref)->keyOffset = HT_NO_STRING;
+            ht_ranks_add(ht, target, 1);
+            ht_ranks_add(ht, ref, -1);
+        }
+        moved++;
+    }
+
+    if (h->compactNext > h->entriesUsed)
+        ht_finish_compact(ht);
+}
+
+// Start compacting once removed entries outnumber the rest, or once the strings of removed
+// entries and replaced values make up half the strings section. Nothing moves yet.
+static void ht_maybe_compact(HashTable* ht) {
+    HTHeader* h = ht->header;
+    if (ht_is_compacting(ht))
+        return;
+    if (h->entriesUsed - h->count > h->count + HT_MIN_BUCKETS ||
+        (h->stringsGarbage > h->stringsUsed / 2 && h->stringsUsed > HT_COMPACT_MIN_BYTES)) {
+        ht_touch(ht, h, sizeof(HTHeader));
+        ht->releaseStringsEnd = NULL;      // the spare section is about to be written again
+        h->version = HT_FORMAT_VERSION;     // older code would misread a table halfway through compaction
+        h->compactNext = 1;
+        h->compactUsed = 0;
+        h->compactStringsUsed = 1;
+        h->compactStringsGarbage = 0;
+    }
+}
+
+// Find the link pointing at the entry for key (in either table), or NULL if it isn't there
+static uint32_t* ht_find(HashTable* ht, const char* key, uint64_t hash) {
+    for (int t = 0; t < (ht_is_rehashing(ht) ? 2 : 1); t++) {
+        uint32_t* link = &ht_buckets(ht, t)[hash & (ht->header->bucketsSize[t] - 1)];
+        while (*link != HT_NONE) {
+            HTEntry* e = ht_entry(ht, *link);
+            if (e->hash == hash && strcmp(ht_key(ht, *link), key) == 0)
+                return link;
+            link = &e->next;
+        }
+    }
+    return NULL;
+}
+
+static void ht_init_header(HashTable* ht, size_t buckets, uint64_t sectionSize) {
+    HTHeader* h = ht->header;
+    ht_touch(ht, h, sizeof(HTHeader));
+    h->magic = HT_MAGIC;
+    h->version = HT_FORMAT_VERSION;
+    h->headerSize = HT_HEADER_SIZE;
+    h->sectionSize = sectionSize;
+    h->bucketsSize[0] = ht_round_buckets(buckets);
+    if (h->bucketsSize[0] * sizeof(uint32_t) > h->sectionSize)
+        h->bucketsSize[0] = h->sectionSize / sizeof(uint32_t);
+    h->bucketsSize[1] = 0;
+    h->bucketsSection[0] = HT_SECTION_BUCKETS;
+    h->bucketsSection[1] = HT_SECTION_BUCKETS + 1;
+    h->rehashIndex = -1;
+    h->entriesUsed = 0;
+    h->count = 0;
+    h->stringsSection = HT_SECTION_STRINGS;
+    h->stringsUsed = 1;
+    h->stringsGarbage = 0;
+    h->compactNext = 0;
+    h->compactUsed = 0;
+    h->compactStringsUsed = 0;
+    h->compactStringsGarbage = 0;
+}
+
+// Crash consistency. The file is only ever changed by ht_sync(), which first saves the old
+// contents of every page it is about to overwrite to an undo log next to the file, then
+// overwrites them, then empties the log. If we crash while overwriting, ht_open() finds a
+// complete log and copies the old pages back, which returns the file to the last ht_sync().
+
+typedef struct HTUndoHeader {
+    uint64_t magic;
+    uint64_t pageCount;
+    uint64_t pageSize;
+} HTUndoHeader;
+
+typedef struct HTUndoTrailer {
+    uint64_t checksum;
+    uint64_t commit;
+} HTUndoTrailer;
+
+static int ht_compare_pages(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Write the undo log for every dirty page; returns the sorted page numbers (or NULL on failure)
+static uint64_t* ht_sync_write_undo_log(HashTable* ht) {
+    uint64_t* pages = malloc((ht->dirty.count ? ht->dirty.count : 1) * sizeof(uint64_t));
+    char* buffer = malloc(ht->pageSize);
+    if (pages == NULL || buffer == NULL)
+        goto fail;
+    size_t n = 0;
+    for (size_t i = 0; i < ht->dirty.capacity; i++) {
+        if (ht->dirty.pages[i] != 0)
+            pages[n++] = ht->dirty.pages[i] - 1;
+    }
+    qsort(pages, n, sizeof(uint64_t), ht_compare_pages);
+
+    HTUndoHeader header = { HT_UNDO_MAGIC, n, ht->pageSize };
+    HTUndoTrailer trailer = { ht_checksum(0xcbf29ce484222325ULL, &header, sizeof(header)), HT_UNDO_COMMIT };
+    off_t position = sizeof(header);
+    if (ftruncate(ht->undoFd, 0) != 0)
+        goto fail;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t offset = pages[i] * ht->pageSize;
+        if (pread(ht->fd, buffer, ht->pageSize, offset) != (ssize_t)ht->pageSize)
+            goto fail;
+        if (pwrite(ht->undoFd, &offset, sizeof(offset), position) != sizeof(offset) ||
+            pwrite(ht->undoFd, buffer, ht->pageSize, position + sizeof(offset)) != (ssize_t)ht->pageSize)
+            goto fail;
+        trailer.checksum = ht_checksum(trailer.checksum, &offset, sizeof(offset));
+        trailer.checksum = ht_checksum(trailer.checksum, buffer, ht->pageSize);
+        position += sizeof(offset) + ht->pageSize;
+    }
+    if (pwrite(ht->undoFd, &trailer, sizeof(trailer), position) != sizeof(trailer) ||
+        pwrite(ht->undoFd, &header, sizeof(header), 0) != sizeof(header) ||
+        fdatasync(ht->undoFd) != 0)
+        goto fail;
+
+    free(buffer);
+    return pages;
+
+fail:
+    free(buffer);
+    free(pages);
+    return NULL;
+}
+
+// Copy the dirty pages (sorted) from memory into the file
+static int ht_sync_write_pages(HashTable* ht, const uint64_t* pages, size_t n) {
+    for (size_t i = 0; i < n; ) {
+        size_t run = 1;
+        while (i + run < n && pages[i + run] == pages[i] + run)
+            run++;
+        uint64_t offset = pages[i] * ht->pageSize;
+        size_t length = run * ht->pageSize;
+        for (size_t done = 0; done < length; ) {
+            ssize_t written = pwrite(ht->fd, ht->base + offset + done, length - done, offset + done);
+            if (written <= 0)
+                return -1;
+            done += written;
+        }
+        i += run;
+    }
+    return fdatasync(ht->fd);
+}
+
+// Copy the old pages from a complete undo log back into the file, then empty the log
+static int ht_recover(int fd, int undoFd) {
+    struct stat st;
+    HTUndoHeader header;
+    HTUndoTrailer trailer;
+    if (fstat(undoFd, &st) != 0)
+        return -1;
+    if (st.st_size == 0)
+        return 0;
+
+    // An incomplete log means we crashed before touching the file, so it can just be dropped
+    int complete = 0;
+    char* buffer = NULL;
+    if (pread(undoFd, &header, sizeof(header), 0) == sizeof(header) && header.magic == HT_UNDO_MAGIC &&
+        header.pageSize > 0 && header.pageSize <= (1 << 24) &&
+        (uint64_t)st.st_size == sizeof(header) + header.pageCount * (sizeof(uint64_t) + header.pageSize) + sizeof(trailer) &&
+        pread(undoFd, &trailer, sizeof(trailer), st.st_size - sizeof(trailer)) == sizeof(trailer) &&
+        trailer.commit == HT_UNDO_COMMIT && (buffer = malloc(header.pageSize)) != NULL) {
+        uint64_t checksum = ht_checksum(0xcbf29ce484222325ULL, &header, sizeof(header));
+        off_t position = sizeof(header);
+        for (uint64_t i = 0; i < header.pageCount; i++) {
+            uint64_t offset;
+            if (pread(undoFd, &offset, sizeof(offset), position) != sizeof(offset) ||
+                pread(undoFd, buffer, header.pageSize, position + sizeof(offset)) != (ssize_t)header.pageSize)
+                break;
+            checksum = ht_checksum(checksum, &offset, sizeof(offset));
+            checksum = ht_checksum(checksum, buffer, header.pageSize);
+            position += sizeof(offset) + header.pageSize;
+        }
+        complete = (checksum == trailer.checksum);
+    }
+
+    if (complete) {
+        off_t position = sizeof(header);
+        for (uint64_t i = 0; i < header.pageCount; i++) {
+            uint64_t offset;
+            if (pread(undoFd, &offset, sizeof(offset), position) != sizeof(offset) ||
+                pread(undoFd, buffer, header.pageSize, position + sizeof(offset)) != (ssize_t)header.pageSize ||
+                pwrite(fd, buffer, header.pageSize, offset) != (ssize_t)header.pageSize) {
+                free(buffer);
+                return -1;
+            }
+            position += sizeof(offset) + header.pageSize;
+        }
+        if (fdatasync(fd) != 0) {
+            free(buffer);
+            return -1;
+        }
+    }
+    free(buffer);
+    if (ftruncate(undoFd, 0) != 0 || fdatasync(undoFd) != 0)
+        return -1;
+    return 0;
+}
+
+// Hash table implementation
+
+// Create a table that only lives in memory, with room for the given number of buckets to start
+// with; it grows as needed. Returns -1 with errno set if even that much can't be reserved.
+int ht_init(HashTable* ht, size_t buckets) {
+    memset(ht, 0, sizeof(HashTable));
+    ht->fd = -1;
+    ht->undoFd = -1;
+    ht->pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t sectionSize = HT_MIN_SECTION_SIZE;
+    while (sectionSize < ht_round_buckets(buckets) * sizeof(uint32_t) && sectionSize < HT_SECTION_SIZE)
+        sectionSize *= 2;
+    ht->regionSize = HT_HEADER_SIZE + HT_SECTIONS * sectionSize;
+
+    // Pages are only backed by memory once they are written, so most of this costs nothing
+    // but address space until the table grows into it
+    ht->base = mmap(NULL, ht->regionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ht->base == MAP_FAILED) {
+        ht->base = NULL;    // so ht_destroy() has nothing to undo
+        return -1;
+    }
+    ht->header = (HTHeader*)ht->base;
+    ht_init_header(ht, buckets, sectionSize);
+    return 0;
+}
+
+int ht_sync(HashTable* ht);
+
+// Open the table stored in the file at path, creating it with the given number of buckets if
+// it doesn't exist. Lookups can start right away; pages of the file are read as they are used.
+// Changes are only saved by ht_sync() (or ht_destroy()). Returns -1 with errno set on failure.
+int ht_open(HashTable* ht, const char* path, size_t buckets) {
+    memset(ht, 0, sizeof(HashTable));
+    ht->pageSize = sysconf(_SC_PAGESIZE);
+    ht->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (ht->fd < 0)
+        return -1;
+
+    char undoPath[4096];
+    snprintf(undoPath, sizeof(undoPath), "%s-undo", path);
+    ht->undoFd = open(undoPath, O_RDWR | O_CREAT, 0644);
+    if (ht->undoFd < 0 || ht_recover(ht->fd, ht->undoFd) != 0)
+        goto fail;
+
+    struct stat st;
+    HTHeader header;
+    if (fstat(ht->fd, &st) != 0)
+        goto fail;
+    int created = (st.st_size == 0);
+    if (created) {
+        header.sectionSize = HT_SECTION_SIZE;
+        // A sparse file: only the pages we write take up disk space
+        if (ftruncate(ht->fd, HT_HEADER_SIZE + HT_SECTIONS * HT_SECTION_SIZE) != 0)
+            goto fail;
+    } else {
+        if (pread(ht->fd, &header, sizeof(header), 0) != sizeof(header) ||
+            header.magic != HT_MAGIC || header.version == 0 || header.version > HT_FORMAT_VERSION ||
+            header.headerSize != HT_HEADER_SIZE ||
+            (uint64_t)st.st_size != HT_HEADER_SIZE + HT_SECTIONS * header.sectionSize) {
+            errno = EINVAL;
+            goto fail;
+        }
+    }
+
+    ht->regionSize = HT_HEADER_SIZE + HT_SECTIONS * header.sectionSize;
+    ht->base = mmap(NULL, ht->regionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, ht->fd, 0);
+    if (ht->base == MAP_FAILED) {
+        ht->base = NULL;
+        goto fail;
+    }
+    ht->header = (HTHeader*)ht->base;
+    if (created) {
+        ht_init_header(ht, buckets, HT_SECTION_SIZE);
+        if (ht_sync(ht) != 0)
+            goto fail;
+    }
+    return 0;
+
+fail: {
+        int error = errno;
+        if (ht->base != NULL)
+            munmap(ht->base, ht->regionSize);
+        if (ht->undoFd >= 0)
+            close(ht->undoFd);
+        close(ht->fd);
+        errno = error;
+        return -1;
+    }
+}
+
+// Save every change since the last sync to the file; a crash at any point leaves the file as
+// it was after either this sync or the previous one. Returns -1 with errno set on failure.
+int ht_sync(HashTable* ht) {
+    if (ht->fd < 0 || ht->dirty.count == 0)
+        return 0;
+
+    size_t n = ht->dirty.count;
+    uint64_t* pages = ht_sync_write_undo_log(ht);
+    if (pages == NULL)
+        return -1;
+    if (ht_sync_write_pages(ht, pages, n) != 0 || ftruncate(ht->undoFd, 0) != 0 || fdatasync(ht->undoFd) != 0) {
+        free(pages);
+        return -1;
+    }
+
+    // The file now matches memory, so drop our private copies of those pages
+    for (size_t i = 0; i < n; i++)
+        madvise(ht->base + pages[i] * ht->pageSize, ht->pageSize, MADV_DONTNEED);
+    free(pages);
+    memset(ht->dirty.pages, 0, ht->dirty.capacity * sizeof(uint64_t));
+    ht->dirty.count = 0;
+
+    // Only now that the header on disk agrees can space it no longer uses be released
+    HTHeader* h = ht->header;
+    if (!ht_is_rehashing(ht))
+        ht_release(ht, ht_section(ht, h->bucketsSection[1]), h->sectionSize);
+    ht_release(ht, (char*)&ht_buckets(ht, 0)[h->bucketsSize[0]], h->sectionSize - h->bucketsSize[0] * sizeof(uint32_t));
+    ht_release(ht, (char*)ht_entry(ht, h->entriesUsed + 1), h->sectionSize - h->entriesUsed * sizeof(HTEntry));
+    ht_release(ht, ht_section(ht, h->stringsSection) + h->stringsUsed, h->sectionSize - h->stringsUsed);
+    if (!ht_is_compacting(ht))
+        ht_release(ht, ht_section(ht, ht_spare_strings(ht)), h->sectionSize);
+    return 0;
+}
+
+// Free the table; a file-backed table is synced and closed
+void ht_destroy(HashTable* ht) {
+    if (ht->base == NULL)
+        return;
+    if (ht->fd >= 0) {
+        if (ht_sync(ht) != 0)
+            perror("Failed to save hash table");
+        close(ht->undoFd);
+        close(ht->fd);
+    }
+    munmap(ht->base, ht->regionSize);
+    free(ht->dirty.pages);
+    free(ht->ranks);
+    memset(ht, 0, sizeof(HashTable));
+    ht->fd = -1;
+    ht->undoFd = -1;
+}
+
+// ht_insert() for a key whose hash is already known
+static int ht_insert_hashed(HashTable* ht, const char* key, uint64_t hash, const char* value) {
+    size_t keyLength = strlen(key);
+    size_t valueLength = strlen(value);
+
+    // Make room for either a new entry or a replaced value before taking any pointers into the
+    // region, since making room can move it
+    HTHeader* h = ht->header;
+    if (h->entriesUsed + 1 >= UINT32_MAX) {
+        errno = ENOSPC;
+        return -1;
+    }
+    uint64_t stringsUsed = (h->compactStringsUsed > h->stringsUsed) ? h->compactStringsUsed : h->stringsUsed;
+    if (ht_reserve(ht, (h->entriesUsed + 1) * sizeof(HTEntry)) != 0 ||
+        ht_reserve(ht, stringsUsed + keyLength + valueLength + 2) != 0)
+        return -1;
+    h = ht->header;
+
+    uint32_t* link = ht_find(ht, key, hash);
+    if (link != NULL) {
+        uint32_t ref = *link;
+        HTEntry* e = ht_entry(ht, ref);
+        uint64_t valueOffset = ht_store_string(ht, ref, value, valueLength);
+        if (valueOffset == HT_NO_STRING) {
+            errno = ENOSPC;
+            return -1;
+        }
+        ht_touch(ht, e, sizeof(HTEntry));
+        *ht_garbage(ht, ref) += strlen(ht_value(ht, ref)) + 1;
+        e->valueOffset = valueOffset;
+        ht_maybe_compact(ht);
+        return 0;
+    }
+
+    uint32_t ref = (uint32_t)h->entriesUsed + 1;
+    HTEntry* e = ht_entry(ht, ref);
+    ht_touch(ht, e, sizeof(HTEntry));
+    e->hash = hash;
+    e->keyLength = keyLength;
+    e->keyOffset = ht_store_string(ht, ref, key, keyLength);
+    e->valueOffset = ht_store_string(ht, ref, value, valueLength);
+    h->entriesUsed++;
+    h->count++;
+    ht_ranks_append(ht);
+
+    // New entries always go into the newest table, so the old one only ever shrinks
+    ht_link(ht, ht_is_rehashing(ht) ? 1 : 0, (uint32_t)h->entriesUsed);
+
+    ht_start_grow(ht);
+    return 0;
+}
+
+// Insert value into table based on key, replacing the value if the key already exists;
+// returns 0 on success or -1 with errno set to ENOSPC if the table is full (or ENOMEM if a table
+// in memory could not grow)
+int ht_insert(HashTable* ht, const char* key, const char* value) {
+    ht_rehash_step(ht);
+    ht_compact_step(ht);
+    return ht_insert_hashed(ht, key, ht_hash(key), value);
+}
+
+// Remove the entry matching key, if there is one
+void ht_remove(HashTable* ht, const char* key) {
+    HTHeader* h = ht->header;
+    ht_rehash_step(ht);
+
+    uint32_t* link = ht_find(ht, key, ht_hash(key));
+    if (link == NULL)
+        return;
+    uint32_t ref = *link;
+    HTEntry* e = ht_entry(ht, ref);
+    ht_touch(ht, link, sizeof(*link));
+    ht_touch(ht, e, sizeof(HTEntry));
+    ht_touch(ht, h, sizeof(HTHeader));
+    *link = e->next;
+    *ht_garbage(ht, ref) += e->keyLength + strlen(ht_value(ht, ref)) + 2;
+    e->keyOffset = HT_NO_STRING;
+    h->count--;
+    ht_ranks_add(ht, ref, -1);
+    ht_maybe_compact(ht);
+}
+
+// Return value from table based on key, or NULL if it is not found.
+// The returned string is only valid until the table is next changed.
+const char* ht_get(HashTable* ht, const char* key) {
+    ht_rehash_step(ht);
+
+    uint32_t* link = ht_find(ht, key, ht_hash(key));
+    return (link != NULL) ? ht_value(ht, *link) : NULL;
+}
+
+// Batched lookups. Looking up one key at a time, the CPU sits idle for every cache miss along
+// the way (bucket, entry, key string), and in a table much bigger than the cache that's all
+// of them. ht_get_many() keeps HT_BATCH_WINDOW lookups in flight instead: each step of a
+// lookup prefetches the memory the next step needs and then switches to another lookup, so
+// by the time it comes back the data has arrived ("asynchronous memory access chaining").
+
+#define HT_BATCH_WINDOW 16
+
+enum { HT_PROBE_BUCKET, HT_PROBE_ENTRY, HT_PROBE_KEY, HT_PROBE_DONE };
+
+typedef struct HTProbe {
+    size_t index;                       // which key this lookup is for
+    uint64_t hash;
+    int stage;
+    int table;
+    uint32_t* bucket;
+    uint32_t ref;
+} HTProbe;
+
+// Point a lookup at its bucket in the given table and prefetch it
+static void ht_probe_bucket(HashTable* ht, HTProbe* p, int table) {
+    p->table = table;
+    p->bucket = &ht_buckets(ht, table)[p->hash & (ht->header->bucketsSize[table] - 1)];
+    p->stage = HT_PROBE_BUCKET;
+    __builtin_prefetch(p->bucket);
+}
+
+static void ht_probe_start(HashTable* ht, HTProbe* p, size_t index, uint64_t hash) {
+    p->index = index;
+    p->hash = hash;
+    // A table[0] bucket that has already been moved is known to be empty, so skip its miss
+    if (ht_is_rehashing(ht) && (int64_t)(hash & (ht->header->bucketsSize[0] - 1)) < ht->header->rehashIndex)
+        ht_probe_bucket(ht, p, 1);
+    else
+        ht_probe_bucket(ht, p, 0);
+}
+
+// Follow the chain to ref, or move on to the next table (or give up) at the end of it
+static void ht_probe_follow(HashTable* ht, HTProbe* p, uint32_t ref, const char** values) {
+    if (ref != HT_NONE) {
+        p->ref = ref;
+        p->stage = HT_PROBE_ENTRY;
+        __builtin_prefetch(ht_entry(ht, ref));
+    } else if (p->table == 0 && ht_is_rehashing(ht)) {
+        ht_probe_bucket(ht, p, 1);
+    } else {
+        values[p->index] = NULL;
+        p->stage = HT_PROBE_DONE;
+    }
+}
+
+// Advance one lookup by one step
+static void ht_probe_step(HashTable* ht, HTProbe* p, const char* const* keys, const char** values) {
+    HTEntry* e;
+    switch (p->stage) {
+    case HT_PROBE_BUCKET:
+        ht_probe_follow(ht, p, *p->bucket, values);
+        break;
+    case HT_PROBE_ENTRY:
+        e = ht_entry(ht, p->ref);
+        if (e->hash == p->hash) {
+            p->stage = HT_PROBE_KEY;
+            __builtin_prefetch(ht_key(ht, p->ref));
+        } else {
+            ht_probe_follow(ht, p, e->next, values);
+        }
+        break;
+    case HT_PROBE_KEY:
+        e = ht_entry(ht, p->ref);
+        if (strcmp(ht_key(ht, p->ref), keys[p->index]) == 0) {
+            values[p->index] = ht_value(ht, p->ref);
+            p->stage = HT_PROBE_DONE;
+        } else {
+            ht_probe_follow(ht, p, e->next, values);
+        }
+        break;
+    }
+}
+
+// Look up n keys at once: values[i] is set to the value for keys[i], or NULL if it is not found.
+// Same result as calling ht_get() for each key, and the same lifetime for the returned strings.
+void ht_get_many(HashTable* ht, const char* const* keys, size_t n, const char** values) {
+    HTProbe probes[HT_BATCH_WINDOW];
+    uint64_t hashes[HT_BATCH_WINDOW];
+
+    // Do the rehashing work the individual lookups would have done before any probing
+    // starts, so the chains stay put while lookups are in flight
+    for (size_t i = 0; i < n && ht_is_rehashing(ht); i++)
+        ht_rehash_step(ht);
+
+    for (size_t start = 0; start < n; start += HT_BATCH_WINDOW) {
+        size_t window = (n - start < HT_BATCH_WINDOW) ? n - start : HT_BATCH_WINDOW;
+
+        // Hash the whole window first, then start every lookup, so all the bucket misses overlap
+        for (size_t i = 0; i < window; i++)
+            hashes[i] = ht_hash(keys[start + i]);
+        for (size_t i = 0; i < window; i++)
+            ht_probe_start(ht, &probes[i], start + i, hashes[i]);
+
+        size_t active = window;
+        while (active > 0) {
+            for (size_t i = 0; i < active; ) {
+                ht_probe_step(ht, &probes[i], keys, values);
+                if (probes[i].stage == HT_PROBE_DONE)
+                    probes[i] = probes[--active];
+                else
+                    i++;
+            }
+        }
+    }
+}
+
+// Insert n key/value pairs, like calling ht_insert() for each. Keys are hashed and their buckets
+// prefetched one window ahead of the inserts. Returns 0 on success, or -1 with errno set if an
+// insert failed, in which case the pairs before it have been inserted.
+int ht_insert_many(HashTable* ht, const char* const* keys, const char* const* values, size_t n) {
+    uint64_t hashes[2][HT_BATCH_WINDOW];
+
+    for (size_t start = 0; start < n + HT_BATCH_WINDOW; start += HT_BATCH_WINDOW) {
+        // Hash and prefetch the next window...
+        uint64_t* next = hashes[(start / HT_BATCH_WINDOW) % 2];
+        for (size_t i = start; i < n && i < start + HT_BATCH_WINDOW; i++) {
+            next[i - start] = ht_hash(keys[i]);
+            int t = ht_is_rehashing(ht) ? 1 : 0;
+            __builtin_prefetch(&ht_buckets(ht, t)[next[i - start] & (ht->header->bucketsSize[t] - 1)]);
+        }
+        if (start == 0)
+            continue;
+
+        // ...while inserting the one prefetched last time
+        uint64_t* current = hashes[(start / HT_BATCH_WINDOW - 1) % 2];
+        for (size_t i = start - HT_BATCH_WINDOW; i < n && i < start; i++) {
+            ht_rehash_step(ht);
+            ht_compact_step(ht);
+            if (ht_insert_hashed(ht, keys[i], current[i - (start - HT_BATCH_WINDOW)], values[i]) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// Return the nth item in the table (in insertion order) through key/value;
+// returns 0 if there are not n+1 items. Without removed entries in the way this is a single
+// array access; otherwise it is a descent of the live entry counts, O(log n), which the first
+// such call builds. Only if there is no memory for them does it walk past the holes instead.
+int ht_getnthitem(HashTable* ht, long n, const char** key, const char** value) {
+    HTHeader* h = ht->header;
+    if (n < 0 || (uint64_t)n >= h->count)
+        return 0;
+    uint32_t ref = (uint32_t)n + 1;
+    if (h->entriesUsed != h->count && (ht->ranks != NULL || ht_ranks_build(ht) == 0)) {
+        ref = ht_ranks_find(ht, (uint64_t)n);
+    } else if (h->entriesUsed != h->count) {
+        for (ref = 1; ; ref++) {
+            if (ht_entry(ht, ref)->keyOffset != HT_NO_STRING && n-- == 0)
+                break;
+        }
+    }
+    *key = ht_key(ht, ref);
+    *value = ht_value(ht, ref);
+    return 1;
+}
+
+// Iterate over every item in insertion order: start with *position = 0 and call until it returns 0.
+// Removals and lookups never move entries, so it is safe to remove the returned key while iterating;
+// inserts do compaction work that can move entries behind *position.
+int ht_next(HashTable* ht, size_t* position, const char** key, const char** value) {
+    while (*position < ht->header->entriesUsed) {
+        uint32_t ref = (uint32_t)++(*position);
+        if (ht_entry(ht, ref)->keyOffset != HT_NO_STRING) {
+            *key = ht_key(ht, ref);
+            *value = ht_value(ht, ref);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+size_t ht_len(HashTable* ht) {
+    return ht->header->count;
+}
+
+// Remove every entry and start over with the given number of buckets
+int ht_clear(HashTable* ht, size_t buckets) {
+    if (ht->fd < 0) {
+        ht_destroy(ht);
+        return ht_init(ht, buckets);
+    }
+
+    // A file keeps its place; the bucket arrays are zeroed so the file stays consistent
+    // at every ht_sync(), and the rest of the old contents is released by the next sync
+    HTHeader* h = ht->header;
+    for (int t = 0; t < (ht_is_rehashing(ht) ? 2 : 1); t++) {
+        ht_touch(ht, ht_buckets(ht, t), h->bucketsSize[t] * sizeof(uint32_t));
+        memset(ht_buckets(ht, t), 0, h->bucketsSize[t] * sizeof(uint32_t));
+    }
+    uint32_t section = h->bucketsSection[0];
+    ht_ranks_drop(ht);
+    ht_init_header(ht, buckets, h->sectionSize);
+    h->bucketsSection[0] = section;
+    h->bucketsSection[1] = HT_SECTION_BUCKETS + 1 - (section - HT_SECTION_BUCKETS);
+    return 0;
+}
+
+#ifndef DATASTRUCTURES_NO_MAIN
+// Unit testing code begins here
+
+static int gFailures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        gFailures++; \
+    } \
+} while (0)
+
+static int str_eq(const char* a, const char* b) {
+    return a != NULL && b != NULL && strcmp(a, b) == 0;
+}
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The same cases as TestHashTable in DataStructuresPython.py
+
+static void test_insert_and_get() {
+    HashTable ht;
+    ht_init(&ht, 10);
+    ht_insert(&ht, "key1", "value1");
+    ht_insert(&ht, "key2", "value2");
+    CHECK(str_eq(ht_get(&ht, "key1"), "value1"));
+    CHECK(str_eq(ht_get(&ht, "key2"), "value2"));
+    ht_insert(&ht, "key1", "value3");
+    CHECK(str_eq(ht_get(&ht, "key1"), "value3"));
+    ht_destroy(&ht);
+}
+
+static void test_collision_handling() {
+    HashTable ht;
+    ht_init(&ht, 1);
+    ht_insert(&ht, "key1", "value1");
+    ht_insert(&ht, "key2", "value2");
+    CHECK(str_eq(ht_get(&ht, "key1"), "value1"));
+    CHECK(str_eq(ht_get(&ht, "key2"), "value2"));
+    ht_destroy(&ht);
+}
+
+static void test_remove() {
+    HashTable ht;
+    ht_init(&ht, 10);
+    ht_insert(&ht, "key1", "value1");
+    ht_remove(&ht, "key1");
+    CHECK(ht_get(&ht, "key1") == NULL);
+    ht_destroy(&ht);
+}
+
+static void test_getnthitem() {
+    HashTable ht;
+    const char *key0 = NULL, *value0 = NULL, *key1 = NULL, *value1 = NULL, *key, *value;
+    ht_init(&ht, 10);
+    ht_insert(&ht, "key1", "value1");
+    ht_insert(&ht, "key2", "value2");
+    CHECK(ht_getnthitem(&ht, 0, &key0, &value0));
+    CHECK(ht_getnthitem(&ht, 1, &key1, &value1));
+    CHECK((str_eq(key0, "key1") && str_eq(value0, "value1") && str_eq(key1, "key2") && str_eq(value1, "value2")) ||
+          (str_eq(key1, "key1") && str_eq(value1, "value1") && str_eq(key0, "key2") && str_eq(value0, "value2")));
+    CHECK(!ht_getnthitem(&ht, -1, &key, &value));
+    CHECK(!ht_getnthitem(&ht, 2, &key, &value));
+    ht_destroy(&ht);
+}
+
+// Every live entry, in order, as ht_next() sees it, is what ht_getnthitem() returns
+static int nth_matches_next(HashTable* ht) {
+    size_t position = 0;
+    const char *key, *value, *nthKey, *nthValue;
+    long n = 0;
+    while (ht_next(ht, &position, &key, &value)) {
+        if (!ht_getnthitem(ht, n++, &nthKey, &nthValue) || nthKey != key || nthValue != value)
+            return 0;
+    }
+    return n == (long)ht_len(ht) && !ht_getnthitem(ht, n, &nthKey, &nthValue);
+}
+
+static void test_getnthitem_with_holes() {
+    HashTable ht;
+    char key[32];
+    ht_init(&ht, 16);
+    for (int i = 0; i < 5000; i++) {
+        sprintf(key, "key%d", i);
+        ht_insert(&ht, key, "value");
+    }
+    ht_remove(&ht, "key0");
+    ht_remove(&ht, "key4999");
+    CHECK(nth_matches_next(&ht) && ht.ranks != NULL);
+
+    // The counts follow removals, appends, compaction moving entries and it finishing
+    for (int i = 1; i < 5000; i++) {
+        sprintf(key, "key%d", i);
+        if (i % 5 != 0)
+            ht_remove(&ht, key);
+    }
+    CHECK(nth_matches_next(&ht) && ht_is_compacting(&ht));
+    int next = 5000;
+    while (ht.header->compactNext < 2500) {
+        sprintf(key, "key%d", next++);
+        ht_insert(&ht, key, "value");
+    }
+    ht_remove(&ht, "key5");
+    ht_remove(&ht, "key4995");
+    CHECK(nth_matches_next(&ht));
+    while (ht_is_compacting(&ht)) {
+        sprintf(key, "key%d", next++);
+        ht_insert(&ht, key, "value");
+    }
+    CHECK(nth_matches_next(&ht) && ht.ranksSize == ht.header->entriesUsed);
+    ht_remove(&ht, "key10");
+    sprintf(key, "key%d", next++);
+    ht_insert(&ht, key, "value");
+    CHECK(nth_matches_next(&ht));
+    ht_destroy(&ht);
+}
+
+static void test_clear() {
+    HashTable ht;
+    ht_init(&ht, 10);
+    ht_insert(&ht, "key1", "value1");
+    ht_clear(&ht, 5);
+    CHECK(ht_get(&ht, "key1") == NULL);
+    CHECK(ht_len(&ht) == 0);
+    ht_destroy(&ht);
+}
+
+// getnthitem() and ht_next() follow insertion order, even after removals
+static void test_insertion_order() {
+    HashTable ht;
+    char key[32];
+    const char *k, *v;
+    ht_init(&ht, 4);
+    for (int i = 0; i < 100; i++) {
+        sprintf(key, "key%d", i);
+        ht_insert(&ht, key, "value");
+    }
+    for (int i = 0; i < 100; i += 3) {
+        sprintf(key, "key%d", i);
+        ht_remove(&ht, key);
+    }
+
+    size_t position = 0;
+    int expected = 1;
+    while (ht_next(&ht, &position, &k, &v)) {
+        sprintf(key, "key%d", expected);
+        CHECK(str_eq(k, key));
+        expected += (expected % 3 == 2) ? 2 : 1;
+    }
+    CHECK(expected == 100);
+
+    CHECK(ht_getnthitem(&ht, 0, &k, &v) && str_eq(k, "key1"));
+    CHECK(ht_getnthitem(&ht, 2, &k, &v) && str_eq(k, "key4"));
+    CHECK(ht_getnthitem(&ht, 65, &k, &v) && str_eq(k, "key98"));
+    CHECK(!ht_getnthitem(&ht, 66, &k, &v));
+    CHECK(str_eq(ht_get(&ht, "key98"), "value") && ht_get(&ht, "key99") == NULL);
+    ht_destroy(&ht);
+}
+
+// Every key stays reachable while the table grows, including halfway through a rehash
+static void test_incremental_rehash() {
+    HashTable ht;
+    char key[32], value[32];
+    int sawRehash = 0;
+    ht_init(&ht, 1);
+    for (int i = 0; i < 5000; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(value, "value%d", i);
+        ht_insert(&ht, key, value);
+        sawRehash |= ht_is_rehashing(&ht);
+        if (i % 7 == 0)
+            ht_remove(&ht, key);
+    }
+    CHECK(sawRehash);
+    for (int i = 0; i < 5000; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(value, "value%d", i);
+        if (i % 7 == 0)
+            CHECK(ht_get(&ht, key) == NULL);
+        else
+            CHECK(str_eq(ht_get(&ht, key), value));
+    }
+    CHECK(ht_len(&ht) == 5000 - (5000 + 6) / 7);
+    ht_destroy(&ht);
+}
+
+// Lookups, replacements, removals and both kinds of iteration stay right halfway through a compaction
+static void test_incremental_compaction() {
+    HashTable ht;
+    char key[32], value[32];
+    const char *k, *v;
+    ht_init(&ht, 16);
+    for (int i = 0; i < 3000; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(value, "value%d", i);
+        ht_insert(&ht, key, value);
+    }
+    for (int i = 0; i < 3000; i++) {
+        sprintf(key, "key%d", i);
+        if (i % 3 != 0)
+            ht_remove(&ht, key);
+    }
+    CHECK(ht_is_compacting(&ht) && ht.header->compactUsed == 0);
+
+    // Each insert moves a few entries; stop with key0..key999 partly moved
+    int next = 3000;
+    while (ht.header->compactNext < 1000) {
+        sprintf(key, "key%d", next);
+        sprintf(value, "value%d", next);
+        ht_insert(&ht, key, value);
+        next++;
+    }
+    CHECK(ht_is_compacting(&ht) && ht_is_compacted(&ht, 1) && !ht_is_compacted(&ht, 3000));
+    ht_insert(&ht, "key0", "replaced0");
+    ht_insert(&ht, "key2997", "replaced2997");
+    ht_remove(&ht, "key3");
+    ht_remove(&ht, "key2994");
+    for (int i = 0; i < next; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(value, "value%d", i);
+        if (i == 0)
+            CHECK(str_eq(ht_get(&ht, key), "replaced0"));
+        else if (i == 2997)
+            CHECK(str_eq(ht_get(&ht, key), "replaced2997"));
+        else if ((i < 3000 && i % 3 != 0) || i == 3 || i == 2994)
+            CHECK(ht_get(&ht, key) == NULL);
+        else
+            CHECK(str_eq(ht_get(&ht, key), value));
+    }
+    CHECK(ht_getnthitem(&ht, 0, &k, &v) && str_eq(k, "key0") && str_eq(v, "replaced0"));
+    CHECK(ht_getnthitem(&ht, 1, &k, &v) && str_eq(k, "key6"));
+    CHECK(ht_getnthitem(&ht, 997, &k, &v) && str_eq(k, "key2997") && str_eq(v, "replaced2997"));
+    CHECK(ht_getnthitem(&ht, 998, &k, &v) && str_eq(k, "key3000"));
+    CHECK(ht_is_compacting(&ht));
+
+    size_t position = 0;
+    long seen = 0;
+    while (ht_next(&ht, &position, &k, &v))
+        seen++;
+    CHECK(seen == (long)ht_len(&ht));
+
+    // Once the cursor passes the end, the holes are gone, except key3's, which was removed
+    // after it had moved. So are the strings, except key3's and key0's old value.
+    while (ht_is_compacting(&ht)) {
+        sprintf(key, "key%d", next);
+        sprintf(value, "value%d", next);
+        ht_insert(&ht, key, value);
+        next++;
+    }
+    CHECK(ht.header->entriesUsed == ht.header->count + 1);
+    CHECK(ht.header->stringsGarbage == strlen("key3 value3 value0 "));
+    CHECK(ht_getnthitem(&ht, 998, &k, &v) && str_eq(k, "key3000") && str_eq(v, "value3000"));
+    CHECK(str_eq(ht_get(&ht, "key2997"), "replaced2997") && ht_get(&ht, "key2994") == NULL);
+    ht_destroy(&ht);
+}
+
+// Close a file-backed table without saving, as if the process had crashed
+static void abandon(HashTable* ht) {
+    close(ht->undoFd);
+    close(ht->fd);
+    munmap(ht->base, ht->regionSize);
+    free(ht->dirty.pages);
+    free(ht->ranks);
+}
+
+static void fill(HashTable* ht, int from, int to) {
+    char key[32], value[32];
+    for (int i = from; i < to; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(value, "value%d", i);
+        ht_insert(ht, key, value);
+    }
+}
+
+static int holds(HashTable* ht, int from, int to) {
+    char key[32], value[32];
+    for (int i = from; i < to; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(value, "value%d", i);
+        if (!str_eq(ht_get(ht, key), value))
+            return 0;
+    }
+    return 1;
+}
+
+// A file-backed table comes back as it was last synced, including halfway through a rehash
+static void test_persistence() {
+    char path[] = "/tmp/hashtable-test-XXXXXX";
+    char undoPath[64], key[32];
+    int fd = mkstemp(path);
+    close(fd);
+    unlink(path);
+    sprintf(undoPath, "%s-undo", path);
+
+    HashTable ht;
+    const char *k, *v;
+    CHECK(ht_open(&ht, path, 4) == 0);
+    fill(&ht, 0, 3000);
+    ht_remove(&ht, "key5");
+    CHECK(ht_sync(&ht) == 0);
+    fill(&ht, 3000, 4000);
+    ht_destroy(&ht);
+
+    CHECK(ht_open(&ht, path, 4) == 0);
+    CHECK(ht_len(&ht) == 3999 && holds(&ht, 0, 5) && holds(&ht, 6, 4000) && ht_get(&ht, "key5") == NULL);
+    CHECK(ht_getnthitem(&ht, 5, &k, &v) && str_eq(k, "key6"));
+
+    // Changes that were never synced are lost, but nothing else is
+    fill(&ht, 4000, 5000);
+    abandon(&ht);
+    CHECK(ht_open(&ht, path, 4) == 0);
+    CHECK(ht_len(&ht) == 3999 && holds(&ht, 6, 4000) && ht_get(&ht, "key4000") == NULL);
+
+    // Crash after some pages were overwritten: the undo log puts them back
+    fill(&ht, 4000, 5000);
+    size_t n = ht.dirty.count;
+    uint64_t* pages = ht_sync_write_undo_log(&ht);
+    CHECK(pages != NULL && n > 0);
+    CHECK(ht_sync_write_pages(&ht, pages, n / 2) == 0);
+    free(pages);
+    abandon(&ht);
+    CHECK(ht_open(&ht, path, 4) == 0);
+    CHECK(ht_len(&ht) == 3999 && holds(&ht, 6, 4000) && ht_get(&ht, "key4000") == NULL);
+
+    // Crash while writing the undo log: the file was never touched, so the log is ignored
+    fill(&ht, 4000, 5000);
+    pages = ht_sync_write_undo_log(&ht);
+    free(pages);
+    CHECK(truncate(undoPath, 100) == 0);
+    abandon(&ht);
+    CHECK(ht_open(&ht, path, 4) == 0);
+    CHECK(ht_len(&ht) == 3999 && holds(&ht, 6, 4000));
+
+    // Halfway through a compaction
+    for (int i = 6; i < 3000; i++) {
+        sprintf(key, "key%d", i);
+        ht_remove(&ht, key);
+    }
+    fill(&ht, 5000, 5100);
+    CHECK(ht_is_compacting(&ht) && ht_sync(&ht) == 0);
+    abandon(&ht);
+    CHECK(ht_open(&ht, path, 4) == 0);
+    CHECK(ht_is_compacting(&ht) && ht_len(&ht) == 1105 && holds(&ht, 0, 5) && holds(&ht, 3000, 4000) &&
+          holds(&ht, 5000, 5100) && ht_get(&ht, "key6") == NULL);
+
+    CHECK(ht_clear(&ht, 16) == 0);
+    fill(&ht, 0, 10);
+    ht_destroy(&ht);
+    CHECK(ht_open(&ht, path, 4) == 0);
+    CHECK(ht_len(&ht) == 10 && holds(&ht, 0, 10) && ht_get(&ht, "key10") == NULL);
+    ht_destroy(&ht);
+
+    // Anything else is refused rather than misread
+    fd = open(path, O_WRONLY | O_TRUNC);
+    CHECK(write(fd, "not a hash table", 16) == 16);
+    close(fd);
+    CHECK(ht_open(&ht, path, 4) == -1 && errno == EINVAL);
+
+    unlink(path);
+    unlink(undoPath);
+}
+
+// A table in memory only reserves what it needs, so it works under a small address space limit,
+// growing (and moving) as it fills, and reports it cleanly if it can't even start
+static void test_small_address_space() {
+    HashTable ht;
+    struct rlimit old, limit;
+    getrlimit(RLIMIT_AS, &old);
+    limit = old;
+    limit.rlim_cur = 1ULL << 31;
+    CHECK(setrlimit(RLIMIT_AS, &limit) == 0);
+
+    CHECK(ht_init(&ht, 4) == 0);
+    char* base = ht.base;
+    fill(&ht, 0, 200000);
+    CHECK(ht.base != base && ht.header->sectionSize > HT_MIN_SECTION_SIZE);
+    CHECK(ht_len(&ht) == 200000 && holds(&ht, 0, 200000));
+    ht_destroy(&ht);
+
+    CHECK(ht_init(&ht, 1ULL << 30) == -1 && errno == ENOMEM && ht.base == NULL);
+    ht_destroy(&ht);
+    setrlimit(RLIMIT_AS, &old);
+}
+
+// get_many/insert_many give the same answers as get/insert, including during a rehash
+static void test_batched_operations() {
+    HashTable ht;
+    const char* keys[1000];
+    const char* values[1000];
+    const char* results[1000];
+    char storage[1000][2][32];
+    for (int i = 0; i < 1000; i++) {
+        sprintf(storage[i][0], "key%d", i);
+        sprintf(storage[i][1], "value%d", i);
+        keys[i] = storage[i][0];
+        values[i] = storage[i][1];
+    }
+
+    ht_init(&ht, 1);
+    CHECK(ht_insert_many(&ht, keys, values, 500) == 0);
+    CHECK(ht_len(&ht) == 500 && holds(&ht, 0, 500));
+    CHECK(ht_insert_many(&ht, keys, values, 0) == 0);
+
+    // Keep inserting one at a time until we are partway through a rehash
+    int i = 500;
+    while (!ht_is_rehashing(&ht) && i < 1000) {
+        ht_insert(&ht, keys[i], values[i]);
+        i++;
+    }
+    CHECK(ht_is_rehashing(&ht));
+    for (int round = 0; round < 3; round++) {
+        ht_get_many(&ht, keys, 1000, results);
+        for (int j = 0; j < 1000; j++)
+            CHECK(j < i ? str_eq(results[j], values[j]) : results[j] == NULL);
+    }
+    ht_destroy(&ht);
+}
+
+// Compare one-at-a-time lookups with batched lookups on a table of the given size
+static void report_batched_lookups(long entries) {
+    HashTable ht;
+    const long lookups = 1000000, batch = 1000;
+    char (*keyStorage)[24] = malloc(batch * sizeof(*keyStorage));
+    const char** keys = malloc(batch * sizeof(char*));
+    const char** values = malloc(batch * sizeof(char*));
+    char key[32];
+    ht_init(&ht, entries);
+    for (long i = 0; i < entries; i++) {
+        sprintf(key, "key%ld", i);
+        ht_insert(&ht, key, "value");
+    }
+
+    // Each batch gets fresh random keys, so neither version finds them already in the cache
+    double single = 0, batched = 0;
+    long notFound = 0;
+    for (long done = 0; done < 2 * lookups; done += batch) {
+        for (long i = 0; i < batch; i++) {
+            sprintf(keyStorage[i], "key%ld", random() % entries);
+            keys[i] = keyStorage[i];
+        }
+        double start = now_seconds();
+        if ((done / batch) % 2 == 0) {
+            for (long i = 0; i < batch; i++)
+                notFound += (ht_get(&ht, keys[i]) == NULL);
+            single += now_seconds() - start;
+        } else {
+            ht_get_many(&ht, keys, batch, values);
+            batched += now_seconds() - start;
+            for (long i = 0; i < batch; i++)
+                notFound += (values[i] == NULL);
+        }
+    }
+    printf("%ld lookups in a %ld-entry table: get %.1fns each, get_many %.1fns each%s\n", lookups, entries,
+           single / lookups * 1e9, batched / lookups * 1e9, notFound ? " (KEYS MISSING)" : "");
+
+    ht_destroy(&ht);
+    free(keyStorage);
+    free(keys);
+    free(values);
+}
+
+// Insert a lot of entries and report the slowest single insert, which growth would dominate.
+// Then remove most of them and insert more, which compaction would dominate.
+static void report_worst_case_latency(long entries) {
+    HashTable ht;
+    char key[32];
+    double worst = 0, start = now_seconds();
+    ht_init(&ht, HT_MIN_BUCKETS);
+    for (long i = 0; i < entries; i++) {
+        sprintf(key, "key%ld", i);
+        double before = now_seconds();
+        ht_insert(&ht, key, "value");
+        double elapsed = now_seconds() - before;
+        if (elapsed > worst)
+            worst = elapsed;
+    }
+    printf("Inserted %ld entries in %.2fs, slowest insert %.1fus\n", entries, now_seconds() - start, worst * 1e6);
+
+    double worstRemove = 0;
+    worst = 0;
+    for (long i = 0; i < entries; i++) {
+        if (i % 4 == 0)
+            continue;
+        sprintf(key, "key%ld", i);
+        double before = now_seconds();
+        ht_remove(&ht, key);
+        double elapsed = now_seconds() - before;
+        if (elapsed > worstRemove)
+            worstRemove = elapsed;
+    }
+    for (long i = entries; i < entries + entries / 2; i++) {
+        sprintf(key, "key%ld", i);
+        double before = now_seconds();
+        ht_insert(&ht, key, "value");
+        double elapsed = now_seconds() - before;
+        if (elapsed > worst)
+            worst = elapsed;
+    }
+    printf("Removed %ld entries, slowest remove %.1fus; slowest insert while compacting %.1fus\n",
+           entries - (entries + 3) / 4, worstRemove * 1e6, worst * 1e6);
+
+    // Paging through a table with holes in it, which compaction leaves behind too
+    const char *k, *v;
+    long pages = 0;
+    start = now_seconds();
+    for (long n = 0; n < (long)ht_len(&ht); n += 10, pages++)
+        ht_getnthitem(&ht, n, &k, &v);
+    printf("getnthitem with holes: %ld calls in %.2fms\n", pages, (now_seconds() - start) * 1e3);
+    ht_destroy(&ht);
+}
+
+// Open (or build) a table file and report how soon it can answer lookups
+static void report_open_time(const char* path, long entries) {
+    HashTable ht;
+    char key[32];
+    double start = now_seconds();
+    if (ht_open(&ht, path, HT_MIN_BUCKETS) != 0) {
+        perror("Failed to open hash table file");
+        return;
+    }
+    if (ht_len(&ht) == 0) {
+        for (long i = 0; i < entries; i++) {
+            sprintf(key, "key%ld", i);
+            ht_insert(&ht, key, "value");
+        }
+        ht_sync(&ht);
+        printf("Built %s with %ld entries in %.2fs\n", path, entries, now_seconds() - start);
+        ht_destroy(&ht);
+        return;
+    }
+
+    printf("Opened %s with %zu entries in %.1fus\n", path, ht_len(&ht), (now_seconds() - start) * 1e6);
+    start = now_seconds();
+    long found = 0;
+    for (long i = 0; i < 1000; i++) {
+        sprintf(key, "key%ld", random() % (long)ht_len(&ht));
+        found += (ht_get(&ht, key) != NULL);
+    }
+    printf("First 1000 lookups took %.2fms (%ld found)\n", (now_seconds() - start) * 1e3, found);
+    ht_destroy(&ht);
+}
+
+int main(int argc, char* argv[]) {
+    long entries = (argc > 1) ? atol(argv[1]) : 1000000;
+
+    test_insert_and_get();
+    test_collision_handling();
+    test_remove();
+    test_getnthitem();
+    test_getnthitem_with_holes();
+    test_clear();
+    test_insertion_order();
+    test_incremental_rehash();
+    test_incremental_compaction();
+    test_persistence();
+    test_small_address_space();
+    test_batched_operations();
+    if (gFailures > 0) {
+        fprintf(stderr, "%d checks failed\n", gFailures);
+        return 1;
+    }
+    printf("All tests passed\n");
+
+    report_worst_case_latency(entries);
+    report_batched_lookups(entries);
+    if (argc > 2)
+        report_open_time(argv[2], entries);
+    return 0;
+}
+#endif
@@ -0,0 +1,467 @@
+/*
+    A concurrent priority queue for handing prioritized tasks to many worker threads.
+
+    PriorityQueue (pq_*) is the straightforward version: one binary heap protected by one
+    mutex, with the same enqueue(item, priority)/dequeue() shape as the PriorityQueue class
+    in DataStructuresPython.py (higher priority number = higher priority, FIFO for ties).
+    Every worker has to take the same lock, so it stops scaling after a few threads.
+
+    MultiQueue (mq_*) is a relaxed version made of c*P small heaps, each with its own lock,
+    where P is the number of threads and c is a small constant (2-4). enqueue() pushes into
+    a random heap. dequeue() looks at the tops of two random heaps and pops from whichever
+    one has the higher priority. Threads almost never touch the same lock, so throughput
+    scales nearly linearly, at the cost of sometimes returning an item that is not the
+    global maximum. The "rank error" (how many queued items had a higher priority than the
+    one we returned) stays small on average, which is fine for task scheduling.
+
+    Running this program benchmarks both queues and reports throughput and rank error:
+        gcc -O2 -pthread PriorityQueueC.c -o pqueue
+        ./pqueue [threads] [c]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+typedef struct PQItem {
+    void* item;
+    int priority;
+    unsigned long sequence;     // insertion order, so equal priorities come out FIFO
+} PQItem;
+
+typedef struct BinaryHeap {
+    PQItem* items;
+    size_t count;
+    size_t capacity;
+} BinaryHeap;
+
+typedef struct PriorityQueue {
+    BinaryHeap heap;
+    unsigned long nextSequence;
+    pthread_mutex_t lock;
+} PriorityQueue;
+
+typedef struct MQHeap {
+    _Alignas(64) BinaryHeap heap;   // one heap per cache line, so neighbouring locks don't false-share
+    pthread_mutex_t lock;
+    atomic_int topPriority;     // priority of heap.items[0], or INT_MIN if empty; read without the lock
+} MQHeap;
+
+typedef struct MultiQueue {
+    MQHeap* heaps;
+    int numHeaps;
+    atomic_ulong nextSequence;
+} MultiQueue;
+
+// Binary heap helpers (max-heap on priority, then min-heap on sequence)
+
+static int pq_item_before(const PQItem* a, const PQItem* b) {
+    if (a->priority != b->priority)
+        return a->priority > b->priority;
+    return a->sequence < b->sequence;
+}
+
+static void heap_init(BinaryHeap* heap) {
+    heap->items = NULL;
+    heap->count = 0;
+    heap->capacity = 0;
+}
+
+static void heap_free(BinaryHeap* heap) {
+    free(heap->items);
+    heap_init(heap);
+}
+
+static void heap_push(BinaryHeap* heap, PQItem item) {
+    if (heap->count == heap->capacity) {
+        heap->capacity = heap->capacity ? heap->capacity * 2 : 64;
+        heap->items = realloc(heap->items, heap->capacity * sizeof(PQItem));
+        if (heap->items == NULL) {
+            perror("Failed to grow heap");
+            exit(1);
+        }
+    }
+
+    // Sift the new item up from the bottom of the heap
+    size_t i = heap->count++;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!pq_item_before(&item, &heap->items[parent]))
+            break;
+        heap->items[i] = heap->items[parent];
+        i = parent;
+    }
+    heap->items[i] = item;
+}
+
+static PQItem heap_pop(BinaryHeap* heap) {
+    PQItem top = heap->items[0];
+    PQItem last = heap->items[--heap->count];
+
+    // Sift the last item down from the top of the heap
+    size_t i = 0;
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= heap->count)
+            break;
+        if (child + 1 < heap->count && pq_item_before(&heap->items[child + 1], &heap->items[child]))
+            child++;
+        if (!pq_item_before(&heap->items[child], &last))
+            break;
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    if (heap->count > 0)
+        heap->items[i] = last;
+    return top;
+}
+
+// Per-thread random numbers (xorshift64*), so picking heaps never touches shared state
+
+static __thread unsigned long long tMQRandomState = 0;
+
+static unsigned int mq_random() {
+    if (tMQRandomState == 0)
+        tMQRandomState = (unsigned long long)(size_t)&tMQRandomState ^ (unsigned long long)time(NULL) ^ 0x9E3779B97F4A7C15ULL;
+    tMQRandomState ^= tMQRandomState >> 12;
+    tMQRandomState ^= tMQRandomState << 25;
+    tMQRandomState ^= tMQRandomState >> 27;
+    return (unsigned int)((tMQRandomState * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+// PriorityQueue: one heap behind one mutex
+
+void pq_init(PriorityQueue* pq) {
+    heap_init(&pq->heap);
+    pq->nextSequence = 0;
+    pthread_mutex_init(&pq->lock, NULL);
+}
+
+void pq_destroy(PriorityQueue* pq) {
+    heap_free(&pq->heap);
+    pthread_mutex_destroy(&pq->lock);
+}
+
+void pq_enqueue(PriorityQueue* pq, void* item, int priority) {
+    pthread_mutex_lock(&pq->lock);
+    PQItem entry = { item, priority, pq->nextSequence++ };
+    heap_push(&pq->heap, entry);
+    pthread_mutex_unlock(&pq->lock);
+}
+
+// Remove the item with the highest priority; returns 0 if the queue was empty
+int pq_dequeue(PriorityQueue* pq, void** item, int* priority) {
+    pthread_mutex_lock(&pq->lock);
+    if (pq->heap.count == 0) {
+        pthread_mutex_unlock(&pq->lock);
+        return 0;
+    }
+    PQItem top = heap_pop(&pq->heap);
+    pthread_mutex_unlock(&pq->lock);
+
+    *item = top.item;
+    if (priority != NULL)
+        *priority = top.priority;
+    return 1;
+}
+
+size_t pq_len(PriorityQueue* pq) {
+    pthread_mutex_lock(&pq->lock);
+    size_t count = pq->heap.count;
+    pthread_mutex_unlock(&pq->lock);
+    return count;
+}
+
+void pq_clear(PriorityQueue* pq) {
+    pthread_mutex_lock(&pq->lock);
+    pq->heap.count = 0;
+    pthread_mutex_unlock(&pq->lock);
+}
+
+// MultiQueue: c*P heaps with randomized two-choice deletion
+
+static void mq_update_top(MQHeap* h) {
+    atomic_store_explicit(&h->topPriority, h->heap.count ? h->heap.items[0].priority : INT_MIN, memory_order_relaxed);
+}
+
+void mq_init(MultiQueue* mq, int threads, int c) {
+    mq->numHeaps = threads * c;
+    if (mq->numHeaps < 2)
+        mq->numHeaps = 2;
+    mq->heaps = aligned_alloc(64, mq->numHeaps * sizeof(MQHeap));
+    if (mq->heaps == NULL) {
+        perror("Failed to allocate MultiQueue");
+        exit(1);
+    }
+    for (int i = 0; i < mq->numHeaps; i++) {
+        heap_init(&mq->heaps[i].heap);
+        pthread_mutex_init(&mq->heaps[i].lock, NULL);
+        atomic_init(&mq->heaps[i].topPriority, INT_MIN);
+    }
+    atomic_init(&mq->nextSequence, 0);
+}
+
+void mq_destroy(MultiQueue* mq) {
+    for (int i = 0; i < mq->numHeaps; i++) {
+        heap_free(&mq->heaps[i].heap);
+        pthread_mutex_destroy(&mq->heaps[i].lock);
+    }
+    free(mq->heaps);
+}
+
+void mq_enqueue(MultiQueue* mq, void* item, int priority) {
+    PQItem entry = { item, priority, atomic_fetch_add_explicit(&mq->nextSequence, 1, memory_order_relaxed) };
+
+    // Keep trying random heaps until we find one nobody else is using
+    while (1) {
+        MQHeap* h = &mq->heaps[mq_random() % mq->numHeaps];
+        if (pthread_mutex_trylock(&h->lock) != 0)
+            continue;
+        heap_push(&h->heap, entry);
+        mq_update_top(h);
+        pthread_mutex_unlock(&h->lock);
+        return;
+    }
+}
+
+// Remove an item with (approximately) the highest priority; returns 0 if every heap was empty
+int mq_dequeue(MultiQueue* mq, void** item, int* priority) {
+    // Two random choices give a good item quickly; after a few misses, fall back to
+    // a full sweep so we never report "empty" while another heap still holds items
+    for (int attempt = 0; attempt < 2 * mq->numHeaps; attempt++) {
+        MQHeap* a = &mq->heaps[mq_random() % mq->numHeaps];
+        MQHeap* b = &mq->heaps[mq_random() % mq->numHeaps];
+        int pa = atomic_load_explicit(&a->topPriority, memory_order_relaxed);
+        int pb = atomic_load_explicit(&b->topPriority, memory_order_relaxed);
+        MQHeap* h = (pb > pa) ? b : a;
+        if ((pa > pb ? pa : pb) == INT_MIN)
+            continue;
+        if (pthread_mutex_trylock(&h->lock) != 0)
+            continue;
+        if (h->heap.count == 0) {
+            pthread_mutex_unlock(&h->lock);
+            continue;
+        }
+        PQItem top = heap_pop(&h->heap);
+        mq_update_top(h);
+        pthread_mutex_unlock(&h->lock);
+
+        *item = top.item;
+        if (priority != NULL)
+            *priority = top.priority;
+        return 1;
+    }
+
+    for (int i = 0; i < mq->numHeaps; i++) {
+        MQHeap* h = &mq->heaps[i];
+        pthread_mutex_lock(&h->lock);
+        if (h->heap.count > 0) {
+            PQItem top = heap_pop(&h->heap);
+            mq_update_top(h);
+            pthread_mutex_unlock(&h->lock);
+            *item = top.item;
+            if (priority != NULL)
+                *priority = top.priority;
+            return 1;
+        }
+        pthread_mutex_unlock(&h->lock);
+    }
+    return 0;
+}
+
+size_t mq_len(MultiQueue* mq) {
+    size_t count = 0;
+    for (int i = 0; i < mq->numHeaps; i++) {
+        pthread_mutex_lock(&mq->heaps[i].lock);
+        count += mq->heaps[i].heap.count;
+        pthread_mutex_unlock(&mq->heaps[i].lock);
+    }
+    return count;
+}
+
+void mq_clear(MultiQueue* mq) {
+    for (int i = 0; i < mq->numHeaps; i++) {
+        pthread_mutex_lock(&mq->heaps[i].lock);
+        mq->heaps[i].heap.count = 0;
+        mq_update_top(&mq->heaps[i]);
+        pthread_mutex_unlock(&mq->heaps[i].lock);
+    }
+}
+
+#ifndef DATASTRUCTURES_NO_MAIN
+// Benchmark and self-test code begins here
+
+#define PREFILL_ITEMS 100000
+#define OPS_PER_THREAD 1000000
+#define RANK_ITEMS 100000
+
+typedef struct BenchmarkArgs {
+    void* queue;
+    int useMultiQueue;
+    int ops;
+} BenchmarkArgs;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Each worker alternates enqueue and dequeue, like a worker that takes a task and schedules a follow-up
+static void* benchmark_thread(void* arg) {
+    BenchmarkArgs* args = (BenchmarkArgs*)arg;
+    void* item;
+    for (int i = 0; i < args->ops; i++) {
+        int priority = (int)(mq_random() % 1000000);
+        if (args->useMultiQueue) {
+            mq_enqueue((MultiQueue*)args->queue, NULL, priority);
+            mq_dequeue((MultiQueue*)args->queue, &item, NULL);
+        } else {
+            pq_enqueue((PriorityQueue*)args->queue, NULL, priority);
+            pq_dequeue((PriorityQueue*)args->queue, &item, NULL);
+        }
+    }
+    return NULL;
+}
+
+static double run_throughput(void* queue, int useMultiQueue, int threads) {
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    BenchmarkArgs args = { queue, useMultiQueue, OPS_PER_THREAD / threads };
+
+    double start = now_seconds();
+    for (int i = 0; i < threads; i++)
+        pthread_create(&tids[i], NULL, benchmark_thread, &args);
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    double elapsed = now_seconds() - start;
+
+    free(tids);
+    return (2.0 * args.ops * threads) / elapsed;   // enqueue + dequeue per iteration
+}
+
+// Rank error: for every dequeued item, how many items still in the queue had a higher priority.
+// Priorities are a permutation of 0..n-1, so a Fenwick tree over them counts that in O(log n).
+static void measure_rank_error(MultiQueue* mq, int n, double* meanRank, int* maxRank) {
+    int* present = calloc(n + 1, sizeof(int));
+    int* order = malloc(n * sizeof(int));
+    for (int i = 0; i < n; i++)
+        order[i] = i;
+    for (int i = n - 1; i > 0; i--) {
+        int j = mq_random() % (i + 1);
+        int tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+    }
+    for (int i = 0; i < n; i++) {
+        mq_enqueue(mq, NULL, order[i]);
+        for (int k = order[i] + 1; k <= n; k += k & -k)
+            present[k]++;
+    }
+
+    long long totalRank = 0;
+    int remaining = n;
+    *maxRank = 0;
+    void* item;
+    int priority;
+    while (mq_dequeue(mq, &item, &priority)) {
+        int notAbove = 0;       // items with priority <= this one, including itself
+        for (int k = priority + 1; k > 0; k -= k & -k)
+            notAbove += present[k];
+        int rank = remaining - notAbove;
+        totalRank += rank;
+        if (rank > *maxRank)
+            *maxRank = rank;
+        for (int k = priority + 1; k <= n; k += k & -k)
+            present[k]--;
+        remaining--;
+    }
+    *meanRank = (double)totalRank / n;
+
+    free(order);
+    free(present);
+}
+
+static int self_test() {
+    // Same checks as TestPriorityQueue in DataStructuresPython.py
+    PriorityQueue pq;
+    void* item;
+    int priority;
+    pq_init(&pq);
+    pq_enqueue(&pq, "item1", 2);
+    pq_enqueue(&pq, "item2", 1);
+    pq_enqueue(&pq, "item3", 2);
+    int ok = pq_dequeue(&pq, &item, &priority) && strcmp(item, "item1") == 0 && priority == 2
+          && pq_dequeue(&pq, &item, &priority) && strcmp(item, "item3") == 0 && priority == 2
+          && pq_dequeue(&pq, &item, &priority) && strcmp(item, "item2") == 0 && priority == 1
+          && !pq_dequeue(&pq, &item, &priority);
+    pq_enqueue(&pq, "item1", 2);
+    pq_clear(&pq);
+    ok = ok && pq_len(&pq) == 0;
+    pq_destroy(&pq);
+
+    // Every item that goes into a MultiQueue must come out exactly once
+    MultiQueue mq;
+    mq_init(&mq, 4, 2);
+    for (long i = 0; i < 1000; i++)
+        mq_enqueue(&mq, (void*)i, (int)(i % 37));
+    char seen[1000] = { 0 };
+    int count = 0;
+    while (mq_dequeue(&mq, &item, NULL)) {
+        long i = (long)item;
+        if (i < 0 || i >= 1000 || seen[i])
+            ok = 0;
+        else
+            seen[i] = 1;
+        count++;
+    }
+    ok = ok && count == 1000 && mq_len(&mq) == 0;
+    mq_destroy(&mq);
+
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    int maxThreads = (argc > 1) ? atoi(argv[1]) : 8;
+    int c = (argc > 2) ? atoi(argv[2]) : 2;
+
+    if (!self_test()) {
+        fprintf(stderr, "Self test failed\n");
+        return 1;
+    }
+
+    printf("%8s %18s %18s\n", "threads", "locked heap ops/s", "multiqueue ops/s");
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        PriorityQueue pq;
+        MultiQueue mq;
+        pq_init(&pq);
+        mq_init(&mq, threads, c);
+        for (int i = 0; i < PREFILL_ITEMS; i++) {
+            int priority = (int)(mq_random() % 1000000);
+            pq_enqueue(&pq, NULL, priority);
+            mq_enqueue(&mq, NULL, priority);
+        }
+
+        double pqOps = run_throughput(&pq, 0, threads);
+        double mqOps = run_throughput(&mq, 1, threads);
+        printf("%8d %18.0f %18.0f\n", threads, pqOps, mqOps);
+
+        pq_destroy(&pq);
+        mq_destroy(&mq);
+    }
+
+    // A locked heap always has rank error 0, so only the MultiQueue needs measuring
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        MultiQueue mq;
+        double meanRank;
+        int maxRank;
+        mq_init(&mq, threads, c);
+        measure_rank_error(&mq, RANK_ITEMS, &meanRank, &maxRank);
+        printf("MultiQueue with %d heaps: mean rank error %.2f, max rank error %d\n", mq.numHeaps, meanRank, maxRank);
+        mq_destroy(&mq);
+    }
+
+    return 0;
+}
+#endif
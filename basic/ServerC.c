@@ -1,9 +1,94 @@
+/*
+    C version of ServerPython.py. Every connection mode the Python server has (the
+    handle_new_connections_* functions) is here too, plus epoll, and the mode is picked at
+    runtime with -m instead of by commenting lines in and out of start_server():
+
+        simple       accept one client and serve it until it hangs up, then the next one
+        threads      a new thread per client
+        thread_pool  a fixed pool of threads taking accepted clients from a queue
+        select       one thread multiplexing every client with select()
+        poll         the same with poll(), which has no FD_SETSIZE limit
+        epoll        the same with epoll, which does not rescan every client on every wakeup
+
+    All of them share one request handler, process_request(), which does what the Python
+    handlers do to each message (count it, optionally print it, echo it back), so the modes only
+    differ in how they get bytes in and out. They also share one set of metrics: connections,
+    messages, bytes in each direction and a histogram of how long each request took from
+    arriving to its response being sent. Every -i seconds (and once more on Ctrl-C) a line with
+    the numbers for that interval is printed, the same for every mode, so the modes can be
+    benchmarked head to head against the same client load.
+
+    The metrics are sharded per thread: each thread owns a cache line of counters that only it
+    writes, with a plain load and store instead of a lock or a locked add, and the reporter sums
+    the shards. ServerPython.py's messageCounter under messageCounterLock and notify_100()
+    waiting on a Condition become a shared total that each thread adds its messages to in
+    batches (and whenever it is about to sleep, so nothing is held back from an idle server),
+    with a single atomic add. Every multiple of -N messages the total passes is seen by exactly
+    one of those adds, which signals it through an eventfd in semaphore mode, so a watcher
+    blocked on it wakes once per crossing.
+
+    Clients on the same host can skip TCP. With -u the server also listens on a Unix socket,
+    served by the same mode in a thread of its own. With -s it offers a shared memory transport:
+    a client that connects to that Unix socket is handed a memfd holding two single-producer
+    single-consumer rings, one for its requests and one for the responses, and the socket is
+    kept only to notice the client going away. Each side polls the ring it reads for a while and
+    then sleeps on it as a futex, raising a flag so the other side knows to wake it; while both
+    are busy a request and its response cross without a single system call. Every shared memory
+    client gets a thread of its own whatever the mode.
+
+    -b runs a client instead of a server: it measures round trips to a running server over tcp,
+    unix or shm.
+
+    Besides being echoed, a message can be a command. "PUBLISH <count>\n" followed by count
+    SerializedData records, at most CDC_BATCH_RECORDS (16384, or 768 KiB) of them, ingests them
+    as one batch: the batch is framed once, appended to a ring of the last -R batches and
+    answered with "OK <sequence>\n". Only the command line has to arrive in one read, like any
+    other message; the records may take as many reads as they need, and over a socket they are
+    received straight into the batch. The client waits for the answer before sending anything
+    else, since more than count records is refused. "SUBSCRIBE [sequence]" turns a socket
+    connection into a change stream: once the responses to its earlier requests are all sent, it
+    is handed to the change stream sender thread, which sends it every batch from the given one
+    on (from the next one, without a sequence), each frame a CdcFrameHeader and the records.
+    Batches are reference counted so every subscriber sends from the one shared copy at its own
+    cursor, gathering several batches per sendmsg(), with MSG_ZEROCOPY when the send is large
+    enough and the socket supports it; the kernel's completion notices release the batches. A
+    subscriber so slow that the ring laps it is, per -S, dropped or resynced: sent a
+    CDC_FRAME_RESYNC naming the batch it continues from, so it can fetch what it missed some
+    other way.
+
+        gcc -O2 -pthread ServerC.c -o server
+        ./server [-p port] [-m simple|threads|thread_pool|select|poll|epoll] [-t pool threads]
+                 [-i seconds] [-N messages per notification] [-u unix socket] [-s shm socket]
+                 [-R change ring batches] [-S drop|resync] [-v]
+        ./server -b tcp|unix|shm [-p port] [-u unix socket] [-s shm socket] [-r round trips]
+*/
+
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <sys/un.h>
+#include <linux/errqueue.h>
+#include <linux/futex.h>
+#include <sys/select.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 
 // Define data structures and global variables
 
@@ -11,7 +96,7 @@ typedef struct FileHeader {
     // Define structure members to hold file header information
     int numElements;
     int elementSize;
-};
+} FileHeader;
 
 struct SerializedData {
     // Define structure members to hold serialized data
@@ -21,9 +106,210 @@ struct SerializedData {
     long transactionTime;
 };
 
+#define MESSAGE_SIZE 1024               // largest request read at once, like recv(1024) in Python
+#define PENDING_CAPACITY (8 * MESSAGE_SIZE)  // responses an event loop client may have waiting to be sent
+#define PENDING_RESPONSES 64            // and how many of them, however short
+#define LATENCY_BUCKETS 24              // bucket i counts requests taking [2^(i-1), 2^i) microseconds
+#define LISTEN_BACKLOG 128
+#define EPOLL_BATCH 64
+#define MESSAGE_FLUSH_BATCH 64          // messages a thread counts before adding them to the shared total
+#define SHM_MAGIC 0x53484d31            // "SHM1"
+#define SHM_RING_SIZE (64 * 1024)       // bytes of each ring, a power of two
+#define SHM_WRAP 0xffffffffu            // length of a record telling the reader to go back to the start
+#define SHM_SPIN 4000                   // polls of a ring before sleeping on it
+#define SHM_PEER_CHECK_MS 500           // how often a sleeping side checks the other is still there
+#define BENCHMARK_MESSAGE 64            // bytes per round trip of the -b client
+#define CDC_RING_BATCHES 4096           // default -R
+#define CDC_IOV 64                      // batches gathered into one send to a subscriber
+#define CDC_ZEROCOPY_MIN (16 * 1024)    // smaller sends are cheaper to copy than to pin
+#define CDC_INFLIGHT 64                 // zero-copy sends a subscriber may have the kernel still holding
+#define CDC_FROM_NOW UINT64_MAX
+#define CDC_BATCH_RECORDS 16384         // most records one PUBLISH may carry
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+typedef enum ServerMode {
+    MODE_SIMPLE,
+    MODE_THREADS,
+    MODE_THREAD_POOL,
+    MODE_SELECT,
+    MODE_POLL,
+    MODE_EPOLL,
+    MODE_COUNT
+} ServerMode;
+
+// Counters every mode updates in the same places, so their numbers can be compared directly
+typedef enum Counter {
+    COUNTER_ACCEPTED,
+    COUNTER_CLOSED,
+    COUNTER_MESSAGES,
+    COUNTER_BYTES_RECEIVED,
+    COUNTER_BYTES_SENT,
+    COUNTER_ERRORS,
+    COUNTER_COUNT
+} Counter;
+
+// One thread's share of the metrics, on cache lines of its own. Only the owning thread writes
+// it; readers sum every shard. A shard outlives its thread, since its counts are part of the
+// totals, and is handed on to the next thread that starts.
+typedef struct MetricsShard {
+    _Alignas(64) atomic_ullong counters[COUNTER_COUNT];
+    atomic_ullong latency[LATENCY_BUCKETS];
+    unsigned long long unflushedMessages;  // counted here but not yet added to gMessageTotal
+    atomic_int owned;
+    struct MetricsShard* next;
+} MetricsShard;
+
+// A response waiting in a Connection: it has been sent once bytesSent reaches end
+typedef struct PendingResponse {
+    uint64_t end;
+    int64_t startNs;  // when its request arrived
+} PendingResponse;
+
+// What a client's next bytes continue: the records of a PUBLISH that have not all arrived yet
+typedef struct RequestState {
+    struct CdcBatch* publishing;  // the batch being filled, or NULL
+    uint32_t publishReceived;     // bytes of records in it so far
+    int64_t startNs;              // when the request being answered arrived
+} RequestState;
+
+// A client served by one of the event loop modes, with the responses it has not taken yet
+typedef struct Connection {
+    int fd;
+    RequestState request;
+    int subscribing;        // sent SUBSCRIBE, handed over once its responses are all sent
+    uint64_t subscribeFrom;
+    size_t pendingStart;
+    size_t pendingLength;
+    uint64_t bytesQueued;  // response bytes ever queued and sent
+    uint64_t bytesSent;
+    PendingResponse responses[PENDING_RESPONSES];  // ring of the responses in pending, oldest first
+    int responsesHead;
+    int responsesCount;
+    char pending[PENDING_CAPACITY];
+} Connection;
+
+// One direction of a shared memory client: a ring of records, each a 32-bit length and the
+// message, padded to 4 bytes. head and tail count bytes ever written and read; they are 32 bits
+// so the reader can sleep on head, and the writer on tail, as a futex.
+typedef struct ShmRing {
+    _Alignas(64) atomic_uint head;    // stored only by the writer
+    atomic_uint readerSleeping;
+    _Alignas(64) atomic_uint tail;    // stored only by the reader
+    atomic_uint writerSleeping;
+    _Alignas(64) char data[SHM_RING_SIZE];
+} ShmRing;
+
+// The contents of the memfd shared with one client
+typedef struct ShmChannel {
+    uint32_t magic;
+    uint32_t ringSize;
+    ShmRing requests;   // written by the client
+    ShmRing responses;  // written by the server
+} ShmChannel;
+
+typedef enum ConnectionState {
+    CONNECTION_GONE,
+    CONNECTION_OPEN,
+    CONNECTION_SUBSCRIBED  // handed to the change stream sender
+} ConnectionState;
+
+typedef enum CdcFrameType {
+    CDC_FRAME_SUBSCRIBED = 1,  // first frame; sequence is the first batch the subscriber gets
+    CDC_FRAME_BATCH = 2,       // count SerializedData records follow
+    CDC_FRAME_RESYNC = 3,      // the subscriber fell behind; sequence is where it continues
+} CdcFrameType;
+
+typedef struct CdcFrameHeader {
+    uint32_t type;
+    uint32_t count;
+    uint64_t sequence;
+} CdcFrameHeader;
+
+// One ingested batch, framed once and sent as is to every subscriber. The ring holds a
+// reference, and so does each subscriber while the batch is partly sent or, with zero-copy,
+// until the kernel says it is done with the pages.
+typedef struct CdcBatch {
+    atomic_int refs;
+    uint32_t length;  // of data, the frame header included
+    char data[];
+} CdcBatch;
+
+// A zero-copy send the kernel has not completed yet, and the batches it pins
+typedef struct CdcInFlight {
+    uint32_t id;
+    int count;  // -1 once completed
+    CdcBatch* batches[CDC_IOV];
+} CdcInFlight;
+
+typedef struct CdcSubscriber {
+    int fd;
+    uint64_t cursor;            // sequence of the next batch to start sending
+    CdcBatch* current;          // batch partly sent, with a reference held
+    size_t currentOffset;
+    CdcFrameHeader control;     // SUBSCRIBED or RESYNC frame to send before any more batches
+    size_t controlSent;
+    size_t controlLength;
+    int writable;
+    int gone;
+    int zerocopy;               // SO_ZEROCOPY is on
+    uint32_t zerocopyNext;      // id the kernel gives the next zero-copy send
+    CdcInFlight inflight[CDC_INFLIGHT];
+    int inflightHead;
+    int inflightCount;
+    struct CdcSubscriber* nextNew;
+} CdcSubscriber;
+
+// The last gCdcCapacity batches; batch n is in slot n % capacity
+typedef struct CdcRing {
+    pthread_mutex_t lock;
+    CdcBatch** slots;
+    uint64_t capacity;
+    uint64_t head;                   // sequence the next batch gets
+    CdcSubscriber* newSubscribers;   // waiting for the sender to take them on
+    int wakeFd;                      // eventfd telling the sender something is new
+} CdcRing;
+
+// Accepted clients waiting for a thread of the pool
+typedef struct ClientQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    int* fds;
+    int capacity;
+    int head;
+    int count;
+} ClientQueue;
+
 char* gFilePath;
-int gNetworkPort;
+int gNetworkPort = 12345;
 // Other configuration variables
+ServerMode gMode = MODE_SIMPLE;
+int gPoolThreads = 10;
+int gMetricsInterval = 10;  // in seconds
+int gVerbose = 0;
+char* gUnixPath;                  // -u: also listen on this Unix socket
+char* gShmPath;                   // -s: hand out shared memory channels on this Unix socket
+char* gBenchmark;                 // -b: run the round trip client over this transport instead
+long gBenchmarkRounds = 100000;
+int gShmSpin = SHM_SPIN;
+uint64_t gCdcCapacity = CDC_RING_BATCHES;
+int gCdcResync = 1;               // -S: resync a lapped subscriber rather than drop it
+CdcRing gCdc;
+unsigned long long gNotifyEvery = 100;  // messages between threshold notifications
+ClientQueue gClientQueue;
+
+MetricsShard* _Atomic gShards;   // every shard ever made, newest first
+pthread_key_t gShardKey;          // its destructor hands a finished thread's shard on
+_Thread_local MetricsShard* tShard;
+atomic_ullong gMessageTotal;      // messages flushed from the shards, for threshold crossings
+int gThresholdFd = -1;            // eventfd counting the crossings not yet taken by a watcher
+
+const char* gModeNames[MODE_COUNT] = {"simple", "threads", "thread_pool", "select", "poll", "epoll"};
 
 // Function prototypes
 
@@ -38,17 +324,238 @@ void serialize_data(struct SerializedData* data);
 void parse_command_line_arguments(int argc, char* argv[]);
 void read_environment_variables();
 void prompt_user_for_file();
+size_t process_request(RequestState* state, const char* request, size_t length, char* response);
+char* request_buffer(RequestState* state, char* buffer, size_t* capacity);
+void request_state_clear(RequestState* state);
+void cdc_batch_release(CdcBatch* batch);
+ConnectionState connection_write(Connection* connection);
+int parse_subscribe(const char* request, size_t length, uint64_t* from);
+void cdc_subscribe(int client_socket, uint64_t from);
+size_t publish_start(RequestState* state, const char* command, size_t length, char* response);
+size_t publish_records(RequestState* state, const char* records, size_t length, char* response);
 
 // Function implementations
 
+int64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The calling thread's shard: the one it already has, else one a finished thread left, else a
+// new one
+MetricsShard* metrics_shard() {
+    if (tShard != NULL)
+        return tShard;
+    MetricsShard* shard;
+    for (shard = atomic_load(&gShards); shard != NULL; shard = shard->next) {
+        int free = 0;
+        if (atomic_compare_exchange_strong(&shard->owned, &free, 1))
+            break;
+    }
+    if (shard == NULL) {
+        shard = aligned_alloc(_Alignof(MetricsShard), sizeof(MetricsShard));
+        if (shard == NULL) {
+            perror("Failed to allocate metrics shard");
+            exit(1);
+        }
+        memset(shard, 0, sizeof(MetricsShard));
+        atomic_store(&shard->owned, 1);
+        shard->next = atomic_load(&gShards);
+        while (!atomic_compare_exchange_weak(&gShards, &shard->next, shard))
+            ;
+    }
+    pthread_setspecific(gShardKey, shard);
+    tShard = shard;
+    return shard;
+}
+
+// Only the owner writes a shard's counters, so adding needs no read-modify-write instruction
+void shard_add(atomic_ullong* value, unsigned long long n) {
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void count(Counter counter, unsigned long long n) {
+    shard_add(&metrics_shard()->counters[counter], n);
+}
+
+unsigned long long counter_total(Counter counter) {
+    unsigned long long total = 0;
+    for (MetricsShard* shard = atomic_load(&gShards); shard != NULL; shard = shard->next)
+        total += atomic_load_explicit(&shard->counters[counter], memory_order_relaxed);
+    return total;
+}
+
+// Add the thread's unflushed messages to the shared total. The adds cover disjoint ranges of
+// the total, so each multiple of gNotifyEvery falls in exactly one of them and is signaled once.
+void flush_message_count(MetricsShard* shard) {
+    unsigned long long n = shard->unflushedMessages;
+    if (n == 0)
+        return;
+    shard->unflushedMessages = 0;
+    unsigned long long before = atomic_fetch_add_explicit(&gMessageTotal, n, memory_order_relaxed);
+    uint64_t crossings = (before + n) / gNotifyEvery - before / gNotifyEvery;
+    if (crossings > 0 && write(gThresholdFd, &crossings, sizeof(crossings)) != sizeof(crossings))
+        perror("Failed to signal message threshold");
+}
+
+// Called before a thread blocks waiting for clients, so an idle server has counted everything
+void flush_before_sleeping() {
+    flush_message_count(metrics_shard());
+}
+
+// pthread key destructor: a finished thread's messages are flushed and its shard freed up
+void release_shard(void* arg) {
+    MetricsShard* shard = arg;
+    flush_message_count(shard);
+    atomic_store(&shard->owned, 0);
+}
+
+void record_latency(int64_t startNs) {
+    int64_t ns = monotonic_ns() - startNs;
+    uint64_t us = ns > 0 ? (uint64_t)ns / 1000 : 0;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+    shard_add(&metrics_shard()->latency[bucket], 1);
+}
+
+// Like notify_100() in ServerPython.py, but for every multiple of gNotifyEvery rather than once.
+// The eventfd is a semaphore, so each read takes one crossing.
+void* threshold_watcher(void* arg) {
+    (void)arg;
+    unsigned long long reached = 0;
+    uint64_t crossing;
+    while (read(gThresholdFd, &crossing, sizeof(crossing)) == sizeof(crossing)) {
+        reached += gNotifyEvery;
+        printf("*** %llu messages received ***\n", reached);
+    }
+    perror("Failed to wait for message threshold");
+    return NULL;
+}
+
+void count_accepted(int client_socket, struct sockaddr_storage* address) {
+    count(COUNTER_ACCEPTED, 1);
+    if (!gVerbose)
+        return;
+    if (address->ss_family == AF_INET) {
+        struct sockaddr_in* inet = (struct sockaddr_in*)address;
+        printf("Received new connection from  ('%s', %d) on fd %d\n",
+               inet_ntoa(inet->sin_addr), ntohs(inet->sin_port), client_socket);
+    } else {
+        printf("Received new connection on a Unix socket on fd %d\n", client_socket);
+    }
+}
+
+void close_client(int client_socket) {
+    close(client_socket);
+    count(COUNTER_CLOSED, 1);
+}
+
+// The one request handler every mode shares: count the message, show it if asked to, and
+// write the response to response (a PUBLISH acknowledgement, or else the message itself,
+// echoed back). Returns its length, or 0 while a PUBLISH is still missing records; state says
+// what the client is in the middle of and when the request being answered arrived.
+size_t process_request(RequestState* state, const char* request, size_t length, char* response) {
+    MetricsShard* shard = metrics_shard();
+    shard_add(&shard->counters[COUNTER_BYTES_RECEIVED], length);
+    if (state->publishing != NULL)
+        return publish_records(state, request, length, response);
+    state->startNs = monotonic_ns();
+    shard_add(&shard->counters[COUNTER_MESSAGES], 1);
+    if (++shard->unflushedMessages >= MESSAGE_FLUSH_BATCH)
+        flush_message_count(shard);
+    if (gVerbose) {
+        printf("Received: %.*s\n", (int)length, request);
+        printf("Total messages received: %llu\n", counter_total(COUNTER_MESSAGES));
+    }
+    if (length >= 7 && memcmp(request, "PUBLISH", 7) == 0)
+        return publish_start(state, request + 7, length - 7, response);
+    uint64_t from;
+    if (parse_subscribe(request, length, &from))
+        return sprintf(response, "ERROR SUBSCRIBE needs a socket connection\n");
+    if (response != request)
+        memcpy(response, request, length);
+    return length;
+}
+
+// Where to receive a client's next bytes: straight into the batch of a PUBLISH still missing
+// records, no more of them than it is missing, or else into buffer
+char* request_buffer(RequestState* state, char* buffer, size_t* capacity) {
+    if (state->publishing == NULL)
+        return buffer;
+    *capacity = state->publishing->length - sizeof(CdcFrameHeader) - state->publishReceived;
+    return state->publishing->data + sizeof(CdcFrameHeader) + state->publishReceived;
+}
+
+// The client is gone; drop the PUBLISH it did not finish
+void request_state_clear(RequestState* state) {
+    if (state->publishing != NULL)
+        cdc_batch_release(state->publishing);
+    state->publishing = NULL;
+}
+
+int send_all(int client_socket, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(client_socket, data, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        count(COUNTER_BYTES_SENT, sent);
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+// Serve one client with blocking calls until it hangs up; used by the simple, threads and
+// thread_pool modes
+void serve_client_blocking(int client_socket) {
+    char buffer[MESSAGE_SIZE];
+    RequestState state = {0};
+    while (1) {
+        size_t capacity = sizeof(buffer);
+        char* request = request_buffer(&state, buffer, &capacity);
+        ssize_t received = recv(client_socket, request, capacity, MSG_DONTWAIT);
+        if (received < 0 && errno == EAGAIN) {
+            flush_before_sleeping();
+            received = recv(client_socket, request, capacity, 0);
+        }
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0) {
+            if (received < 0)
+                count(COUNTER_ERRORS, 1);
+            break;
+        }
+        uint64_t from;
+        // Every earlier response has been sent in full, so nothing is left behind for the sender
+        if (state.publishing == NULL && parse_subscribe(request, received, &from)) {
+            flush_before_sleeping();
+            cdc_subscribe(client_socket, from);
+            return;
+        }
+        size_t length = process_request(&state, request, received, buffer);
+        if (length == 0)
+            continue;
+        if (send_all(client_socket, buffer, length) != 0) {
+            count(COUNTER_ERRORS, 1);
+            break;
+        }
+        record_latency(state.startNs);
+    }
+    request_state_clear(&state);
+    flush_before_sleeping();
+    close_client(client_socket);
+}
+
 void* handle_client(void* arg) {
     // Handle client connection and data exchange
     // This is launched in its own thread
-    int client_socket = *(int *)arg;
-    // Handle client connection here
-    // ...
-
-    close(client_socket);
+    int client_socket = (int)(intptr_t)arg;
+    serve_client_blocking(client_socket);
     return NULL;
 }
 
@@ -71,8 +578,13 @@ int initialize_server_socket() {
         exit(1);
     }
 
+    // Let a restarted server (say, between benchmark runs) bind while old connections linger
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Set up the server address
     struct sockaddr_in server_address;
+    memset(&server_address, 0, sizeof(server_address));
     server_address.sin_family = AF_INET;
     server_address.sin_addr.s_addr = INADDR_ANY;
     server_address.sin_port = htons(gNetworkPort);
@@ -84,7 +596,7 @@ int initialize_server_socket() {
     }
 
     // Listen for incoming connections
-    if (listen(server_socket, 5) == -1) {
+    if (listen(server_socket, LISTEN_BACKLOG) == -1) {
         perror("Failed to listen for connections");
         exit(1);
     }
@@ -94,6 +606,57 @@ int initialize_server_socket() {
     return(server_socket);
 }
 
+void remove_unix_sockets() {
+    if (gUnixPath != NULL)
+        unlink(gUnixPath);
+    if (gShmPath != NULL)
+        unlink(gShmPath);
+}
+
+int unix_socket_address(const char* path, struct sockaddr_un* address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+// Same as initialize_server_socket(), for same-host clients on a Unix socket at path
+int initialize_unix_socket(const char* path) {
+    struct sockaddr_un server_address;
+    if (unix_socket_address(path, &server_address) == -1) {
+        perror("Invalid Unix socket path");
+        exit(1);
+    }
+
+    int server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_socket == -1) {
+        perror("Failed to create Unix socket");
+        exit(1);
+    }
+
+    // A socket file left behind by a previous run would make bind() fail; anything else is kept
+    struct stat existing;
+    if (lstat(path, &existing) == 0 && S_ISSOCK(existing.st_mode))
+        unlink(path);
+
+    if (bind(server_socket, (struct sockaddr*)&server_address, sizeof(server_address)) == -1) {
+        perror("Failed to bind Unix socket");
+        exit(1);
+    }
+    if (listen(server_socket, LISTEN_BACKLOG) == -1) {
+        perror("Failed to listen for connections");
+        exit(1);
+    }
+
+    printf("Server socket initialized and listening on %s\n", path);
+
+    return(server_socket);
+}
+
 void send_data(int client_socket, struct SerializedData* data) {
     // Send data over the network to the client
 }
@@ -147,7 +710,7 @@ void parse_command_line_arguments(int argc, char* argv[]) {
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
-            char* gFilePath = argv[i + 1];
+            gFilePath = argv[i + 1];
             i++; // Skip the next argument since it is the file path
         }
         else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
@@ -157,7 +720,69 @@ void parse_command_line_arguments(int argc, char* argv[]) {
         else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
             force_new = 1;
         }
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            int mode;
+            for (mode = 0; mode < MODE_COUNT; mode++)
+                if (strcmp(argv[i + 1], gModeNames[mode]) == 0)
+                    break;
+            if (mode == MODE_COUNT) {
+                fprintf(stderr, "Unknown mode %s\n", argv[i + 1]);
+                exit(1);
+            }
+            gMode = (ServerMode)mode;
+            i++;
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            gPoolThreads = atoi(argv[i + 1]);
+            if (gPoolThreads < 1)
+                gPoolThreads = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            gMetricsInterval = atoi(argv[i + 1]);
+            if (gMetricsInterval < 1)
+                gMetricsInterval = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "-N") == 0 && i + 1 < argc) {
+            gNotifyEvery = strtoull(argv[i + 1], NULL, 10);
+            if (gNotifyEvery < 1)
+                gNotifyEvery = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            gUnixPath = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            gShmPath = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            gBenchmark = argv[i + 1];
+            i++;
+        }
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            gBenchmarkRounds = atol(argv[i + 1]);
+            if (gBenchmarkRounds < 1)
+                gBenchmarkRounds = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+            gCdcCapacity = strtoull(argv[i + 1], NULL, 10);
+            if (gCdcCapacity < 1)
+                gCdcCapacity = 1;
+            i++;
+        }
+        else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            gCdcResync = strcmp(argv[i + 1], "drop") != 0;
+            i++;
+        }
+        else if (strcmp(argv[i], "-v") == 0) {
+            gVerbose = 1;
+        }
     }
+    (void)force_new;
 }
 
 void read_environment_variables() {
@@ -170,15 +795,15 @@ void read_environment_variables() {
 
 int spinoff_new_thread(int client_socket) {
     pthread_t thread;
-    if (pthread_create(&thread, NULL, handle_client, (void *)&client_socket) != 0) {
+    // The descriptor itself is passed, not its address, since the caller reuses its variable
+    if (pthread_create(&thread, NULL, handle_client, (void *)(intptr_t)client_socket) != 0) {
         perror("Failed to create thread");
-        close(client_socket);
+        close_client(client_socket);
         return -1;
     }
 
     if (pthread_detach(thread) != 0) {
         perror("Failed to detach thread");
-        close(client_socket);
         return -1;
     }
 
@@ -186,37 +811,1256 @@ int spinoff_new_thread(int client_socket) {
     return 0;
 }
 
-void handle_new_connections(int server_socket) {
-    struct sockaddr_in client_address;
+int accept_client(int server_socket) {
+    struct sockaddr_storage client_address;
     socklen_t client_len = sizeof(client_address);
+    int client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_len);
+    if (client_socket == -1) {
+        if (errno != EAGAIN && errno != EINTR)
+            perror("Failed to accept client connection");
+        return -1;
+    }
+    count_accepted(client_socket, &client_address);
+    return client_socket;
+}
 
+// Simple single-client non-threaded mode
+void handle_new_connections_simple(int server_socket) {
     while (1) {
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_address, &client_len);
-        if (client_socket == -1) {
-            perror("Failed to accept client connection");
+        int client_socket = accept_client(server_socket);
+        if (client_socket != -1)
+            serve_client_blocking(client_socket);
+    }
+}
+
+// Threaded mode
+void handle_new_connections_threads(int server_socket) {
+    while (1) {
+        int client_socket = accept_client(server_socket);
+        if (client_socket != -1)
+            spinoff_new_thread(client_socket);
+    }
+}
+
+// Thread-pool mode: like ThreadPoolExecutor, accepted clients queue up (without limit) for
+// whichever of the gPoolThreads threads is free next
+void client_queue_push(ClientQueue* queue, int client_socket) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity) {
+        int capacity = queue->capacity ? 2 * queue->capacity : 64;
+        int* fds = malloc(capacity * sizeof(int));
+        if (fds == NULL) {
+            perror("Failed to grow the client queue");
+            exit(1);
+        }
+        for (int i = 0; i < queue->count; i++)
+            fds[i] = queue->fds[(queue->head + i) % queue->capacity];
+        free(queue->fds);
+        queue->fds = fds;
+        queue->capacity = capacity;
+        queue->head = 0;
+    }
+    queue->fds[(queue->head + queue->count) % queue->capacity] = client_socket;
+    queue->count++;
+    pthread_cond_signal(&queue->notEmpty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+int client_queue_pop(ClientQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0)
+        pthread_cond_wait(&queue->notEmpty, &queue->lock);
+    int client_socket = queue->fds[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_mutex_unlock(&queue->lock);
+    return client_socket;
+}
+
+void* pool_worker(void* arg) {
+    ClientQueue* queue = arg;
+    while (1)
+        serve_client_blocking(client_queue_pop(queue));
+    return NULL;
+}
+
+void start_thread_pool() {
+    pthread_mutex_init(&gClientQueue.lock, NULL);
+    pthread_cond_init(&gClientQueue.notEmpty, NULL);
+    for (int i = 0; i < gPoolThreads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_worker, &gClientQueue) != 0) {
+            perror("Failed to create pool thread");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
+
+// The TCP and Unix socket listeners share one pool
+void handle_new_connections_thread_pool(int server_socket) {
+    static pthread_once_t poolStarted = PTHREAD_ONCE_INIT;
+    pthread_once(&poolStarted, start_thread_pool);
+    while (1) {
+        int client_socket = accept_client(server_socket);
+        if (client_socket != -1)
+            client_queue_push(&gClientQueue, client_socket);
+    }
+}
+
+// The event loop modes keep each client non-blocking and share the Connection helpers below
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags == -1 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+Connection* connection_open(int client_socket) {
+    Connection* connection = malloc(sizeof(Connection));
+    if (connection == NULL || set_nonblocking(client_socket) != 0) {
+        perror("Failed to set up connection");
+        free(connection);
+        close_client(client_socket);
+        return NULL;
+    }
+    connection->fd = client_socket;
+    connection->request = (RequestState){0};
+    connection->subscribing = 0;
+    connection->pendingStart = 0;
+    connection->pendingLength = 0;
+    connection->bytesQueued = 0;
+    connection->bytesSent = 0;
+    connection->responsesHead = 0;
+    connection->responsesCount = 0;
+    return connection;
+}
+
+// Done with a client that is gone or now belongs to the change stream sender
+void connection_finish(Connection* connection, ConnectionState state) {
+    request_state_clear(&connection->request);
+    if (state == CONNECTION_GONE)
+        close_client(connection->fd);
+    free(connection);
+}
+
+// Room for another response; until there is, the loop stops reading the client (backpressure)
+int connection_can_read(const Connection* connection) {
+    return !connection->subscribing && PENDING_CAPACITY - connection->pendingLength >= MESSAGE_SIZE && connection->responsesCount < PENDING_RESPONSES;
+}
+
+// Responses are sent as soon as they are queued, so this is only true while the socket is full
+int connection_wants_write(const Connection* connection) {
+    return connection->pendingLength > 0;
+}
+
+// Hand a client that asked to subscribe to the change stream sender, once nothing it is owed is
+// left in pending: the sender only writes frames, so anything still queued would be lost
+ConnectionState connection_subscribe(Connection* connection) {
+    if (connection->pendingLength > 0)
+        return CONNECTION_OPEN;
+    cdc_subscribe(connection->fd, connection->subscribeFrom);
+    return CONNECTION_SUBSCRIBED;
+}
+
+// Read one request, or more of a PUBLISH, and send its response, queuing whatever the socket
+// does not take yet
+ConnectionState connection_read(Connection* connection) {
+    // A subscribing client has nothing more to say; a hangup shows up when its responses are sent
+    if (connection->subscribing)
+        return CONNECTION_OPEN;
+    char buffer[MESSAGE_SIZE];
+    size_t capacity = sizeof(buffer);
+    char* request = request_buffer(&connection->request, buffer, &capacity);
+    ssize_t received = recv(connection->fd, request, capacity, 0);
+    if (received < 0)
+        return errno == EAGAIN || errno == EINTR ? CONNECTION_OPEN : CONNECTION_GONE;
+    if (received == 0)
+        return CONNECTION_GONE;
+    uint64_t from;
+    if (connection->request.publishing == NULL && parse_subscribe(request, received, &from)) {
+        connection->subscribing = 1;
+        connection->subscribeFrom = from;
+        return connection_subscribe(connection);
+    }
+
+    if (connection->pendingLength == 0) {
+        connection->pendingStart = 0;
+    } else if (connection->pendingStart + connection->pendingLength + MESSAGE_SIZE > PENDING_CAPACITY) {
+        memmove(connection->pending, connection->pending + connection->pendingStart, connection->pendingLength);
+        connection->pendingStart = 0;
+    }
+    char* response = connection->pending + connection->pendingStart + connection->pendingLength;
+    size_t length = process_request(&connection->request, request, received, response);
+    if (length == 0)
+        return CONNECTION_OPEN;
+    connection->pendingLength += length;
+    connection->bytesQueued += length;
+    PendingResponse* pending = &connection->responses[(connection->responsesHead + connection->responsesCount++) % PENDING_RESPONSES];
+    pending->end = connection->bytesQueued;
+    pending->startNs = connection->request.startNs;
+    return connection_write(connection);
+}
+
+// Send as much of the queued responses as the socket takes
+ConnectionState connection_write(Connection* connection) {
+    if (connection->pendingLength == 0)
+        return CONNECTION_OPEN;
+    ssize_t sent = send(connection->fd, connection->pending + connection->pendingStart,
+                        connection->pendingLength, MSG_NOSIGNAL);
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return CONNECTION_OPEN;
+        count(COUNTER_ERRORS, 1);
+        return CONNECTION_GONE;
+    }
+    count(COUNTER_BYTES_SENT, sent);
+    connection->pendingStart += sent;
+    connection->pendingLength -= sent;
+    connection->bytesSent += sent;
+
+    // One sample per response, like the blocking modes take, however many one send finished
+    while (connection->responsesCount > 0 &&
+           connection->responses[connection->responsesHead].end <= connection->bytesSent) {
+        record_latency(connection->responses[connection->responsesHead].startNs);
+        connection->responsesHead = (connection->responsesHead + 1) % PENDING_RESPONSES;
+        connection->responsesCount--;
+    }
+    return connection->subscribing ? connection_subscribe(connection) : CONNECTION_OPEN;
+}
+
+// Select mode
+void handle_new_connections_select(int server_socket) {
+    Connection* connections[FD_SETSIZE] = {0};
+    set_nonblocking(server_socket);
+
+    while (1) {
+        fd_set readable, writable;
+        FD_ZERO(&readable);
+        FD_ZERO(&writable);
+        FD_SET(server_socket, &readable);
+        int maxFd = server_socket;
+        for (int fd = 0; fd < FD_SETSIZE; fd++) {
+            if (connections[fd] == NULL)
+                continue;
+            if (connection_can_read(connections[fd]))
+                FD_SET(fd, &readable);
+            if (connection_wants_write(connections[fd]))
+                FD_SET(fd, &writable);
+            maxFd = fd > maxFd ? fd : maxFd;
+        }
+
+        // select() blocks until at least one socket is ready for I/O
+        flush_before_sleeping();
+        if (select(maxFd + 1, &readable, &writable, NULL, NULL) < 0) {
+            if (errno != EINTR)
+                perror("select");
+            continue;
+        }
+
+        if (FD_ISSET(server_socket, &readable)) {
+            int client_socket;
+            while ((client_socket = accept_client(server_socket)) != -1) {
+                if (client_socket >= FD_SETSIZE) {
+                    fprintf(stderr, "Too many clients for select(), closing fd %d\n", client_socket);
+                    close_client(client_socket);
+                    continue;
+                }
+                connections[client_socket] = connection_open(client_socket);
+            }
+        }
+        for (int fd = 0; fd <= maxFd; fd++) {
+            Connection* connection = connections[fd];
+            if (connection == NULL || fd == server_socket)
+                continue;
+            ConnectionState state = CONNECTION_OPEN;
+            if (FD_ISSET(fd, &readable))
+                state = connection_read(connection);
+            if (state == CONNECTION_OPEN && FD_ISSET(fd, &writable))
+                state = connection_write(connection);
+            if (state != CONNECTION_OPEN) {
+                connection_finish(connection, state);
+                connections[fd] = NULL;
+            }
+        }
+    }
+}
+
+// Poll mode
+void handle_new_connections_poll(int server_socket) {
+    int capacity = 64, nfds = 1;
+    struct pollfd* pollfds = malloc(capacity * sizeof(struct pollfd));
+    Connection** connections = malloc(capacity * sizeof(Connection*));
+    if (pollfds == NULL || connections == NULL) {
+        perror("Failed to allocate poll set");
+        exit(1);
+    }
+    set_nonblocking(server_socket);
+    pollfds[0].fd = server_socket;
+    pollfds[0].events = POLLIN;
+    connections[0] = NULL;
+
+    while (1) {
+        for (int i = 1; i < nfds; i++)
+            pollfds[i].events = (connection_can_read(connections[i]) ? POLLIN : 0) |
+                                (connection_wants_write(connections[i]) ? POLLOUT : 0);
+        flush_before_sleeping();
+        if (poll(pollfds, nfds, -1) < 0) {
+            if (errno != EINTR)
+                perror("poll");
             continue;
         }
 
-        handle_client(&client_socket);
-        // if (spinoff_new_thread(client_socket) == 0)
-        //     sleep(1);
+        // Serve clients first; a closed one is replaced by the last entry, which was already seen
+        for (int i = nfds - 1; i >= 1; i--) {
+            short revents = pollfds[i].revents;
+            ConnectionState state = revents & (POLLERR | POLLNVAL) ? CONNECTION_GONE : CONNECTION_OPEN;
+            if (state == CONNECTION_OPEN && (revents & (POLLIN | POLLHUP)))
+                state = connection_read(connections[i]);
+            if (state == CONNECTION_OPEN && (revents & POLLOUT))
+                state = connection_write(connections[i]);
+            if (state != CONNECTION_OPEN) {
+                connection_finish(connections[i], state);
+                nfds--;
+                pollfds[i] = pollfds[nfds];
+                connections[i] = connections[nfds];
+            }
+        }
+
+        if (pollfds[0].revents & POLLIN) {
+            int client_socket;
+            while ((client_socket = accept_client(server_socket)) != -1) {
+                Connection* connection = connection_open(client_socket);
+                if (connection == NULL)
+                    continue;
+                if (nfds == capacity) {
+                    capacity *= 2;
+                    pollfds = realloc(pollfds, capacity * sizeof(struct pollfd));
+                    connections = realloc(connections, capacity * sizeof(Connection*));
+                    if (pollfds == NULL || connections == NULL) {
+                        perror("Failed to grow poll set");
+                        exit(1);
+                    }
+                }
+                pollfds[nfds].fd = client_socket;
+                pollfds[nfds].revents = 0;
+                connections[nfds++] = connection;
+            }
+        }
     }
 }
 
+// Epoll mode: the kernel keeps the interest list, so a wakeup costs nothing per idle client.
+// A client's interest only changes when its socket backs up: EPOLLOUT is only wanted while
+// responses wait for room in it, and EPOLLIN is dropped while pending has no room for another.
+typedef struct EpollClient {
+    Connection* connection;
+    uint32_t interest;
+} EpollClient;
+
+void epoll_update(int epoll_fd, EpollClient* client) {
+    uint32_t wanted = (connection_can_read(client->connection) ? EPOLLIN : 0) |
+                      (connection_wants_write(client->connection) ? EPOLLOUT : 0);
+    if (wanted == client->interest)
+        return;
+    struct epoll_event event = {.events = wanted, .data.ptr = client};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->connection->fd, &event);
+    client->interest = wanted;
+}
+
+void handle_new_connections_epoll(int server_socket) {
+    int epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    set_nonblocking(server_socket);
+    struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &listen_event);
+
+    struct epoll_event events[EPOLL_BATCH];
+    while (1) {
+        flush_before_sleeping();
+        int ready = epoll_wait(epoll_fd, events, EPOLL_BATCH, -1);
+        if (ready < 0) {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            continue;
+        }
+        for (int i = 0; i < ready; i++) {
+            EpollClient* client = events[i].data.ptr;
+            if (client == NULL) {
+                int client_socket;
+                while ((client_socket = accept_client(server_socket)) != -1) {
+                    client = malloc(sizeof(EpollClient));
+                    if (client == NULL || (client->connection = connection_open(client_socket)) == NULL) {
+                        free(client);
+                        continue;
+                    }
+                    client->interest = EPOLLIN;
+                    struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &event);
+                }
+                continue;
+            }
+
+            uint32_t flags = events[i].events;
+            ConnectionState state = flags & EPOLLERR ? CONNECTION_GONE : CONNECTION_OPEN;
+            if (state == CONNECTION_OPEN && (flags & (EPOLLIN | EPOLLHUP)))
+                state = connection_read(client->connection);
+            if (state == CONNECTION_OPEN && (flags & EPOLLOUT))
+                state = connection_write(client->connection);
+            if (state != CONNECTION_OPEN) {
+                // Closing the descriptor removes it from the epoll set; a subscriber's stays open
+                if (state == CONNECTION_SUBSCRIBED)
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client->connection->fd, NULL);
+                connection_finish(client->connection, state);
+                free(client);
+                continue;
+            }
+            epoll_update(epoll_fd, client);
+        }
+    }
+}
+
+// Shared memory transport
+
+int futex_wait(atomic_uint* word, uint32_t value, int timeoutMs) {
+    struct timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    return syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+}
+
+void futex_wake(atomic_uint* word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// The other side of a shared memory channel still has its socket open
+int peer_alive(int peer_socket) {
+    char byte;
+    ssize_t received = recv(peer_socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return received > 0 || (received < 0 && (errno == EAGAIN || errno == EINTR));
+}
+
+// Wait for *position to move on from seen: poll it for a while, then sleep on it as a futex with
+// sleeping raised, so the other side knows a wake is needed. Both the flag and the position are
+// stored before the other is loaded, on either side, so a wake cannot be missed. Returns -1 if
+// the peer hangs up meanwhile.
+int shm_wait(atomic_uint* position, uint32_t seen, atomic_uint* sleeping, int peer_socket) {
+    for (int i = 0; i < gShmSpin; i++) {
+        if (atomic_load_explicit(position, memory_order_acquire) != seen)
+            return 0;
+        cpu_relax();
+    }
+    atomic_store(sleeping, 1);
+    while (atomic_load(position) == seen) {
+        if (futex_wait(position, seen, SHM_PEER_CHECK_MS) == -1 && errno == ETIMEDOUT &&
+            !peer_alive(peer_socket)) {
+            atomic_store(sleeping, 0);
+            return -1;
+        }
+    }
+    atomic_store(sleeping, 0);
+    return 0;
+}
+
+uint32_t shm_record_size(uint32_t length) {
+    return 4 + ((length + 3) & ~3u);
+}
+
+// Append one message, waiting while the reader is too far behind for it to fit. A record never
+// wraps around the end of the ring; the writer leaves a SHM_WRAP marker and starts over instead.
+int shm_ring_write(ShmRing* ring, const char* message, uint32_t length, int peer_socket) {
+    uint32_t record = shm_record_size(length);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t offset = head % SHM_RING_SIZE;
+    uint32_t skip = SHM_RING_SIZE - offset < record ? SHM_RING_SIZE - offset : 0;
+    while (1) {
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head + skip + record - tail <= SHM_RING_SIZE)
+            break;
+        if (shm_wait(&ring->tail, tail, &ring->writerSleeping, peer_socket) == -1)
+            return -1;
+    }
+    if (skip > 0) {
+        uint32_t wrap = SHM_WRAP;
+        memcpy(ring->data + offset, &wrap, 4);
+        head += skip;
+        offset = 0;
+    }
+    memcpy(ring->data + offset, &length, 4);
+    memcpy(ring->data + offset + 4, message, length);
+    atomic_store(&ring->head, head + record);
+    if (atomic_load(&ring->readerSleeping))
+        futex_wake(&ring->head);
+    return 0;
+}
+
+// Take the next message into buffer, waiting for one if the ring is empty. Returns its length.
+ssize_t shm_ring_read(ShmRing* ring, char* buffer, size_t capacity, int peer_socket) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head;
+    while ((head = atomic_load_explicit(&ring->head, memory_order_acquire)) == tail)
+        if (shm_wait(&ring->head, head, &ring->readerSleeping, peer_socket) == -1)
+            return -1;
+    uint32_t length;
+    memcpy(&length, ring->data + tail % SHM_RING_SIZE, 4);
+    if (length == SHM_WRAP) {
+        tail += SHM_RING_SIZE - tail % SHM_RING_SIZE;
+        memcpy(&length, ring->data, 4);
+    }
+    if (length > capacity) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(buffer, ring->data + tail % SHM_RING_SIZE + 4, length);
+    atomic_store(&ring->tail, tail + shm_record_size(length));
+    if (atomic_load(&ring->writerSleeping))
+        futex_wake(&ring->tail);
+    return length;
+}
+
+int shm_ring_empty(ShmRing* ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire) ==
+           atomic_load_explicit(&ring->tail, memory_order_relaxed);
+}
+
+// Pass a descriptor over a Unix socket
+int send_fd(int unix_socket, int fd) {
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer)};
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    return sendmsg(unix_socket, &message, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+int receive_fd(int unix_socket) {
+    char byte;
+    struct iovec iov = {&byte, 1};
+    union {
+        char buffer[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr message = {.msg_iov = &iov, .msg_iovlen = 1,
+                             .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer)};
+    if (recvmsg(unix_socket, &message, MSG_CMSG_CLOEXEC) != 1)
+        return -1;
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        errno = EPROTO;
+        return -1;
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+}
+
+ShmChannel* map_channel(int fd) {
+    ShmChannel* channel = mmap(NULL, sizeof(ShmChannel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    return channel == MAP_FAILED ? NULL : channel;
+}
+
+// Make a channel for a client that connected to the shm socket, hand it over, and serve it
+// until the client hangs up
+void* serve_shm_client(void* arg) {
+    int client_socket = (int)(intptr_t)arg;
+    ShmChannel* channel = NULL;
+    int fd = memfd_create("ServerC shm channel", MFD_CLOEXEC);
+    if (fd == -1 || ftruncate(fd, sizeof(ShmChannel)) == -1 || (channel = map_channel(fd)) == NULL) {
+        perror("Failed to create shared memory channel");
+        count(COUNTER_ERRORS, 1);
+    } else {
+        // The memfd starts zeroed, which is two empty rings
+        channel->magic = SHM_MAGIC;
+        channel->ringSize = SHM_RING_SIZE;
+        if (send_fd(client_socket, fd) == -1) {
+            perror("Failed to send shared memory channel");
+            count(COUNTER_ERRORS, 1);
+        }
+    }
+    if (fd != -1)
+        close(fd);
+
+    // The records of a PUBLISH come in messages of their own, copied out of the ring into the batch
+    char buffer[MESSAGE_SIZE];
+    RequestState state = {0};
+    while (channel != NULL) {
+        if (shm_ring_empty(&channel->requests))
+            flush_before_sleeping();
+        ssize_t received = shm_ring_read(&channel->requests, buffer, sizeof(buffer), client_socket);
+        if (received < 0)
+            break;
+        size_t length = process_request(&state, buffer, received, buffer);
+        if (length == 0)
+            continue;
+        if (shm_ring_write(&channel->responses, buffer, length, client_socket) == -1)
+            break;
+        count(COUNTER_BYTES_SENT, length);
+        record_latency(state.startNs);
+    }
+    request_state_clear(&state);
+    if (channel != NULL)
+        munmap(channel, sizeof(ShmChannel));
+    flush_before_sleeping();
+    close_client(client_socket);
+    return NULL;
+}
+
+void* handle_shm_connections(void* arg) {
+    int server_socket = (int)(intptr_t)arg;
+    while (1) {
+        int client_socket = accept_client(server_socket);
+        pthread_t thread;
+        if (client_socket == -1)
+            continue;
+        if (pthread_create(&thread, NULL, serve_shm_client, (void*)(intptr_t)client_socket) != 0) {
+            perror("Failed to create thread");
+            close_client(client_socket);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+// Change stream
+
+void cdc_batch_release(CdcBatch* batch) {
+    if (atomic_fetch_sub(&batch->refs, 1) == 1)
+        free(batch);
+}
+
+void cdc_wake() {
+    uint64_t one = 1;
+    if (write(gCdc.wakeFd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+        perror("Failed to wake change stream sender");
+}
+
+// Append a batch whose records have all arrived to the ring
+size_t publish_batch(CdcBatch* batch, char* response) {
+    uint32_t records = (batch->length - sizeof(CdcFrameHeader)) / sizeof(struct SerializedData);
+    CdcFrameHeader header = {CDC_FRAME_BATCH, records, 0};
+    pthread_mutex_lock(&gCdc.lock);
+    header.sequence = gCdc.head;
+    memcpy(batch->data, &header, sizeof(header));
+    CdcBatch** slot = &gCdc.slots[gCdc.head % gCdc.capacity];
+    CdcBatch* overwritten = *slot;
+    *slot = batch;
+    gCdc.head++;
+    pthread_mutex_unlock(&gCdc.lock);
+
+    if (overwritten != NULL)
+        cdc_batch_release(overwritten);
+    cdc_wake();
+    return sprintf(response, "OK %llu\n", (unsigned long long)header.sequence);
+}
+
+// PUBLISH <count>\n: start a batch of count records, taking those that came with the command
+size_t publish_start(RequestState* state, const char* command, size_t length, char* response) {
+    const char* newline = memchr(command, '\n', length);
+    char text[32];
+    char* end = text;
+    unsigned long long records = 0;
+    if (newline != NULL && command[0] == ' ' && (size_t)(newline - command) < sizeof(text)) {
+        memcpy(text, command + 1, newline - command - 1);
+        text[newline - command - 1] = '\0';
+        records = strtoull(text, &end, 10);
+    }
+    if (end == text || *end != '\0' || records == 0 || records > CDC_BATCH_RECORDS) {
+        count(COUNTER_ERRORS, 1);
+        return sprintf(response, "ERROR PUBLISH needs a count of 1 to %d records\n", CDC_BATCH_RECORDS);
+    }
+    size_t bytes = records * sizeof(struct SerializedData);
+    CdcBatch* batch = malloc(sizeof(CdcBatch) + sizeof(CdcFrameHeader) + bytes);
+    if (batch == NULL) {
+        count(COUNTER_ERRORS, 1);
+        return sprintf(response, "ERROR out of memory\n");
+    }
+    atomic_init(&batch->refs, 1);
+    batch->length = sizeof(CdcFrameHeader) + bytes;
+    state->publishing = batch;
+    state->publishReceived = 0;
+    newline++;
+    return publish_records(state, newline, command + length - newline, response);
+}
+
+// More of the records of the PUBLISH in progress; the batch goes to the ring with the last
+size_t publish_records(RequestState* state, const char* records, size_t length, char* response) {
+    CdcBatch* batch = state->publishing;
+    char* into = batch->data + sizeof(CdcFrameHeader) + state->publishReceived;
+    size_t missing = batch->length - sizeof(CdcFrameHeader) - state->publishReceived;
+    if (length > missing) {
+        uint32_t announced = (batch->length - sizeof(CdcFrameHeader)) / sizeof(struct SerializedData);
+        request_state_clear(state);
+        count(COUNTER_ERRORS, 1);
+        return sprintf(response, "ERROR PUBLISH got more than its %u records\n", announced);
+    }
+    if (records != into)
+        memcpy(into, records, length);
+    state->publishReceived += length;
+    if (length < missing)
+        return 0;
+    state->publishing = NULL;
+    return publish_batch(batch, response);
+}
+
+// SUBSCRIBE [sequence]: where the stream should start, or CDC_FROM_NOW
+int parse_subscribe(const char* request, size_t length, uint64_t* from) {
+    if (length < 9 || memcmp(request, "SUBSCRIBE", 9) != 0)
+        return 0;
+    char text[32];
+    size_t n = length - 9 < sizeof(text) - 1 ? length - 9 : sizeof(text) - 1;
+    memcpy(text, request + 9, n);
+    text[n] = '\0';
+    char* end;
+    unsigned long long sequence = strtoull(text, &end, 10);
+    *from = end == text ? CDC_FROM_NOW : sequence;
+    return 1;
+}
+
+// Hand a client connection over to the change stream sender
+void cdc_subscribe(int client_socket, uint64_t from) {
+    CdcSubscriber* subscriber = calloc(1, sizeof(CdcSubscriber));
+    if (subscriber == NULL || set_nonblocking(client_socket) != 0) {
+        perror("Failed to add subscriber");
+        free(subscriber);
+        close_client(client_socket);
+        return;
+    }
+    int on = 1;
+    subscriber->fd = client_socket;
+    subscriber->zerocopy = setsockopt(client_socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+    subscriber->writable = 1;
+
+    pthread_mutex_lock(&gCdc.lock);
+    subscriber->cursor = from == CDC_FROM_NOW || from > gCdc.head ? gCdc.head : from;
+    subscriber->control = (CdcFrameHeader){CDC_FRAME_SUBSCRIBED, 0, subscriber->cursor};
+    subscriber->controlLength = sizeof(CdcFrameHeader);
+    subscriber->nextNew = gCdc.newSubscribers;
+    gCdc.newSubscribers = subscriber;
+    pthread_mutex_unlock(&gCdc.lock);
+
+    if (gVerbose)
+        printf("Subscriber on fd %d starts at batch %llu\n", client_socket,
+               (unsigned long long)subscriber->cursor);
+    cdc_wake();
+}
+
+// The kernel is done with the pages of zero-copy sends lo to hi
+void cdc_complete(CdcSubscriber* subscriber, uint32_t lo, uint32_t hi) {
+    for (int i = 0; i < subscriber->inflightCount; i++) {
+        CdcInFlight* send = &subscriber->inflight[(subscriber->inflightHead + i) % CDC_INFLIGHT];
+        if (send->count < 0 || (uint32_t)(send->id - lo) > hi - lo)
+            continue;
+        for (int j = 0; j < send->count; j++)
+            cdc_batch_release(send->batches[j]);
+        send->count = -1;
+    }
+    while (subscriber->inflightCount > 0 && subscriber->inflight[subscriber->inflightHead].count < 0) {
+        subscriber->inflightHead = (subscriber->inflightHead + 1) % CDC_INFLIGHT;
+        subscriber->inflightCount--;
+    }
+}
+
+void cdc_read_completions(CdcSubscriber* subscriber) {
+    while (1) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in6))];
+        struct msghdr message = {.msg_control = control, .msg_controllen = sizeof(control)};
+        if (recvmsg(subscriber->fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            return;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            struct sock_extended_err* error = (struct sock_extended_err*)CMSG_DATA(cmsg);
+            if (((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                 (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) &&
+                error->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+                cdc_complete(subscriber, error->ee_info, error->ee_data);
+        }
+    }
+}
+
+// The ring lapped the subscriber: drop it, or skip it ahead to the newest batch and tell it so
+void cdc_fell_behind(CdcSubscriber* subscriber, uint64_t head) {
+    if (!gCdcResync) {
+        fprintf(stderr, "Dropping subscriber on fd %d, %llu batches behind\n", subscriber->fd,
+                (unsigned long long)(head - subscriber->cursor));
+        subscriber->gone = 1;
+        return;
+    }
+    if (gVerbose)
+        printf("Resyncing subscriber on fd %d from batch %llu to %llu\n", subscriber->fd,
+               (unsigned long long)subscriber->cursor, (unsigned long long)head);
+    subscriber->control = (CdcFrameHeader){CDC_FRAME_RESYNC, 0, head};
+    subscriber->controlSent = 0;
+    subscriber->controlLength = sizeof(CdcFrameHeader);
+    subscriber->cursor = head;
+}
+
+// Take references to the batches from the subscriber's cursor on, up to the iov's room.
+// Returns -1 if the oldest of them has already been overwritten.
+int cdc_take_batches(CdcSubscriber* subscriber, struct iovec* iov, CdcBatch** batches, int* n) {
+    pthread_mutex_lock(&gCdc.lock);
+    uint64_t head = gCdc.head;
+    uint64_t oldest = head > gCdc.capacity ? head - gCdc.capacity : 0;
+    if (subscriber->cursor < oldest) {
+        pthread_mutex_unlock(&gCdc.lock);
+        cdc_fell_behind(subscriber, head);
+        return -1;
+    }
+    for (uint64_t sequence = subscriber->cursor; sequence < head && *n < CDC_IOV; sequence++) {
+        CdcBatch* batch = gCdc.slots[sequence % gCdc.capacity];
+        atomic_fetch_add(&batch->refs, 1);
+        iov[*n] = (struct iovec){batch->data, batch->length};
+        batches[(*n)++] = batch;
+    }
+    pthread_mutex_unlock(&gCdc.lock);
+    return 0;
+}
+
+// Send the subscriber what it is missing until it is caught up or its socket is full
+void cdc_send(CdcSubscriber* subscriber) {
+    while (subscriber->writable && !subscriber->gone) {
+        struct iovec iov[CDC_IOV];
+        CdcBatch* batches[CDC_IOV];
+        int n = 0;
+        int hadCurrent = subscriber->current != NULL;
+        if (hadCurrent) {
+            // Finish the batch that is partly out before anything else, or the stream breaks
+            iov[n] = (struct iovec){subscriber->current->data + subscriber->currentOffset,
+                                    subscriber->current->length - subscriber->currentOffset};
+            batches[n++] = subscriber->current;
+        } else if (subscriber->controlLength > 0) {
+            ssize_t sent = send(subscriber->fd, (char*)&subscriber->control + subscriber->controlSent,
+                                subscriber->controlLength - subscriber->controlSent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0) {
+                if (errno == EAGAIN)
+                    subscriber->writable = 0;
+                else if (errno != EINTR)
+                    subscriber->gone = 1;
+                continue;
+            }
+            count(COUNTER_BYTES_SENT, sent);
+            subscriber->controlSent += sent;
+            if (subscriber->controlSent == subscriber->controlLength)
+                subscriber->controlLength = subscriber->controlSent = 0;
+            continue;
+        }
+        if (!hadCurrent && cdc_take_batches(subscriber, iov, batches, &n) == -1)
+            continue;
+        if (n == 0)
+            return;
+
+        size_t total = 0;
+        for (int i = 0; i < n; i++)
+            total += iov[i].iov_len;
+        int zerocopy = subscriber->zerocopy && total >= CDC_ZEROCOPY_MIN && subscriber->inflightCount < CDC_INFLIGHT;
+        struct msghdr message = {.msg_iov = iov, .msg_iovlen = n};
+        ssize_t sent = sendmsg(subscriber->fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT | (zerocopy ? MSG_ZEROCOPY : 0));
+        if (sent < 0 && errno == ENOBUFS && zerocopy) {
+            // Out of memory to pin pages with; copying still works
+            zerocopy = 0;
+            sent = sendmsg(subscriber->fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        if (sent < 0) {
+            if (errno == EAGAIN)
+                subscriber->writable = 0;
+            else if (errno != EINTR)
+                subscriber->gone = 1;
+            for (int i = hadCurrent; i < n; i++)
+                cdc_batch_release(batches[i]);
+            continue;
+        }
+        count(COUNTER_BYTES_SENT, sent);
+
+        // Batches sent whole are done with, unless the kernel still holds their pages; the one
+        // cut short becomes current; the rest were never started
+        CdcInFlight* inflight = NULL;
+        if (zerocopy) {
+            inflight = &subscriber->inflight[(subscriber->inflightHead + subscriber->inflightCount++) % CDC_INFLIGHT];
+            inflight->id = subscriber->zerocopyNext++;
+            inflight->count = 0;
+        }
+        size_t remaining = sent;
+        for (int i = 0; i < n; i++) {
+            CdcBatch* batch = batches[i];
+            int isCurrent = hadCurrent && i == 0;
+            if (remaining == 0) {
+                cdc_batch_release(batch);
+                continue;
+            }
+            if (!isCurrent)
+                subscriber->cursor++;
+            if (remaining >= iov[i].iov_len) {
+                remaining -= iov[i].iov_len;
+                if (isCurrent)
+                    subscriber->current = NULL;
+                if (inflight != NULL)
+                    inflight->batches[inflight->count++] = batch;
+                else
+                    cdc_batch_release(batch);
+            } else {
+                subscriber->currentOffset = (isCurrent ? subscriber->currentOffset : 0) + remaining;
+                subscriber->current = batch;
+                remaining = 0;
+                if (inflight != NULL) {
+                    atomic_fetch_add(&batch->refs, 1);
+                    inflight->batches[inflight->count++] = batch;
+                }
+            }
+        }
+    }
+}
+
+void cdc_subscriber_close(CdcSubscriber* subscriber) {
+    if (subscriber->inflightCount > 0) {
+        // Reset the connection so the kernel drops, rather than sends, the pages it still holds,
+        // and only give them back once it has
+        struct linger reset = {1, 0};
+        setsockopt(subscriber->fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    }
+    close_client(subscriber->fd);
+    cdc_complete(subscriber, 0, UINT32_MAX);
+    if (subscriber->current != NULL)
+        cdc_batch_release(subscriber->current);
+    free(subscriber);
+}
+
+// The change stream sender: one thread sending every subscriber its batches
+void* cdc_sender(void* arg) {
+    (void)arg;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event wake = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, gCdc.wakeFd, &wake) == -1) {
+        perror("Failed to set up change stream sender");
+        exit(1);
+    }
+    CdcSubscriber** subscribers = NULL;
+    int subscriberCount = 0, capacity = 0;
+    struct epoll_event events[EPOLL_BATCH];
+    while (1) {
+        int ready = epoll_wait(epoll_fd, events, EPOLL_BATCH, -1);
+        if (ready < 0 && errno != EINTR)
+            perror("epoll_wait");
+        for (int i = 0; i < ready; i++) {
+            CdcSubscriber* subscriber = events[i].data.ptr;
+            if (subscriber == NULL) {
+                uint64_t wakes;
+                if (read(gCdc.wakeFd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN)
+                    perror("Failed to read change stream wakeups");
+                pthread_mutex_lock(&gCdc.lock);
+                CdcSubscriber* added = gCdc.newSubscribers;
+                gCdc.newSubscribers = NULL;
+                pthread_mutex_unlock(&gCdc.lock);
+                for (; added != NULL; added = added->nextNew) {
+                    if (subscriberCount == capacity) {
+                        capacity = capacity ? 2 * capacity : 16;
+                        subscribers = realloc(subscribers, capacity * sizeof(CdcSubscriber*));
+                        if (subscribers == NULL) {
+                            perror("Failed to grow subscriber list");
+                            exit(1);
+                        }
+                    }
+                    struct epoll_event event = {.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET, .data.ptr = added};
+                    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, added->fd, &event) == -1)
+                        added->gone = 1;
+                    subscribers[subscriberCount++] = added;
+                }
+                continue;
+            }
+            uint32_t flags = events[i].events;
+            if (flags & EPOLLERR)
+                cdc_read_completions(subscriber);
+            if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+                // Subscribers have nothing more to say; anything read is dropped, and EOF ends them
+                char discard[MESSAGE_SIZE];
+                ssize_t received;
+                while ((received = recv(subscriber->fd, discard, sizeof(discard), MSG_DONTWAIT)) > 0)
+                    ;
+                if (received == 0 || (received < 0 && errno != EAGAIN && errno != EINTR))
+                    subscriber->gone = 1;
+            }
+            if (flags & EPOLLOUT)
+                subscriber->writable = 1;
+        }
+
+        // Everyone who can take more is sent what is new; the ones that left are let go
+        for (int i = subscriberCount - 1; i >= 0; i--) {
+            CdcSubscriber* subscriber = subscribers[i];
+            cdc_send(subscriber);
+            if (subscriber->gone) {
+                cdc_subscriber_close(subscriber);
+                subscribers[i] = subscribers[--subscriberCount];
+            }
+        }
+    }
+    return NULL;
+}
+
+void (*gModeHandlers[MODE_COUNT])(int) = {
+    handle_new_connections_simple,
+    handle_new_connections_threads,
+    handle_new_connections_thread_pool,
+    handle_new_connections_select,
+    handle_new_connections_poll,
+    handle_new_connections_epoll,
+};
+
+void* handle_unix_connections(void* arg) {
+    gModeHandlers[gMode]((int)(intptr_t)arg);
+    return NULL;
+}
+
+// The -b client: one BENCHMARK_MESSAGE byte round trip at a time to a running server
+
+int connect_unix(const char* path) {
+    struct sockaddr_un address;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || unix_socket_address(path, &address) == -1 ||
+        connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int connect_tcp(int port) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int socket_round_trip(int fd, char* message, size_t length) {
+    if (send_all(fd, message, length) == -1)
+        return -1;
+    for (size_t received = 0; received < length;) {
+        ssize_t n = recv(fd, message + received, length - received, 0);
+        if (n <= 0)
+            return -1;
+        received += n;
+    }
+    return 0;
+}
+
+int compare_int64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+void run_benchmark() {
+    int fd = -1;
+    ShmChannel* channel = NULL;
+    if (strcmp(gBenchmark, "tcp") == 0) {
+        fd = connect_tcp(gNetworkPort);
+    } else if (strcmp(gBenchmark, "unix") == 0 && gUnixPath != NULL) {
+        fd = connect_unix(gUnixPath);
+    } else if (strcmp(gBenchmark, "shm") == 0 && gShmPath != NULL) {
+        fd = connect_unix(gShmPath);
+        int memfd = fd == -1 ? -1 : receive_fd(fd);
+        if (memfd != -1) {
+            channel = map_channel(memfd);
+            close(memfd);
+        }
+        if (channel == NULL || channel->magic != SHM_MAGIC || channel->ringSize != SHM_RING_SIZE) {
+            fprintf(stderr, "Failed to set up shared memory channel\n");
+            exit(1);
+        }
+    } else {
+        fprintf(stderr, "-b needs tcp, unix with -u, or shm with -s\n");
+        exit(1);
+    }
+    if (fd == -1) {
+        perror("Failed to connect");
+        exit(1);
+    }
+
+    int64_t* times = malloc(gBenchmarkRounds * sizeof(int64_t));
+    if (times == NULL) {
+        perror("Failed to allocate round trip times");
+        exit(1);
+    }
+    char message[BENCHMARK_MESSAGE];
+    memset(message, 'x', sizeof(message));
+    int64_t benchmarkStartNs = monotonic_ns();
+    for (long i = 0; i < gBenchmarkRounds; i++) {
+        int64_t startNs = monotonic_ns();
+        int ok = channel != NULL
+                     ? shm_ring_write(&channel->requests, message, sizeof(message), fd) == 0 &&
+                           shm_ring_read(&channel->responses, message, sizeof(message), fd) == sizeof(message)
+                     : socket_round_trip(fd, message, sizeof(message)) == 0;
+        if (!ok) {
+            perror("Round trip failed");
+            exit(1);
+        }
+        times[i] = monotonic_ns() - startNs;
+    }
+    double seconds = (monotonic_ns() - benchmarkStartNs) / 1e9;
+
+    qsort(times, gBenchmarkRounds, sizeof(int64_t), compare_int64);
+    printf("%s: %ld round trips of %d bytes, p50 %.1f us, p99 %.1f us, %.0f round trips/s\n", gBenchmark,
+           gBenchmarkRounds, BENCHMARK_MESSAGE, times[gBenchmarkRounds / 2] / 1e3,
+           times[(long)(gBenchmarkRounds * 0.99)] / 1e3, gBenchmarkRounds / seconds);
+    free(times);
+    if (channel != NULL)
+        munmap(channel, sizeof(ShmChannel));
+    close(fd);
+}
+
+// Upper edge, in microseconds, of the bucket holding the given fraction of the counts
+unsigned long long latency_percentile(const unsigned long long* counts, unsigned long long total, double fraction) {
+    if (total == 0)
+        return 0;
+    unsigned long long rank = (unsigned long long)(fraction * (total - 1)) + 1, seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank)
+            return 1ULL << i;
+    }
+    return 1ULL << (LATENCY_BUCKETS - 1);
+}
+
+// Print the metrics for the interval since the previous call, the same line for every mode
+void print_metrics(double seconds) {
+    static unsigned long long lastMessages, lastReceived, lastSent, lastLatency[LATENCY_BUCKETS];
+    unsigned long long accepted = counter_total(COUNTER_ACCEPTED);
+    unsigned long long closed = counter_total(COUNTER_CLOSED);
+    unsigned long long messages = counter_total(COUNTER_MESSAGES);
+    unsigned long long received = counter_total(COUNTER_BYTES_RECEIVED);
+    unsigned long long sent = counter_total(COUNTER_BYTES_SENT);
+    unsigned long long latency[LATENCY_BUCKETS] = {0}, counts[LATENCY_BUCKETS], requests = 0;
+    for (MetricsShard* shard = atomic_load(&gShards); shard != NULL; shard = shard->next)
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+            latency[i] += atomic_load_explicit(&shard->latency[i], memory_order_relaxed);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        counts[i] = latency[i] - lastLatency[i];
+        lastLatency[i] = latency[i];
+        requests += counts[i];
+    }
+
+    printf("[%s] %llu open, %llu accepted, %llu errors; %llu messages (%.0f/s), %.1f KB in, %.1f KB out; "
+           "latency us p50 %llu p99 %llu\n",
+           gModeNames[gMode], accepted - closed, accepted, counter_total(COUNTER_ERRORS),
+           messages - lastMessages, (messages - lastMessages) / seconds, (received - lastReceived) / 1024.0,
+           (sent - lastSent) / 1024.0, latency_percentile(counts, requests, 0.5),
+           latency_percentile(counts, requests, 0.99));
+    fflush(stdout);
+    lastMessages = messages;
+    lastReceived = received;
+    lastSent = sent;
+}
+
+// Runs alongside the mode's own threads with SIGINT and SIGTERM blocked everywhere else: prints
+// the metrics every interval, and a last time before exiting when one of those signals arrives
+void* metrics_reporter(void* arg) {
+    sigset_t* signals = arg;
+    int64_t lastNs = monotonic_ns();
+    while (1) {
+        struct timespec timeout = {gMetricsInterval, 0};
+        int signal = sigtimedwait(signals, NULL, &timeout);
+        if (signal < 0 && errno == EINTR)
+            continue;
+        int64_t nowNs = monotonic_ns();
+        print_metrics((nowNs - lastNs) / 1e9);
+        lastNs = nowNs;
+        if (signal > 0) {
+            printf("Shutting down gracefully...\n");
+            exit(0);
+        }
+    }
+    return NULL;
+}
+
 int main(int argc, char* argv[]) {
     int listen_socket;
     // Parse command line arguments and environment variables
     read_environment_variables();
     parse_command_line_arguments(argc, argv);
 
+    // With a single CPU, polling a ring only keeps the other side from running
+    gShmSpin = get_nprocs() > 1 ? SHM_SPIN : 0;
+
+    if (gBenchmark != NULL) {
+        run_benchmark();
+        return 0;
+    }
+
     // Read data from file
     read_data_from_file();
 
     // Initialize server socket
     listen_socket = initialize_server_socket();
+    int unix_socket = gUnixPath != NULL ? initialize_unix_socket(gUnixPath) : -1;
+    int shm_socket = gShmPath != NULL ? initialize_unix_socket(gShmPath) : -1;
+    atexit(remove_unix_sockets);
+    printf("Handling connections in %s mode\n", gModeNames[gMode]);
+
+    // Every thread started from here on inherits the blocked signals, leaving them to the reporter
+    static sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    pthread_t reporter;
+    if (pthread_create(&reporter, NULL, metrics_reporter, &signals) != 0) {
+        perror("Failed to create metrics thread");
+        exit(1);
+    }
+
+    pthread_key_create(&gShardKey, release_shard);
+    gThresholdFd = eventfd(0, EFD_SEMAPHORE | EFD_CLOEXEC);
+    pthread_t watcher;
+    if (gThresholdFd == -1 || pthread_create(&watcher, NULL, threshold_watcher, NULL) != 0) {
+        perror("Failed to start message threshold watcher");
+        exit(1);
+    }
+
+    pthread_mutex_init(&gCdc.lock, NULL);
+    gCdc.capacity = gCdcCapacity;
+    gCdc.slots = calloc(gCdc.capacity, sizeof(CdcBatch*));
+    gCdc.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_t cdc_thread;
+    if (gCdc.slots == NULL || gCdc.wakeFd == -1 || pthread_create(&cdc_thread, NULL, cdc_sender, NULL) != 0) {
+        perror("Failed to start change stream sender");
+        exit(1);
+    }
+
+    pthread_t unix_thread, shm_thread;
+    if (unix_socket != -1 &&
+        pthread_create(&unix_thread, NULL, handle_unix_connections, (void*)(intptr_t)unix_socket) != 0) {
+        perror("Failed to create Unix socket thread");
+        exit(1);
+    }
+    if (shm_socket != -1 &&
+        pthread_create(&shm_thread, NULL, handle_shm_connections, (void*)(intptr_t)shm_socket) != 0) {
+        perror("Failed to create shared memory thread");
+        exit(1);
+    }
 
-    // Accept client connections and handle them in separate threads
-    handle_new_connections(listen_socket);
+    // Accept client connections and handle them the way the mode says
+    gModeHandlers[gMode](listen_socket);
 
     return 0;
 }
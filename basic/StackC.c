@@ -0,0 +1,474 @@
+/*
+    A lock-free stack (a "Treiber stack") for free lists and work pools shared between threads.
+
+    The Stack class in DataStructuresPython.py keeps its items in a list, and popMany(n) slices
+    the end off that list. Here the stack is a linked list of nodes, and the only shared state
+    is the pointer to the top node. push() and pop() change that pointer with a single
+    compare-and-swap (CAS), so no thread ever waits on a lock.
+
+    The classic problem with this design is ABA: thread 1 reads top = A (with A->next = B),
+    thread 2 pops A and B and pushes A back, and thread 1's CAS from A to B then succeeds even
+    though B is no longer on the stack. We avoid it the same way most free lists do: nodes live
+    in one preallocated array and are referred to by index, and the top of the stack is a
+    64-bit word holding a 32-bit index plus a 32-bit tag that changes on every update. A stale
+    CAS sees a different tag and fails. Because the node array is never freed, a thread that
+    reads a node which was popped a moment ago reads valid (if stale) memory, so no hazard
+    pointers are needed.
+
+    push_many() links all of its nodes into a chain first and attaches the whole chain with one
+    CAS, and pop_many() detaches up to n nodes with one CAS, so bulk operations cost the same
+    contention as single ones.
+
+    Under heavy contention a push and a pop that both failed their CAS can cancel each other
+    out in an "elimination array" instead of retrying on the top pointer: the pusher parks its
+    node in a random slot for a short time, and a popper that finds it takes the item directly.
+
+        gcc -O2 -pthread StackC.c -o stack
+        ./stack [threads]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define STACK_NULL 0                // node references are index + 1, so 0 means "no node"
+#define ELIMINATION_SLOTS 16
+#define ELIMINATION_SPINS 128
+
+typedef struct StackNode {
+    void* item;
+    _Atomic uint32_t next;
+} StackNode;
+
+typedef struct Stack {
+    _Alignas(64) _Atomic uint64_t top;      // tag << 32 | node reference
+    _Alignas(64) _Atomic uint64_t freeTop;  // unused nodes, kept as a second tagged stack
+    _Alignas(64) atomic_long count;
+    _Alignas(64) _Atomic uint64_t elimination[ELIMINATION_SLOTS];
+    StackNode* nodes;
+    uint32_t capacity;
+} Stack;
+
+// Elimination slot layout: tag (30 bits) | state (2 bits) | node reference (32 bits)
+#define SLOT_EMPTY 0
+#define SLOT_WAITING 1
+#define SLOT_TAKEN 2
+
+static inline uint64_t make_word(uint32_t tag, uint32_t ref) {
+    return ((uint64_t)tag << 32) | ref;
+}
+
+static inline uint32_t word_ref(uint64_t word) {
+    return (uint32_t)word;
+}
+
+static inline uint32_t word_tag(uint64_t word) {
+    return (uint32_t)(word >> 32);
+}
+
+static inline uint64_t make_slot(uint32_t tag, uint32_t state, uint32_t ref) {
+    return ((uint64_t)((tag << 2) | state) << 32) | ref;
+}
+
+static inline uint32_t slot_state(uint64_t slot) {
+    return (uint32_t)(slot >> 32) & 3;
+}
+
+static inline uint32_t slot_tag(uint64_t slot) {
+    return (uint32_t)(slot >> 34);
+}
+
+static inline StackNode* node_at(Stack* s, uint32_t ref) {
+    return &s->nodes[ref - 1];
+}
+
+static __thread unsigned int tStackRandomState = 0;
+
+static unsigned int stack_random() {
+    if (tStackRandomState == 0)
+        tStackRandomState = (unsigned int)(size_t)&tStackRandomState ^ (unsigned int)time(NULL) ^ 0x9E3779B9u;
+    tStackRandomState ^= tStackRandomState << 13;
+    tStackRandomState ^= tStackRandomState >> 17;
+    tStackRandomState ^= tStackRandomState << 5;
+    return tStackRandomState;
+}
+
+// Generic chain operations on a tagged top word
+
+// Attach the chain first..last (already linked through next) to the stack in one CAS
+static void chain_push(Stack* s, _Atomic uint64_t* top, uint32_t first, uint32_t last) {
+    uint64_t old = atomic_load_explicit(top, memory_order_acquire);
+    while (1) {
+        atomic_store_explicit(&node_at(s, last)->next, word_ref(old), memory_order_relaxed);
+        if (atomic_compare_exchange_weak_explicit(top, &old, make_word(word_tag(old) + 1, first),
+                                                  memory_order_release, memory_order_acquire))
+            return;
+    }
+}
+
+// Try once to detach up to n nodes; returns the first node of the detached chain and its length,
+// or STACK_NULL with *got = 0 if the stack is empty, or STACK_NULL with *got = -1 if the CAS lost a race
+static uint32_t chain_try_pop(Stack* s, _Atomic uint64_t* top, long n, long* got) {
+    uint64_t old = atomic_load_explicit(top, memory_order_acquire);
+    uint32_t first = word_ref(old);
+    if (first == STACK_NULL) {
+        *got = 0;
+        return STACK_NULL;
+    }
+
+    // Walk n nodes down; the nodes may be changing under us, but if the CAS below succeeds
+    // the tag proves nothing was pushed or popped while we walked, so the chain is valid
+    uint32_t ref = first;
+    long count = 1;
+    uint32_t next = atomic_load_explicit(&node_at(s, ref)->next, memory_order_relaxed);
+    while (count < n && next != STACK_NULL && next <= s->capacity) {
+        ref = next;
+        count++;
+        next = atomic_load_explicit(&node_at(s, ref)->next, memory_order_relaxed);
+    }
+    if (next > s->capacity) {
+        *got = -1;
+        return STACK_NULL;
+    }
+
+    if (!atomic_compare_exchange_strong_explicit(top, &old, make_word(word_tag(old) + 1, next),
+                                                 memory_order_acquire, memory_order_relaxed)) {
+        *got = -1;
+        return STACK_NULL;
+    }
+    atomic_store_explicit(&node_at(s, ref)->next, STACK_NULL, memory_order_relaxed);
+    *got = count;
+    return first;
+}
+
+static uint32_t chain_pop(Stack* s, _Atomic uint64_t* top, long n, long* got) {
+    while (1) {
+        uint32_t first = chain_try_pop(s, top, n, got);
+        if (*got >= 0)
+            return first;
+    }
+}
+
+// Stack implementation
+
+int stack_init(Stack* s, uint32_t capacity) {
+    s->nodes = calloc(capacity, sizeof(StackNode));
+    if (s->nodes == NULL)
+        return -1;
+    s->capacity = capacity;
+
+    // Every node starts out on the free list, already linked in order
+    for (uint32_t i = 0; i < capacity; i++)
+        atomic_init(&s->nodes[i].next, (i + 1 < capacity) ? i + 2 : STACK_NULL);
+    atomic_init(&s->freeTop, make_word(0, capacity ? 1 : STACK_NULL));
+    atomic_init(&s->top, make_word(0, STACK_NULL));
+    atomic_init(&s->count, 0);
+    for (int i = 0; i < ELIMINATION_SLOTS; i++)
+        atomic_init(&s->elimination[i], make_slot(0, SLOT_EMPTY, STACK_NULL));
+    return 0;
+}
+
+void stack_destroy(Stack* s) {
+    free(s->nodes);
+    s->nodes = NULL;
+    s->capacity = 0;
+}
+
+// Park a node in the elimination array for a popper to take; returns 1 if one took it
+static int eliminate_push(Stack* s, uint32_t ref) {
+    _Atomic uint64_t* slot = &s->elimination[stack_random() % ELIMINATION_SLOTS];
+    uint64_t old = atomic_load_explicit(slot, memory_order_acquire);
+    if (slot_state(old) != SLOT_EMPTY)
+        return 0;
+    uint32_t tag = slot_tag(old);
+    uint64_t waiting = make_slot(tag, SLOT_WAITING, ref);
+    if (!atomic_compare_exchange_strong_explicit(slot, &old, waiting, memory_order_release, memory_order_relaxed))
+        return 0;
+
+    for (int i = 0; i < ELIMINATION_SPINS; i++) {
+        if (atomic_load_explicit(slot, memory_order_acquire) != waiting)
+            break;
+    }
+
+    // Withdraw the offer; if that fails, a popper has taken the node
+    uint64_t expected = waiting;
+    if (atomic_compare_exchange_strong_explicit(slot, &expected, make_slot(tag + 1, SLOT_EMPTY, STACK_NULL),
+                                                memory_order_acq_rel, memory_order_acquire))
+        return 0;
+    atomic_store_explicit(slot, make_slot(tag + 1, SLOT_EMPTY, STACK_NULL), memory_order_release);
+    return 1;
+}
+
+// Take a node parked by a concurrent pusher; returns its reference or STACK_NULL
+static uint32_t eliminate_pop(Stack* s) {
+    _Atomic uint64_t* slot = &s->elimination[stack_random() % ELIMINATION_SLOTS];
+    uint64_t old = atomic_load_explicit(slot, memory_order_acquire);
+    if (slot_state(old) != SLOT_WAITING)
+        return STACK_NULL;
+    if (!atomic_compare_exchange_strong_explicit(slot, &old, make_slot(slot_tag(old), SLOT_TAKEN, word_ref(old)),
+                                                 memory_order_acq_rel, memory_order_relaxed))
+        return STACK_NULL;
+    return word_ref(old);
+}
+
+// Add item to stack; returns 0 on success or -1 if every node is in use
+int stack_push(Stack* s, void* item) {
+    long got;
+    uint32_t ref = chain_pop(s, &s->freeTop, 1, &got);
+    if (ref == STACK_NULL)
+        return -1;
+    node_at(s, ref)->item = item;
+    atomic_fetch_add_explicit(&s->count, 1, memory_order_relaxed);
+
+    uint64_t old = atomic_load_explicit(&s->top, memory_order_acquire);
+    while (1) {
+        atomic_store_explicit(&node_at(s, ref)->next, word_ref(old), memory_order_relaxed);
+        if (atomic_compare_exchange_strong_explicit(&s->top, &old, make_word(word_tag(old) + 1, ref),
+                                                    memory_order_release, memory_order_acquire))
+            return 0;
+        // Lost a race on the top pointer: try to hand the node straight to a popper instead
+        if (eliminate_push(s, ref))
+            return 0;
+        old = atomic_load_explicit(&s->top, memory_order_acquire);
+    }
+}
+
+// Remove last item from stack; returns 0 on success or -1 if the stack is empty
+int stack_pop(Stack* s, void** item) {
+    long got;
+    uint32_t ref;
+    while (1) {
+        ref = chain_try_pop(s, &s->top, 1, &got);
+        if (got == 0)
+            return -1;
+        if (got > 0)
+            break;
+        // Lost a race on the top pointer: try to take a node straight from a pusher instead
+        ref = eliminate_pop(s);
+        if (ref != STACK_NULL)
+            break;
+    }
+
+    *item = node_at(s, ref)->item;
+    atomic_fetch_sub_explicit(&s->count, 1, memory_order_relaxed);
+    chain_push(s, &s->freeTop, ref, ref);
+    return 0;
+}
+
+// Add n items in one CAS (items[n-1] ends up on top); returns 0 on success or -1 if there aren't n free nodes
+int stack_push_many(Stack* s, void* const* items, long n) {
+    if (n <= 0)
+        return 0;
+    long got;
+    uint32_t first = chain_pop(s, &s->freeTop, n, &got);
+    if (got < n) {
+        if (got > 0) {
+            uint32_t last = first;
+            for (long i = 1; i < got; i++)
+                last = atomic_load_explicit(&node_at(s, last)->next, memory_order_relaxed);
+            chain_push(s, &s->freeTop, first, last);
+        }
+        return -1;
+    }
+
+    // The chain from the free list is already linked; the first node will be the new top
+    uint32_t ref = first, last = first;
+    for (long i = n - 1; i >= 0; i--) {
+        node_at(s, ref)->item = items[i];
+        last = ref;
+        ref = atomic_load_explicit(&node_at(s, ref)->next, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&s->count, n, memory_order_relaxed);
+    chain_push(s, &s->top, first, last);
+    return 0;
+}
+
+// Remove the last n items in one CAS, oldest first (same order as Stack.popMany());
+// returns how many were removed, which is less than n if the stack had fewer items
+long stack_pop_many(Stack* s, void** items, long n) {
+    if (n <= 0)
+        return 0;
+    long got;
+    uint32_t first = chain_pop(s, &s->top, n, &got);
+    if (got == 0)
+        return 0;
+
+    uint32_t ref = first, last = first;
+    for (long i = got - 1; i >= 0; i--) {
+        items[i] = node_at(s, ref)->item;
+        last = ref;
+        ref = atomic_load_explicit(&node_at(s, ref)->next, memory_order_relaxed);
+    }
+    atomic_fetch_sub_explicit(&s->count, got, memory_order_relaxed);
+    chain_push(s, &s->freeTop, first, last);
+    return got;
+}
+
+long stack_len(Stack* s) {
+    return atomic_load_explicit(&s->count, memory_order_relaxed);
+}
+
+void stack_clear(Stack* s) {
+    long got;
+    uint32_t first = chain_pop(s, &s->top, (long)s->capacity, &got);
+    if (got == 0)
+        return;
+    uint32_t last = first;
+    for (long i = 1; i < got; i++)
+        last = atomic_load_explicit(&node_at(s, last)->next, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&s->count, got, memory_order_relaxed);
+    chain_push(s, &s->freeTop, first, last);
+}
+
+#ifndef DATASTRUCTURES_NO_MAIN
+// Benchmark and self-test code begins here
+
+#define OPS_PER_THREAD 1000000
+#define STACK_CAPACITY 65536
+
+typedef struct LockedStack {
+    void** items;
+    long count;
+    pthread_mutex_t lock;
+} LockedStack;
+
+typedef struct BenchmarkArgs {
+    void* stack;
+    int useLockFree;
+    int ops;
+} BenchmarkArgs;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Work-pool pattern: take a batch, give it back, take one, give it back
+static void* benchmark_thread(void* arg) {
+    BenchmarkArgs* args = (BenchmarkArgs*)arg;
+    void* batch[8];
+    for (int i = 0; i < args->ops; i++) {
+        if (args->useLockFree) {
+            Stack* s = (Stack*)args->stack;
+            long got = stack_pop_many(s, batch, 8);
+            stack_push_many(s, batch, got);
+            if (stack_pop(s, &batch[0]) == 0)
+                stack_push(s, batch[0]);
+        } else {
+            LockedStack* s = (LockedStack*)args->stack;
+            pthread_mutex_lock(&s->lock);
+            long got = s->count < 8 ? s->count : 8;
+            memcpy(batch, &s->items[s->count - got], got * sizeof(void*));
+            s->count -= got;
+            pthread_mutex_unlock(&s->lock);
+            pthread_mutex_lock(&s->lock);
+            memcpy(&s->items[s->count], batch, got * sizeof(void*));
+            s->count += got;
+            pthread_mutex_unlock(&s->lock);
+            pthread_mutex_lock(&s->lock);
+            if (s->count > 0)
+                batch[0] = s->items[--s->count];
+            pthread_mutex_unlock(&s->lock);
+            pthread_mutex_lock(&s->lock);
+            s->items[s->count++] = batch[0];
+            pthread_mutex_unlock(&s->lock);
+        }
+    }
+    return NULL;
+}
+
+static double run_throughput(void* stack, int useLockFree, int threads) {
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    BenchmarkArgs args = { stack, useLockFree, OPS_PER_THREAD / threads };
+
+    double start = now_seconds();
+    for (int i = 0; i < threads; i++)
+        pthread_create(&tids[i], NULL, benchmark_thread, &args);
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    double elapsed = now_seconds() - start;
+
+    free(tids);
+    return (4.0 * args.ops * threads) / elapsed;
+}
+
+static int self_test() {
+    // Same checks as TestStack in DataStructuresPython.py
+    Stack s;
+    void* item;
+    void* items[3];
+    int ok = 1;
+    stack_init(&s, 16);
+
+    stack_push(&s, "item1");
+    stack_push(&s, "item2");
+    ok = ok && stack_pop(&s, &item) == 0 && strcmp(item, "item2") == 0;
+    stack_clear(&s);
+
+    stack_push(&s, "item1");
+    stack_push(&s, "item2");
+    stack_push(&s, "item3");
+    ok = ok && stack_pop_many(&s, items, 2) == 2 && strcmp(items[0], "item2") == 0 && strcmp(items[1], "item3") == 0;
+
+    stack_push(&s, "item1");
+    stack_clear(&s);
+    ok = ok && stack_len(&s) == 0 && stack_pop(&s, &item) == -1;
+
+    // push_many/pop_many keep stack order, and running out of nodes is reported
+    void* many[4] = { "a", "b", "c", "d" };
+    ok = ok && stack_push_many(&s, many, 4) == 0 && stack_pop(&s, &item) == 0 && strcmp(item, "d") == 0;
+    ok = ok && stack_pop_many(&s, items, 5) == 3 && strcmp(items[0], "a") == 0 && strcmp(items[2], "c") == 0;
+    for (int i = 0; i < 16; i++)
+        ok = ok && stack_push(&s, "x") == 0;
+    ok = ok && stack_push(&s, "x") == -1 && stack_push_many(&s, many, 1) == -1;
+    stack_clear(&s);
+    ok = ok && stack_push_many(&s, many, 4) == 0 && stack_len(&s) == 4;
+
+    stack_destroy(&s);
+    return ok;
+}
+
+int main(int argc, char* argv[]) {
+    int maxThreads = (argc > 1) ? atoi(argv[1]) : 8;
+
+    if (!self_test()) {
+        fprintf(stderr, "Self test failed\n");
+        return 1;
+    }
+
+    printf("%8s %18s %18s\n", "threads", "locked ops/s", "lock-free ops/s");
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        Stack s;
+        LockedStack ls;
+        stack_init(&s, STACK_CAPACITY);
+        ls.items = malloc(STACK_CAPACITY * sizeof(void*));
+        ls.count = 0;
+        pthread_mutex_init(&ls.lock, NULL);
+        for (long i = 0; i < STACK_CAPACITY / 2; i++) {
+            stack_push(&s, (void*)i);
+            ls.items[ls.count++] = (void*)i;
+        }
+
+        double lockedOps = run_throughput(&ls, 0, threads);
+        double lockFreeOps = run_throughput(&s, 1, threads);
+        printf("%8d %18.0f %18.0f\n", threads, lockedOps, lockFreeOps);
+
+        // Nothing may be lost or duplicated under contention
+        if (stack_len(&s) != STACK_CAPACITY / 2) {
+            fprintf(stderr, "Lost items: %ld left on the stack\n", stack_len(&s));
+            return 1;
+        }
+
+        stack_destroy(&s);
+        free(ls.items);
+        pthread_mutex_destroy(&ls.lock);
+    }
+
+    return 0;
+}
+#endif